@@ -59,6 +59,95 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Word-at-a-time scanning. The storage is still a byte array (overlays point into mmap'd
+// blocks, so we don't get to pick the alignment), so words are pulled out with memcpy which
+// compiles down to a single unaligned load. Bit N of the bitmap ends up as bit N of the word.
+static inline uint64_t bitmap_load_word(const uint8_t *const data, const size_t bytes) 
+{
+    uint64_t word = 0;
+    memcpy(&word, data, bytes);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Skips whole words that match the pattern (all ones for ffz, all zeros for ffs)
+// Returns the index of the first word that might hold an answer
+typedef size_t (*bitmap_skip_t)(const uint8_t *const data, const size_t words, const uint64_t pattern);
+
+static size_t bitmap_skip_words(const uint8_t *const data, const size_t words, const uint64_t pattern) 
+{
+    size_t idx = 0;
+    for (; idx < words && bitmap_load_word(data + (idx << 3), 8) == pattern; ++idx) 
+    {
+    }
+    return idx;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+// Same thing, 256 bits per compare. Only picked when the CPU says it has AVX2.
+__attribute__((target("avx2")))
+static size_t bitmap_skip_words_avx2(const uint8_t *const data, const size_t words, const uint64_t pattern) 
+{
+    const __m256i match = _mm256_set1_epi64x((long long) pattern);
+    size_t idx = 0;
+    for (; idx + 4 <= words; idx += 4) 
+    {
+        const __m256i diff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (data + (idx << 3))), match);
+        if (!_mm256_testz_si256(diff, diff)) 
+        {
+            break;
+        }
+    }
+    // finish off (and pin down) whatever is left with the scalar version
+    return idx + bitmap_skip_words(data + (idx << 3), words - idx, pattern);
+}
+
+static bitmap_skip_t bitmap_pick_skip(void) 
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? bitmap_skip_words_avx2 : bitmap_skip_words;
+}
+#else
+static bitmap_skip_t bitmap_pick_skip(void) 
+{
+    return bitmap_skip_words;
+}
+#endif
+
+// Find the first bit that differs from the pattern (pattern of 0 is ffs, ~0 is ffz)
+static size_t bitmap_scan(const bitmap_t *const bitmap, const uint64_t pattern) 
+{
+    static bitmap_skip_t skip = NULL;
+    if (!skip) 
+    {
+        skip = bitmap_pick_skip();
+    }
+
+    const size_t full_words = bitmap->bit_count >> 6;
+    size_t idx = skip(bitmap->data, full_words, pattern);
+    if (idx < full_words) 
+    {
+        return (idx << 6) + __builtin_ctzll(bitmap_load_word(bitmap->data + (idx << 3), 8) ^ pattern);
+    }
+
+    // Partial word at the end, the bits past bit_count are undetermined so mask them off
+    const size_t tail_bits = bitmap->bit_count & 0x3F;
+    if (tail_bits) 
+    {
+        uint64_t word = bitmap_load_word(bitmap->data + (full_words << 3), bitmap->byte_count - (full_words << 3));
+        word = (word ^ pattern) & ((UINT64_C(1) << tail_bits) - 1);
+        if (word) 
+        {
+            return (full_words << 6) + __builtin_ctzll(word);
+        }
+    }
+    return SIZE_MAX;
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
     bitmap->data[bit >> 3] |= mask[bit & 0x07];
@@ -91,11 +180,7 @@ size_t bitmap_ffs(const bitmap_t *const bitmap)
 {
     if (bitmap) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
-        {
-        }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        return bitmap_scan(bitmap, 0);
     }
     return SIZE_MAX;
 }
@@ -104,11 +189,7 @@ size_t bitmap_ffz(const bitmap_t *const bitmap)
 {
     if (bitmap) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
-        {
-        }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        return bitmap_scan(bitmap, UINT64_MAX);
     }
     return SIZE_MAX;
 }
@@ -78,7 +78,7 @@ size_t block_store_allocate(block_store_t *const bs)
 {
     //UNUSED(bs);
     // error check parameters
-    if(!bs || !bs->block_data)
+    if(!bs)
         return SIZE_MAX;    // return size max on error
 
     // find first free bit with first zero of bitmap and set to block size
@@ -2,6 +2,7 @@
 #define _FS_H__
 
 #include <sys/types.h>
+#include <sys/uio.h>	// for struct iovec
 #include <dyn_array.h>
 
 #include <stdio.h>
@@ -43,6 +44,13 @@ typedef enum { FS_SEEK_SET, FS_SEEK_CUR, FS_SEEK_END } seek_t;
 
 typedef enum { FS_REGULAR, FS_DIRECTORY } file_t;
 
+// map_t is for fs_format_map, how regular files keep track of their blocks
+typedef enum { FS_MAP_POINTERS, FS_MAP_EXTENTS } map_t;
+
+// metadata journal reserved by fs_format, right after the inode bitmap (block 0) and the inode table (blocks 1-4)
+#define FS_JOURNAL_START 5
+#define FS_JOURNAL_BLOCKS 512
+
 #define FS_FNAME_MAX (127)
 // INCLUDING null terminator
 
@@ -53,6 +61,13 @@ typedef struct {
     file_t type;
 } file_record_t;
 
+typedef struct {
+    size_t inode;   // SIZE_MAX if the file doesn't exist
+    file_t type;
+    size_t size;    // in bytes
+    size_t links;
+} file_stat_t;
+
 ///
 /// Formats (and mounts) an FS file for use
 /// \param fname The file to format
@@ -60,6 +75,17 @@ typedef struct {
 ///
 FS_t *fs_format(const char *path);
 
+///
+/// Formats (and mounts) an FS file for use, picking how regular files map their blocks
+///   FS_MAP_POINTERS is the direct/indirect/double indirect layout fs_format uses
+///   FS_MAP_EXTENTS keeps (start, length) runs in a tree rooted in the inode, so large
+///   sequential files need next to no metadata lookups. The choice is kept across fs_mount
+/// \param path The file to format
+/// \param map How regular files map their blocks
+/// \return Mounted FS object, NULL on error
+///
+FS_t *fs_format_map(const char *path, map_t map);
+
 ///
 /// Mounts an FS object and prepares it for use
 /// \param fname The file to mount
@@ -86,6 +112,30 @@ int fs_unmount(FS_t *fs);
 ///
 int fs_create(FS_t *fs, const char *path, file_t type);
 
+///
+/// Creates a batch of files in one directory
+///   The directory is resolved once and the inodes for the whole batch are allocated in one pass
+/// \param fs The FS containing the directory
+/// \param path Absolute path to the directory
+/// \param names Filenames (not paths) of the files to create
+/// \param count Number of names
+/// \param type Type of the files to create (regular/directory)
+/// \return number of files created, stopping at the first name that can't be created, < 0 on error
+///
+ssize_t fs_create_many(FS_t *fs, const char *path, const char *const *names, size_t count, file_t type);
+
+///
+/// Looks up a batch of files in one directory
+///   The directory is resolved once, each name is one directory lookup
+/// \param fs The FS containing the directory
+/// \param path Absolute path to the directory
+/// \param names Filenames (not paths) of the files to look up
+/// \param count Number of names
+/// \param stats Filled in for each name, inode is SIZE_MAX for names that don't exist
+/// \return number of names found, < 0 on error
+///
+ssize_t fs_stat_many(FS_t *fs, const char *path, const char *const *names, size_t count, file_stat_t *stats);
+
 ///
 /// Opens the specified file for use
 ///   R/W position is set to the beginning of the file (BOF)
@@ -141,9 +191,77 @@ ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte);
 ///
 ssize_t fs_write(FS_t *fs, int fd, const void *src, size_t nbyte);
 
+///
+/// Reads data from the file linked to the given descriptor into several buffers
+///   Buffers are filled in order, as if fs_read was called once per buffer
+///   R/W position in incremented by the number of bytes read
+/// \param fs The FS containing the file
+/// \param fd The file to read from
+/// \param iov The buffers to write to
+/// \param iovcnt Number of buffers in iov
+/// \return number of bytes read (< total length IFF read passes EOF), < 0 on error
+///
+ssize_t fs_readv(FS_t *fs, int fd, const struct iovec *iov, int iovcnt);
+
+///
+/// Writes data from several buffers to the file linked to the descriptor
+///   Buffers are written in order, as if fs_write was called once per buffer
+///   R/W position in incremented by the number of bytes written
+/// \param fs The FS containing the file
+/// \param fd The file to write to
+/// \param iov The buffers to read from
+/// \param iovcnt Number of buffers in iov
+/// \return number of bytes written (< total length IFF out of space), < 0 on error
+///
+ssize_t fs_writev(FS_t *fs, int fd, const struct iovec *iov, int iovcnt);
+
+///
+/// Reads data from the file linked to the given descriptor at an absolute offset
+///   The R/W position of the descriptor is neither used nor changed
+///   Reading past EOF returns data up to EOF
+/// \param fs The FS containing the file
+/// \param fd The file to read from
+/// \param dst The buffer to write to
+/// \param nbyte The number of bytes to read
+/// \param offset Offset from BOF to start reading at
+/// \return number of bytes read (< nbyte IFF read passes EOF), < 0 on error
+///
+ssize_t fs_pread(FS_t *fs, int fd, void *dst, size_t nbyte, off_t offset);
+
+///
+/// Writes data to the file linked to the given descriptor at an absolute offset
+///   The R/W position of the descriptor is neither used nor changed
+///   Writing past EOF extends the file, the gap is left as a hole that reads as zeros
+///   and takes no blocks
+/// \param fs The FS containing the file
+/// \param fd The file to write to
+/// \param src The buffer to read from
+/// \param nbyte The number of bytes to write
+/// \param offset Offset from BOF to start writing at
+/// \return number of bytes written (< nbyte IFF out of space), < 0 on error
+///
+ssize_t fs_pwrite(FS_t *fs, int fd, const void *src, size_t nbyte, off_t offset);
+
+///
+/// Writes everything the FS is holding in memory back to the backing file
+/// \param fs The FS to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_sync(FS_t *fs);
+
+///
+/// Waits for the data written to a file to reach the backing file, only the blocks of
+/// that file written since they were last synced go out, along with its metadata
+/// \param fs The FS containing the file
+/// \param fd The file to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_fsync(FS_t *fs, int fd);
+
 ///
 /// Deletes the specified file and closes all open descriptors to the file
 ///   Directories can only be removed when empty
+///   The blocks and the inode are freed in the background once the last link to the file is gone
 /// \param fs The FS containing the file
 /// \param path Absolute path to file to remove
 /// \return 0 on success, < 0 on error
@@ -152,7 +270,7 @@ int fs_remove(FS_t *fs, const char *path);
 
 ///
 /// Populates a dyn_array with information about the files in a directory
-///   Array contains up to 15 file_record_t structures
+///   Array contains one file_record_t structure per directory entry
 /// \param fs The FS containing the file
 /// \param path Absolute path to the directory to inspect
 /// \return dyn_array of file records, NULL on error
@@ -161,6 +279,7 @@ dyn_array_t *fs_get_dir(FS_t *fs, const char *path);
 
 /// Moves the file from one location to the other
 ///   Moving files does not affect open descriptors
+///   Only the two directory entries change, no data is copied
 /// \param fs The FS containing the file
 /// \param src Absolute path of the file to move
 /// \param dst Absolute path to move the file to
@@ -170,6 +289,7 @@ int fs_move(FS_t *fs, const char *src, const char *dst);
 
 /// Link the dst with the src
 /// dst and src should be in the same File type, say, both are files or both are directories
+/// dst is another directory entry for the inode of src, its linkCount goes up by one
 /// \param fs The F18FS containing the file
 /// \param src Absolute path of the source file
 /// \param dst Absolute path to link the source to
@@ -189,13 +309,51 @@ int fs_link(FS_t *fs, const char *src, const char *dst);
 bool isValidFileName(const char *filename);
 
 ///
-/// Used to decompose the input string into filenames along the path, '/'
-/// \param a_str input filename path
-/// \param a_delim delimitor split in filename path
-/// \param count elements extracted from path
-/// \return result of path with tokens
+/// Checks if a name of the given length is a valid filename, the name doesn't need to be terminated
+/// \param name start of the name
+/// \param len length of the name
+/// \return true if valid, else false
 ///
-char** str_split(char* a_str, const char a_delim, size_t * count);
+bool isValidName(const char *name, size_t len);
+
+///
+/// Step to the next filename along a path. The path is walked in place, nothing is copied
+/// \param cursor position in the path, just past a '/'. Moved past the filename, NULL after the last one
+/// \param len length of the filename
+/// \return start of the filename, NULL once the path is used up
+///
+const char* path_next(const char **cursor, size_t *len);
+
+///
+/// Resolve an absolute path to an inode, one dir_lookup per filename
+/// \param fs File system
+/// \param path absolute path
+/// \param last if not NULL, the last filename isn't looked up, it is handed back here and its directory is returned
+/// \param last_len length of the last filename
+/// \return inode of the file (or of its directory), SIZE_MAX if the path is invalid or doesn't exist
+///
+size_t resolve_path(FS_t *fs, const char *path, const char **last, size_t *last_len);
+
+///
+/// Checks whether an inode is the given file or, for a directory, anywhere below it
+/// \param fs File system, rename_lock held
+/// \param top inode to search from
+/// \param inode_ID inode to look for
+/// \return true if inode_ID is top or in its subtree
+///
+bool subtree_contains(FS_t *fs, size_t top, size_t inode_ID);
+
+///
+/// Create a file in a directory, using an inode the caller already allocated
+/// \param fs File system
+/// \param parent_inode_ID inode of the directory
+/// \param name the new filename, not terminated
+/// \param name_len length of the filename
+/// \param type Type of file to create (regular/directory)
+/// \param child_inode_ID allocated inode for the new file, left allocated on failure
+/// \return 0 on success, < 0 if the name is taken or the directory can't hold it
+///
+int create_entry(FS_t *fs, size_t parent_inode_ID, const char *name, size_t name_len, file_t type, size_t child_inode_ID);
 
 ///
 /// Read direct block pointers
@@ -271,6 +429,78 @@ ssize_t write_indirect_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t
 ///
 ssize_t write_double_direct_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, const void *src, size_t nbyte);
 
+///
+/// Read from the file starting at the given block position
+/// \param fs File system
+/// \param inode source to be read from
+/// \param fd_loc file directory locator
+/// \param fd_off file directory locator offset
+/// \param dst destination to write to
+/// \param nbyte bytes to read
+/// \return bytes read, else 0
+///
+ssize_t read_from_position(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, void *dst, size_t nbyte);
+
+///
+/// Write to the file starting at the given block position
+/// \param fs File system
+/// \param inode destination to write to
+/// \param fd_loc fd locator
+/// \param fd_off fd offset
+/// \param src source to be written
+/// \param nbyte bytes to write
+/// \return written, else 0
+///
+ssize_t write_to_position(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, const void *src, size_t nbyte);
+
+///
+/// Read from an extent mapped file starting at the given block position, one tree lookup per extent
+/// \param fs File system
+/// \param inode source to be read from
+/// \param fd_loc file block to start at
+/// \param fd_off offset within that block
+/// \param dst destination to write to
+/// \param nbyte bytes to read
+/// \return bytes read
+///
+ssize_t read_extents(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, void *dst, size_t nbyte);
+
+///
+/// Wait for the blocks of a regular file written since they were last synced to reach the backing file
+/// \param fs File system
+/// \param inode the file, the caller holds its lock
+/// \param metadata whether the blocks that map the file (indirect blocks, extent tree nodes) go too
+/// \return number of blocks synced, < 0 on error
+///
+ssize_t file_sync_blocks(FS_t* fs, const inode_t* inode, bool metadata);
+
+///
+/// Wait for the inode bitmap, the inode table and the free block map to reach the backing file.
+/// They are written without going through the whole store, so they aren't tracked as dirty
+/// \param fs File system
+/// \return 0 on success, < 0 on error
+///
+int store_sync_metadata(FS_t* fs);
+
+///
+/// Wait for every block written since it was last synced to reach the backing file, see store_sync_metadata
+/// \param fs File system
+/// \return 0 on success, < 0 on error
+///
+int store_sync(FS_t* fs);
+
+///
+/// Write to an extent mapped file starting at the given block position
+/// \param fs File system
+/// \param inode destination to write to
+/// \param fd_loc file block to start at
+/// \param fd_off offset within that block
+/// \param src source to be written
+/// \param nbyte bytes to write
+/// \return bytes written (< nbyte IFF out of space)
+///
+ssize_t write_extents(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, const void *src, size_t nbyte);
+
 ///
 /// Update file directory
 /// \param fd file descriptor
@@ -278,6 +508,13 @@ ssize_t write_double_direct_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uin
 /// 
 void updateFD(fileDescriptor_t* fd, ssize_t nbyte);
 
+///
+/// Set the file descriptor to the given byte offset
+/// \param fd file descriptor
+/// \param offset offset from BOF
+///
+void setFDPosition(fileDescriptor_t* fd, off_t offset);
+
 ///
 /// Allocate space for indirect pointer block
 /// \param fs File system
@@ -286,10 +523,315 @@ void updateFD(fileDescriptor_t* fd, ssize_t nbyte);
 size_t allocate_indirectPtr_block(FS_t* fs);
 
 ///
-/// Get previous file directory offset
+/// Allocate a data block, preferring the one right after the previous block of the file
+/// \param fs File system
+/// \param prev_block block id of the previous block in the file, 0 if there is none
+/// \return allocated block id, SIZE_MAX on error
+///
+size_t allocate_data_block(FS_t* fs, size_t prev_block);
+
+///
+/// Reserve the blocks a write will add past the end of the file as one contiguous extent
+/// \param fs File system
+/// \param pos byte offset the write starts at
+/// \param nbyte bytes to be written
+/// \param file_size current size of the file in bytes
+///
+void reserve_write_extent(FS_t* fs, off_t pos, size_t nbyte, size_t file_size);
+
+///
+/// Hand back whatever is left of the extent reserved for a write
+/// \param fs File system
+///
+void release_write_extent(FS_t* fs);
+
+///
+/// Get previous file directory offset, the inverse of setFDPosition
 /// \param fd file descriptor to find offset
 /// \return offset result
 /// 
 off_t getPrevOffset(fileDescriptor_t* fileDescriptor);
 
+///
+/// Get an inode from the inode cache, reading it from the inode store the first time.
+/// Changes are made in place, call inode_mark_dirty after changing it
+/// \param fs File system
+/// \param inode_id inode to get
+/// \return the cached inode, valid until the FS is unmounted, NULL on error
+///
+inode_t* inode_get(FS_t* fs, size_t inode_id);
+
+///
+/// Pin an inode for an open descriptor
+/// \param fs File system
+/// \param inode_id inode to pin
+/// \return the cached inode, NULL on error
+///
+inode_t* inode_pin(FS_t* fs, size_t inode_id);
+
+///
+/// Drop a pin taken by inode_pin, the inode is written back once the last pin is gone
+/// \param fs File system
+/// \param inode_id inode to unpin
+///
+void inode_unpin(FS_t* fs, size_t inode_id);
+
+///
+/// Note that a cached inode was changed and has to be written back
+/// \param fs File system
+/// \param inode_id changed inode
+///
+void inode_mark_dirty(FS_t* fs, size_t inode_id);
+
+///
+/// Write a cached inode back to the inode store if it is dirty.
+/// The caller holds the inode's lock, a read lock is enough
+/// \param fs File system
+/// \param inode_id inode to write back
+///
+void inode_flush(FS_t* fs, size_t inode_id);
+
+///
+/// Write every dirty cached inode back to the inode store
+/// \param fs File system
+///
+void inode_cache_flush(FS_t* fs);
+
+///
+/// Lock an inode. A read lock is enough to read the inode and the blocks it maps,
+/// anything that changes either takes the write lock
+/// \param fs File system
+/// \param inode_id inode to lock
+/// \param write true for the write lock
+///
+void inode_lock(FS_t* fs, size_t inode_id, bool write);
+
+///
+/// Unlock an inode locked by inode_lock
+/// \param fs File system
+/// \param inode_id inode to unlock
+///
+void inode_unlock(FS_t* fs, size_t inode_id);
+
+///
+/// Write lock several inodes, in ascending inode number so two calls over overlapping sets can't wait on each other
+/// \param fs File system
+/// \param ids inodes to lock, sorted in place. An inode listed twice is locked once
+/// \param count number of inodes, a handful at most
+///
+void inode_lock_set(FS_t* fs, size_t* ids, size_t count);
+
+///
+/// Unlock the inodes locked by inode_lock_set
+/// \param fs File system
+/// \param ids inodes as inode_lock_set left them
+/// \param count number of inodes
+///
+void inode_unlock_set(FS_t* fs, const size_t* ids, size_t count);
+
+///
+/// Set up the locks of a new FS_t, apart from the ones reclaim_start looks after
+/// \param fs File system
+///
+void lock_init(FS_t* fs);
+
+///
+/// Tear down the locks set up by lock_init
+/// \param fs File system
+///
+void lock_destroy(FS_t* fs);
+
+///
+/// Remember what a name in a directory refers to
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \param inode_id inode the name refers to, SIZE_MAX if the name doesn't exist
+///
+void dentry_insert(FS_t* fs, size_t parent_id, const char* name, size_t len, size_t inode_id);
+
+///
+/// Forget a name in a directory, for when the directory entry is changed or removed
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+///
+void dentry_invalidate(FS_t* fs, size_t parent_id, const char* name, size_t len);
+
+///
+/// Look a name up in a directory, through the dentry cache
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return inode of the file, SIZE_MAX if it doesn't exist or parent_id isn't a directory
+///
+size_t dir_lookup(FS_t* fs, size_t parent_id, const char* name, size_t len);
+
+///
+/// dir_lookup for a caller already holding the directory's lock
+/// \param fs File system
+/// \param parent_id inode of the directory, locked
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return inode of the file, SIZE_MAX if it doesn't exist or parent_id isn't a directory
+///
+size_t dir_lookup_locked(FS_t* fs, size_t parent_id, const char* name, size_t len);
+
+///
+/// Add a name to a directory. The name must not be in the directory already
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \param inode_id inode the name refers to
+/// \return 0 on success, < 0 if parent_id isn't a directory or the directory can't grow
+///
+int dir_add_entry(FS_t* fs, size_t parent_id, const char* name, size_t len, size_t inode_id);
+
+///
+/// Take a name out of a directory
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return inode the name referred to, SIZE_MAX if it wasn't in the directory
+///
+size_t dir_remove_entry(FS_t* fs, size_t parent_id, const char* name, size_t len);
+
+///
+/// Rewrite the directories of an image formatted before they were hashed into index and leaf blocks,
+/// for fs_mount. Such an image is told apart by its root inode, whose mapType is still 0
+/// \param fs File system
+/// \return 0 on success or if there was nothing to rewrite, < 0 if the image can't be rewritten
+///
+int dir_upgrade(FS_t* fs);
+
+///
+/// Reclaim an orphan all the way, on the calling thread
+/// \param fs File system
+/// \param inode_id orphaned inode
+///
+void reclaim_inode(FS_t* fs, size_t inode_id);
+
+///
+/// Reclaim every orphan left in the inode store, for fs_mount before anything else can happen
+/// \param fs File system
+///
+void reclaim_recover(FS_t* fs);
+
+///
+/// Set up the locks and start the reclaimer thread
+/// \param fs File system
+///
+void reclaim_start(FS_t* fs);
+
+///
+/// Stop the reclaimer thread once the orphan list is empty and tear down the locks
+/// \param fs File system
+///
+void reclaim_stop(FS_t* fs);
+
+///
+/// Hand an orphan to the reclaimer thread
+/// \param fs File system
+/// \param inode_id orphaned inode, linkCount 0 in the inode store
+///
+void reclaim_queue(FS_t* fs, size_t inode_id);
+
+///
+/// Wait for the reclaimer to empty the orphan list, with its rate limit off
+/// \param fs File system
+/// \return true if there were orphans, so trying again may work
+///
+bool reclaim_drain(FS_t* fs);
+
+///
+/// Allocate an inode, waiting on the reclaimer if removed files are holding the last ones
+/// \param fs File system
+/// \return inode id, SIZE_MAX if there are none left
+///
+size_t inode_allocate(FS_t* fs);
+
+///
+/// Give back an inode that was allocated but never used
+/// \param fs File system
+/// \param inode_id inode to release
+///
+void inode_release(FS_t* fs, size_t inode_id);
+
+///
+/// Reserve the journal area of a new FS and write its header
+/// \param fs File system, formatted up to the inode table
+///
+void journal_format(FS_t* fs);
+
+///
+/// Find the journal of a freshly opened store and put back every transaction committed to it,
+/// in order, stopping at the first one that is missing or torn. For fs_mount before anything
+/// is read from the store. Only the journal is read, however big the FS is
+/// \param fs File system
+/// \return true if anything was put back, the free block map has changed under the store
+///
+bool journal_replay(FS_t* fs);
+
+///
+/// Set up the journal of a mounted FS and start the committer thread
+/// \param fs File system, after journal_format or journal_replay
+///
+void journal_start(FS_t* fs);
+
+///
+/// Stop the committer thread, commit what is left and empty the journal, for fs_unmount
+/// \param fs File system
+///
+void journal_stop(FS_t* fs);
+
+///
+/// Start a call that may change metadata, waiting out a commit in progress or about to start.
+/// Taken before any other lock, calls nested on the same thread only count once
+/// \param fs File system
+/// \param reclaimer true for the reclaimer thread, which calls in progress may be waiting on
+///
+void journal_enter(FS_t* fs, bool reclaimer);
+
+///
+/// End a call started by journal_enter
+/// \param fs File system
+///
+void journal_exit(FS_t* fs);
+
+///
+/// Note that a metadata block changed, once the change is made. It goes in the next
+/// transaction, and the next fs_sync syncs it like blocks written with block_store_write
+/// \param fs File system
+/// \param block_id changed block
+///
+void journal_dirty(FS_t* fs, size_t block_id);
+
+///
+/// journal_dirty for whatever block a pointer is in, pointers outside the store are left alone
+/// \param fs File system
+/// \param ptr pointer into a block
+///
+void journal_dirty_ptr(FS_t* fs, const void* ptr);
+
+///
+/// Note that blocks were freed, so no image of them in the journal is put back over their next owner
+/// \param fs File system
+/// \param start first freed block
+/// \param count number of blocks
+///
+void journal_free(FS_t* fs, size_t start, size_t count);
+
+///
+/// Commit every change made so far as one transaction, once it returns the changes survive a crash
+/// \param fs File system
+/// \param data whether every block written since the last sync is synced too, while nothing can write
+/// \return 0 on success, < 0 on error
+///
+int journal_commit(FS_t* fs, bool data);
+
 #endif
@@ -19,6 +19,7 @@ typedef struct bitmap bitmap_t;
 
 ///
 /// Sets requested bit in bitmap
+///  set, reset, flip, the ranges and the claims are atomic, threads can share a bitmap without a lock
 /// \param bitmap The bitmap
 /// \param bit The bit to set
 ///
@@ -66,6 +67,65 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first zero at or after a given bit (does not wrap around)
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from
+/// \return The first zero bit address >= start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first run of zeros at or after a given bit (does not wrap around)
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from
+/// \param count The length of the run
+/// \return The first bit of the run, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Sets a bit if it is clear, atomically
+/// \param bitmap The bitmap
+/// \param bit The bit to claim
+/// \return true if this call set it, false if it was already set
+///
+bool bitmap_claim(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Find first zero at or after a given bit, wrapping around to the front, and set it atomically
+///  (a 64 bit compare-and-swap on its word, concurrent claims never get the same bit)
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from (out of range starts at 0)
+/// \return The bit claimed, SIZE_MAX on error/none free
+///
+size_t bitmap_claim_from(bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first run of zeros at or after a given bit (does not wrap around) and set it atomically
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from
+/// \param count The length of the run
+/// \return The first bit of the run claimed, SIZE_MAX on error/not found
+///
+size_t bitmap_claim_run(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Sets a range of bits
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears a range of bits
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
@@ -133,6 +193,8 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
 ///  and does not free this pointer on destruction
+///  The free bit index is built from the data once, so after this
+///  the memory should only be changed through the bitmap functions
 /// \param n_bits The number of bits in the bitmap
 /// \param bitmap_data The data to import
 /// \return New bitmap pointer, NULL on error
@@ -42,17 +42,43 @@ extern "C"
     ///
     /// Destroys the provided block storage device
     /// This is an idempotent operation, so there is no return value
+    ///  Blocks still waiting in the threads' magazines go back to the free block map first
     /// \param bs BS device
     ///
     void block_store_destroy(block_store_t *const bs);
 
     ///
     /// Searches for a free block, marks it as in use, and returns the block's id
+    ///  Next fit from the store's cursor, through the calling thread's magazine like block_store_allocate_near
     /// \param bs BS device
     /// \return Allocated block's id, SIZE_MAX on error
     ///
     size_t block_store_allocate(block_store_t *const bs);
 
+    ///
+    /// Marks a free block as in use and returns its id: the hint itself if it is free, so the blocks
+    ///  of a file (the hint being the block after its last one) stay next to each other.
+    ///  Otherwise the next block of the calling thread's magazine, a run of 64 claimed from the free
+    ///  block map at once. When it is empty it is refilled with a run at or after the hint (wrapping
+    ///  around), so the block handed out is only near the hint when the magazine was empty.
+    ///  A thread's magazine is returned to the map when the thread exits, or for all of them when
+    ///  the store runs dry, block_store_flush_magazines is called or it is destroyed
+    /// \param bs BS device
+    /// \param hint Preferred block id, out of range means no preference (continue from this thread's last
+    ///  allocation, each thread starting at a different part of the store)
+    /// \return Allocated block's id, SIZE_MAX on error
+    ///
+    size_t block_store_allocate_near(block_store_t *const bs, const size_t hint);
+
+    ///
+    /// Searches for a run of contiguous free blocks and marks all of them as in use
+    /// \param bs BS device
+    /// \param count Number of blocks in the run
+    /// \param start Set to the first block id of the run
+    /// \return true if the run was allocated, false on error or if no run is long enough
+    ///
+    bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const start);
+
     ///
     /// Attempts to allocate the requested block id
     /// \param bs the block store object
@@ -63,13 +89,30 @@ extern "C"
 
     ///
     /// Frees the specified block
+    ///  It goes into the calling thread's magazine while there's room, to be handed out again first.
+    ///  Releasing a block that is already waiting in a magazine (of any thread) does nothing
     /// \param bs BS device
     /// \param block_id The block to free
     ///
     void block_store_release(block_store_t *const bs, const size_t block_id);
 
     ///
-    /// Counts the number of blocks marked as in use
+    /// Frees a run of contiguous blocks
+    /// \param bs BS device
+    /// \param start The first block to free
+    /// \param count Number of blocks to free
+    ///
+    void block_store_release_extent(block_store_t *const bs, const size_t start, const size_t count);
+
+    ///
+    /// Returns the blocks waiting in every thread's magazine to the free block map. They are set in
+    ///  the map while they wait, so this is for callers about to save the map as it should be after a crash
+    /// \param bs BS device
+    ///
+    void block_store_flush_magazines(block_store_t *const bs);
+
+    ///
+    /// Counts the number of blocks marked as in use (blocks waiting in magazines are free)
     /// \param bs BS device
     /// \return Total blocks in use, SIZE_MAX on error
     ///
@@ -107,6 +150,57 @@ extern "C"
     ///
     size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+    ///
+    /// Borrows a pointer to the specified block inside the mapping, so callers can
+    /// copy straight to/from it instead of going through a block sized buffer.
+    /// The pointer stays valid until the store is destroyed, writes through it land in the file.
+    /// Writes through it are only tracked for block_store_sync_dirty once the caller
+    /// passes the blocks to block_store_mark_dirty.
+    /// \param bs BS device
+    /// \param block_id Block id to borrow
+    /// \return Pointer to the first byte of the block, NULL on error
+    ///
+    uint8_t *block_store_get_ptr(block_store_t *const bs, const size_t block_id);
+
+    ///
+    /// Read-only version of block_store_get_ptr
+    /// \param bs BS device
+    /// \param block_id Block id to borrow
+    /// \return Pointer to the first byte of the block, NULL on error
+    ///
+    const uint8_t *block_store_get_const_ptr(const block_store_t *const bs, const size_t block_id);
+
+    ///
+    /// Waits for a range of blocks to reach the backing file. Writes land in the mapping
+    /// and go out whenever the kernel gets to them, this is for callers that have to know they made it
+    /// \param bs BS device
+    /// \param start First block to sync, the FBM blocks can be synced too
+    /// \param count Number of blocks
+    /// \return true on success, false on error
+    ///
+    bool block_store_sync(block_store_t *const bs, const size_t start, const size_t count);
+
+    ///
+    /// Notes that blocks were written through a pointer from block_store_get_ptr, for block_store_sync_dirty.
+    /// Called once the write is done, block_store_write and block_store_n_write do it themselves
+    /// \param bs BS device
+    /// \param block_id First block written
+    /// \param count Number of blocks
+    ///
+    void block_store_mark_dirty(block_store_t *const bs, const size_t block_id, const size_t count);
+
+    ///
+    /// Waits for the blocks of a range that were written (block_store_write, block_store_n_write or
+    /// block_store_mark_dirty) since they were last synced to reach the backing file, one msync per run of them.
+    /// A block written while this runs may or may not be synced by it, callers that need it synced
+    /// have to keep its writers out
+    /// \param bs BS device
+    /// \param start First block of the range
+    /// \param count Number of blocks in the range
+    /// \return Number of blocks synced, SIZE_MAX on error
+    ///
+    size_t block_store_sync_dirty(block_store_t *const bs, const size_t start, const size_t count);
+
     ///
     /// Imports BS device from the given file - for grads/bonus
     /// \param filename The file to load
@@ -147,6 +241,10 @@ extern "C"
     // Used for the blockstores of the inode table and file descriptor table.
     size_t block_store_sub_allocate(block_store_t *const bs);
 
+    // allocate up to count ids in one pass over the bitmap, returns how many were allocated.
+    // Used for the blockstores of the inode table and file descriptor table.
+    size_t block_store_sub_allocate_many(block_store_t *const bs, const size_t count, size_t *const ids);
+
     // test if a certain block is available.
     // Used for the blockstores of the inode table and file descriptor table.
     bool block_store_sub_test(block_store_t *const bs, const size_t block_id);
@@ -170,6 +268,9 @@ extern "C"
     // reads from data buffer and writes n bytes into block
     size_t block_store_n_write(block_store_t *const bs, const size_t block_id, size_t offset, const void *buffer, size_t bytes);
 
+    // reads n bytes from block at offset into data buffer
+    size_t block_store_n_read(const block_store_t *const bs, const size_t block_id, size_t offset, void *buffer, size_t bytes);
+
     /// block store test if in use
     bool block_store_test(block_store_t *const bs, const size_t block_id);
 
@@ -1,3 +1,8 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
 #include "dyn_array.h"
 #include "bitmap.h"
 #include "block_store.h"
@@ -16,13 +21,58 @@
 #define number_fd 256
 #define fd_size 6    // any number as you see fit
 
-#define folder_number_entries 31
+#define folder_number_entries 31    // entries in one directory leaf block, slot 0 of the block holds the leaf header
+#define dir_leaf_full ((1u << folder_number_entries) - 1)
+#define dir_index_max 511           // leaves one directory index block can point to
+
+#define dentry_cache_size 1024      // slots in the dentry cache, must be a power of 2
+#define dentry_name_max 32          // isValidFileName caps names at 31 characters
+#define dentry_negative UINT16_MAX  // dentry inode for a name known not to exist
+#define dentry_lock_count 64        // dentry cache slots are guarded by one of this many locks, by slot number
+
+#define reclaim_blocks_per_tick 2048    // the reclaimer frees about this many blocks,
+#define reclaim_tick_ns 1000000         // then sleeps this long before carrying on
+
+// stages of reclaim_step, in the order the blocks of an orphan are freed
+#define reclaim_stage_direct 0
+#define reclaim_stage_indirect 1
+#define reclaim_stage_double 2          // one stage per double indirect entry
+#define reclaim_stage_inode (reclaim_stage_double + NUM_DOUBLE_DIRECT_PTR)
+
+#define extent_root_entries 2           // extent tree entries that fit in place of the block pointers of an inode
+#define extent_node_entries 681         // extent tree entries in one block
+#define extent_logical_end (UINT16_MAX + 1)  // first file block past what a 16 bit block number can address
+
+#define inline_data_max 32              // bytes a regular file keeps in its inode, see inline_at
+#define inline_head 16                  // of those, the ones in owner. The rest are in the block pointers
+
+#define journal_commit_s 5              // the committer thread commits at least this often, fs_sync commits on the spot
+#define journal_commit_blocks 128       // a transaction this big is committed without waiting out journal_commit_s
+#define journal_tx_max (FS_JOURNAL_BLOCKS - 3)  // images one transaction can hold, next to the header, its descriptor and commit block
+#define journal_checkpoint_room (2 * journal_commit_blocks)  // the journal is emptied after a commit that leaves less room than this
+#define journal_header_magic 0x4A484452u
+#define journal_descriptor_magic 0x4A445343u
+#define journal_commit_magic 0x4A434D54u
+
+// source for zero filling part of a block with block_store_n_write
+static const uint8_t zero_block[BLOCK_SIZE_BYTES];
+
+// blocks reserved up front by the write in progress on this thread, handed out by allocate_data_block.
+// A write holds the file's lock, so one reservation per thread is all there can be
+static __thread size_t write_extent_start;
+static __thread size_t write_extent_count;
+
+// journal_enter calls this thread is inside, only the outermost one counts
+static __thread size_t journal_depth;
 
 // Inode Struct
 struct inode 
 {
-    uint32_t vacantFile;    // this parameter is only for directory. Used as a bitmap denoting availibility of entries in a directory file.
-    char owner[18];         // for alignment purpose only 
+    uint32_t dirEntries;    // this parameter is only for directory. Number of entries in the directory.
+    char owner[17];         // for alignment purpose only. The first inline_head bytes of a tiny file's data are kept here
+    char mapType;           // for a regular file 'i' while its data is inline, 'e' once mapped by extents (see read_extents),
+                            // block pointers otherwise. The root's records the map picked at fs_format_map,
+                            // it is 0 in an image whose directories aren't hashed yet (see dir_upgrade)
     char fileType;          // 'r' denotes regular file, 'd' denotes directory file
 
     size_t inodeNumber;         // for FS, the range should be 0-255
@@ -51,11 +101,154 @@ struct directoryFile {
     uint8_t inodeNumber;
 };
 
+// Header of a directory leaf block, it takes the place of entry slot 0 (same size as a directoryFile_t).
+// The hashes are kept here so a lookup only compares the names whose hash matches
+typedef struct dirLeafHeader {
+    uint32_t used;                          // bitmap of the entries in use, bit k is entry slot k + 1
+    uint32_t hash[folder_number_entries];   // dir_hash of the name in each entry
+} dirLeafHeader_t;
+
+// Entry of a directory index block. The leaf holds the names hashing from hash up to the hash of the next entry
+typedef struct dirIndexEntry {
+    uint32_t hash;
+    uint16_t block;
+    uint16_t unused;
+} dirIndexEntry_t;
+
+// Directory index block, kept in directPointer[0] of a directory. Entries are sorted by hash, the first one starts at 0
+typedef struct dirIndex {
+    uint32_t count;
+    uint32_t unused;
+    dirIndexEntry_t entry[dir_index_max];
+} dirIndex_t;
+
+// Extent of a file, the count blocks from start hold the file blocks from logical on.
+// In an index node of the extent tree start is the child node instead and count is unused
+typedef struct extent {
+    uint16_t logical;
+    uint16_t start;
+    uint16_t count;
+} extent_t;
+
+// Extent tree node, entries are sorted by logical. The root takes the place of the block pointers
+// of the inode and has room for extent_root_entries entries, every other node fills a block
+typedef struct extentNode {
+    uint16_t count;
+    uint16_t depth;     // 0 for a leaf, whose entries are extents, else the entries point to nodes one level down
+    extent_t entry[extent_node_entries];
+} extentNode_t;
+
+// bytes of the root kept in the inode, the block pointers are 16 bytes as well
+#define extent_root_size (offsetof(extentNode_t, entry) + extent_root_entries * sizeof(extent_t))
+
+// Run of contiguous blocks waiting to be freed or synced, see free_run_add and sync_run_add
+typedef struct blockRun {
+    size_t start;
+    size_t count;
+    size_t freed;   // blocks freed (or synced) by earlier runs
+} blockRun_t;
+
+// Removed file whose blocks haven't all been freed yet. The inode stays allocated with a
+// linkCount of 0 until reclaim_step is done with it, that is what fs_mount looks for
+typedef struct orphan {
+    uint16_t inode;
+    uint16_t stage;     // next reclaim_step to do
+} orphan_t;
+
+// Inode cache slot. There are only number_inodes inodes, so every inode gets its own slot and nothing is ever evicted.
+// refcount, loaded and dirty are only touched atomically, the inode itself is guarded by lock (see inode_lock)
+typedef struct inodeCacheEntry {
+    inode_t inode;
+    pthread_rwlock_t lock;
+    uint32_t refcount;  // pins held by open descriptors and calls in progress
+    bool loaded;        // inode has been read from the inode store
+    bool dirty;         // cached copy is newer than the inode store
+} inodeCacheEntry_t;
+
+// Dentry cache slot, maps (parent inode, name) to the child inode. Direct mapped, a new entry replaces whatever hashed to the same slot
+typedef struct dentryCacheEntry {
+    char name[dentry_name_max];
+    uint16_t parent;    // inode of the directory holding the name
+    uint16_t inode;     // inode the name refers to, dentry_negative if it isn't in the directory
+    bool valid;
+} dentryCacheEntry_t;
+
+// First block of the journal, see journal_replay
+typedef struct journalHeader {
+    uint32_t magic;
+    uint32_t sequence;  // sequence number of the transaction right after the header
+    uint32_t blocks;    // size of the journal, header included
+} journalHeader_t;
+
+// A transaction is a descriptor block, an image of each block it lists and a commit block.
+// The commit block repeats sequence and count and adds the checksum, see journal_checksum
+typedef struct journalRecord {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count;                 // images in the transaction
+    uint32_t checksum;              // commit block only
+    uint16_t block[journal_tx_max]; // descriptor only, where each image goes
+} journalRecord_t;
+
 // File System Sruct
 struct FS {
     block_store_t * BlockStore_whole;
     block_store_t * BlockStore_inode;
     block_store_t * BlockStore_fd;
+
+    // regular files are created extent mapped, see fs_format_map
+    bool extents;
+
+    // Lock order: rename_lock, then a descriptor's fd_lock, then inode locks in ascending inode number
+    // (see inode_lock_set), then the innermost ones, which never wait on anything else:
+    // cache_lock, a dentry lock and reclaim_lock. A path walk holds one inode lock at a time.
+
+    // inodes are worked on in place here and written back by inode_flush
+    inodeCacheEntry_t inode_cache[number_inodes];
+    pthread_mutex_t cache_lock;     // held while an inode is read into the cache
+
+    // path components looked up before, see dir_lookup
+    dentryCacheEntry_t dentry_cache[dentry_cache_size];
+    pthread_mutex_t dentry_locks[dentry_lock_count];
+
+    // held for the whole of a call on the descriptor, so its position changes one call at a time
+    pthread_mutex_t fd_locks[number_fd];
+
+    // taken by fs_move and fs_link, so no other move or link can change the subtree they check
+    pthread_mutex_t rename_lock;
+
+    // the free block map, the inode bitmap and the descriptor bitmap need no lock, their bits are
+    // claimed and released atomically by the block store (see bitmap_claim_from)
+
+    // orphans waiting for the reclaimer thread, everything below is guarded by reclaim_lock
+    pthread_mutex_t reclaim_lock;
+    pthread_cond_t reclaim_wake;    // signalled when there is work or the thread should stop
+    pthread_cond_t reclaim_idle;    // broadcast when the orphan list empties
+    pthread_t reclaimer;
+    orphan_t orphans[number_inodes];
+    size_t orphan_count;
+    size_t reclaim_urgent;          // callers waiting in reclaim_drain, the rate limit is off while > 0
+    bool reclaim_stop;
+
+    // metadata journal. Calls that change metadata run between journal_enter and journal_exit, a commit
+    // waits for the ones in progress and keeps new ones out while it writes. The maps and the fields
+    // marked atomic need no lock, the rest from journal_lock on is guarded by journal_lock
+    bool journal;                   // false for an FS formatted before there was a journal
+    bitmap_t* journal_dirty_map;    // metadata blocks changed since the last commit
+    bitmap_t* journal_logged_map;   // blocks with an image in the journal, only a commit changes it
+    size_t journal_dirty_count;     // atomic, about the number of blocks in journal_dirty_map
+    bool journal_checkpoint_due;    // atomic, a logged block was freed, the journal is emptied by the next commit
+    size_t journal_head;            // block the next transaction goes in
+    uint32_t journal_sequence;      // sequence number of the next transaction
+    pthread_mutex_t journal_lock;
+    pthread_cond_t journal_wake;    // signalled for the committer thread
+    pthread_cond_t journal_idle;    // broadcast when a commit is done or the last call in progress leaves
+    pthread_t committer;
+    size_t journal_active;          // calls between journal_enter and journal_exit
+    size_t journal_changes;         // calls since the last commit
+    bool journal_pending;           // a commit waits for the calls in progress, new ones wait for it
+    bool journal_committing;
+    bool journal_stop;
 };
 
 
@@ -67,18 +260,27 @@ struct FS {
 ///
 bool isValidFileName(const char *filename)
 {
-    if(!filename || strlen(filename) == 0 || strlen(filename) > 31)     // some "big" number as you wish
+    return filename != NULL && isValidName(filename, strlen(filename));
+}
+
+///
+/// Checks if a name of the given length is a valid filename, the name doesn't need to be terminated
+/// \param name start of the name
+/// \param len length of the name
+/// \return true if valid, else false
+///
+bool isValidName(const char *name, size_t len)
+{
+    if(len == 0 || len > 31)     // some "big" number as you wish
     {
         return false;
     }
 
     // define invalid characters might be contained in filenames
-    char *invalidCharacters = "!@#$%^&*?\"";
-    int i = 0;
-    int len = strlen(invalidCharacters);
-    for( ; i < len; i++)
+    const char *invalidCharacters = "!@#$%^&*?\"";
+    for(size_t i = 0; i < len; i++)
     {
-        if(strchr(filename, invalidCharacters[i]) != NULL)
+        if(strchr(invalidCharacters, name[i]) != NULL)
         {
             return false;
         }
@@ -87,52 +289,172 @@ bool isValidFileName(const char *filename)
 }
 
 ///
-/// Used to decompose the input string into filenames along the path, '/'
-/// \param a_str input filename path
-/// \param a_delim delimitor split in filename path
-/// \param count elements extracted from path
-/// \return result of path with tokens
+/// Step to the next filename along a path. The path is walked in place, nothing is copied
+/// \param cursor position in the path, just past a '/'. Moved past the filename, NULL after the last one
+/// \param len length of the filename
+/// \return start of the filename, NULL once the path is used up
 ///
-char** str_split(char* a_str, const char a_delim, size_t * count)
+const char* path_next(const char **cursor, size_t *len)
 {
-    if(*a_str != '/')
+    const char *start = *cursor;
+    if(start == NULL)
     {
         return NULL;
     }
-    char** result    = 0;
-    char* tmp        = a_str;
-    char delim[2];
-    delim[0] = a_delim;
-    delim[1] = '\0';
-    /* Count how many elements will be extracted. */
-    while (*tmp)
+    const char *end = strchr(start, '/');
+    if(end != NULL)
     {
-        if (a_delim == *tmp)
-        {
-            (*count)++;
-        }
-        tmp++;
+        *len = end - start;
+        *cursor = end + 1;
+    }
+    else
+    {
+        *len = strlen(start);
+        *cursor = NULL;
     }
+    return start;
+}
 
-    result = (char**)calloc(1, sizeof(char*) * (*count));
-    for(size_t i = 0; i < (*count); i++)
+///
+/// Resolve an absolute path to an inode, one dir_lookup per filename
+/// \param fs File system
+/// \param path absolute path
+/// \param last if not NULL, the last filename isn't looked up, it is handed back here and its directory is returned
+/// \param last_len length of the last filename
+/// \return inode of the file (or of its directory), SIZE_MAX if the path is invalid or doesn't exist
+///
+size_t resolve_path(FS_t *fs, const char *path, const char **last, size_t *last_len)
+{
+    if(path == NULL || *path != '/')
+    {
+        return SIZE_MAX;
+    }
+    const char *cursor = path + 1;
+    // only a slash, the root dir itself
+    if(*cursor == '\0')
     {
-        *(result + i) = (char*)calloc(1, 200);
+        return last == NULL ? 0 : SIZE_MAX;
     }
 
-    if (result)
+    size_t inode_ID = 0;	// start from the 1st inode, ie., the inode for root directory
+    const char *name;
+    size_t len;
+    while((name = path_next(&cursor, &len)) != NULL)
     {
-        size_t idx  = 0;
-        char* token = strtok(a_str, delim);
+        if(!isValidName(name, len))
+        {
+            return SIZE_MAX;
+        }
+        if(cursor == NULL && last != NULL)
+        {
+            *last = name;
+            *last_len = len;
+            return inode_ID;
+        }
+        inode_ID = dir_lookup(fs, inode_ID, name, len);
+        if(inode_ID == SIZE_MAX)
+        {
+            return SIZE_MAX;
+        }
+    }
+    return inode_ID;
+}
 
-        while (token)
+///
+/// Checks whether an inode is the given file or, for a directory, anywhere below it.
+/// Directories can be linked, so the subtree is walked down rather than the path to the inode up:
+/// one path doesn't show every way a directory can be reached
+/// \param fs File system, rename_lock held so no directory can be moved or linked meanwhile
+/// \param top inode to search from
+/// \param inode_ID inode to look for
+/// \return true if inode_ID is top or in its subtree
+///
+bool subtree_contains(FS_t *fs, size_t top, size_t inode_ID)
+{
+    // there are no cycles, but a directory with two names is walked once
+    bool seen[number_inodes] = {false};
+    size_t pending[number_inodes];
+    size_t count = 0;
+    pending[count++] = top;
+    seen[top] = true;
+    while(count > 0)
+    {
+        size_t dir_ID = pending[--count];
+        if(dir_ID == inode_ID)
         {
-            strcpy(*(result + idx++), token);
-            token = strtok(NULL, delim);
+            return true;
+        }
+        inode_lock(fs, dir_ID, false);
+        inode_t * dir_inode = inode_get(fs, dir_ID);
+        const dirIndex_t * index = dir_inode->fileType != 'd' || dir_inode->directPointer[0] == 0 ? NULL :
+            (const dirIndex_t *) block_store_get_const_ptr(fs->BlockStore_whole, dir_inode->directPointer[0]);
+        for(uint32_t i = 0; index != NULL && i < index->count; i++)
+        {
+            const dirLeafHeader_t * leaf = (const dirLeafHeader_t *) block_store_get_const_ptr(fs->BlockStore_whole, index->entry[i].block);
+            const directoryFile_t * dir_data = (const directoryFile_t *) leaf + 1;
+            for(int j = 0; j < folder_number_entries; j++)
+            {
+                size_t member_ID = dir_data[j].inodeNumber;
+                // a regular file can only be what is searched for, nothing is below it
+                if(((leaf->used >> j) & 1) == 1 && !seen[member_ID] &&
+                        (member_ID == inode_ID || inode_get(fs, member_ID)->fileType == 'd'))
+                {
+                    seen[member_ID] = true;
+                    pending[count++] = member_ID;
+                }
+            }
         }
+        inode_unlock(fs, dir_ID);
+    }
+    return false;
+}
+
+///
+/// Create a file in a directory, using an inode the caller already allocated
+/// \param fs File system
+/// \param parent_inode_ID inode of the directory, write locked by the caller
+/// \param name the new filename, not terminated
+/// \param name_len length of the filename
+/// \param type Type of file to create (regular/directory)
+/// \param child_inode_ID allocated inode for the new file, left allocated on failure
+/// \return 0 on success, < 0 if the name is taken or the directory can't hold it
+///
+int create_entry(FS_t *fs, size_t parent_inode_ID, const char *name, size_t name_len, file_t type, size_t child_inode_ID)
+{
+    // same file or dir name in the same path is intolerable
+    if(dir_lookup_locked(fs, parent_inode_ID, name, name_len) != SIZE_MAX)
+    {
+        return -1;
+    }
 
+    // add the entry to the parent directory, this fails if the directory can't grow any more
+    if(dir_add_entry(fs, parent_inode_ID, name, name_len, child_inode_ID) != 0)
+    {
+        return -1;
     }
-    return result;
+
+    // update the newly created inode, the slot may still hold a previous owner of the ID.
+    // Nothing holding the lock of a free inode waits on anything, so it is fine to take it out of order
+    inode_lock(fs, child_inode_ID, true);
+    inode_t * child_inode = inode_get(fs, child_inode_ID);
+    memset(child_inode, '\0', sizeof(inode_t));
+    child_inode->dirEntries = 0;
+    if(type == FS_REGULAR)
+    {
+        child_inode->fileType = 'r';
+        child_inode->mapType = 'i';   // empty, the data stays inline until it outgrows inline_data_max
+    }
+    else if(type == FS_DIRECTORY)
+    {
+        child_inode->fileType = 'd';
+    }	
+
+    child_inode->inodeNumber = child_inode_ID;
+    child_inode->fileSize = 0;
+    child_inode->linkCount = 1;
+    inode_mark_dirty(fs, child_inode_ID);
+    inode_unlock(fs, child_inode_ID);
+    return 0;
 }
 
 
@@ -143,11 +465,24 @@ char** str_split(char* a_str, const char a_delim, size_t * count)
 ///
 FS_t *fs_format(const char *path)
 {
-    if(path != NULL && strlen(path) != 0)
+    return fs_format_map(path, FS_MAP_POINTERS);
+}
+
+///
+/// Formats (and mounts) an FS file for use, picking how regular files map their blocks
+/// \param path The file to format
+/// \param map block pointers, or extents for large sequential files
+/// \return Mounted FS object, NULL on error
+///
+FS_t *fs_format_map(const char *path, map_t map)
+{
+    if(path != NULL && strlen(path) != 0 && (map == FS_MAP_POINTERS || map == FS_MAP_EXTENTS))
     {
 
         FS_t * ptr_FS = (FS_t *)calloc(1, sizeof(FS_t));	// get started
+        lock_init(ptr_FS);
         ptr_FS->BlockStore_whole = block_store_create(path);				// pointer to start of a large chunck of memory
+        ptr_FS->extents = map == FS_MAP_EXTENTS;
 
         // reserve the 1st block for bitmap of inode
         size_t bitmap_ID = block_store_allocate(ptr_FS->BlockStore_whole);
@@ -173,8 +508,9 @@ FS_t *fs_format(const char *path)
         uint8_t root_inode_ID = 0;	// root inode is the first one in the inode table
         inode_t * root_inode = (inode_t *) calloc(1, sizeof(inode_t));
         //		printf("size of inode_t = %zu\n", sizeof(inode_t));
-        root_inode->vacantFile = 0x00000000;
+        root_inode->dirEntries = 0;
         root_inode->fileType = 'd';								
+        root_inode->mapType = ptr_FS->extents ? 'e' : 'p';	// the root itself is a directory, this is for fs_mount
         root_inode->inodeNumber = root_inode_ID;
         root_inode->linkCount = 1;
         //		root_inode->directPointer[0] = root_data_ID;	// not allocate date block for it until it has a sub-folder or file
@@ -182,9 +518,14 @@ FS_t *fs_format(const char *path)
 
         free(root_inode);
 
+        // the metadata journal goes right after the inode table
+        journal_format(ptr_FS);
+
         // now allocate space for the file descriptors
         ptr_FS->BlockStore_fd = block_store_fd_create();
 
+        journal_start(ptr_FS);
+        reclaim_start(ptr_FS);
         return ptr_FS;
     }
 
@@ -204,8 +545,25 @@ FS_t *fs_mount(const char *path)
     {
 
         FS_t * ptr_FS = (FS_t *)calloc(1, sizeof(FS_t));	// get started
+        lock_init(ptr_FS);
         ptr_FS->BlockStore_whole = block_store_open(path);	// get the chunck of data	 
 
+        // metadata committed to the journal may not have made it home before the FS went down
+        if(ptr_FS->BlockStore_whole != NULL && journal_replay(ptr_FS))
+        {
+            // the free block map changed under the store, it is read again
+            block_store_destroy(ptr_FS->BlockStore_whole);
+            ptr_FS->BlockStore_whole = block_store_open(path);
+        }
+
+        // no image there (or it can't be opened), nothing else has been set up yet
+        if(ptr_FS->BlockStore_whole == NULL)
+        {
+            lock_destroy(ptr_FS);
+            free(ptr_FS);
+            return NULL;
+        }
+
         // the bitmap block should be the 1st one
         size_t bitmap_ID = 0;
 
@@ -215,9 +573,37 @@ FS_t *fs_mount(const char *path)
         // attach the bitmaps to their designated place
         ptr_FS->BlockStore_inode = block_store_inode_create(block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID * BLOCK_SIZE_BYTES, block_store_Data_location(ptr_FS->BlockStore_whole) + inode_start_block * BLOCK_SIZE_BYTES);
 
+        // the root has to be there and be a directory, otherwise this isn't an FS image
+        inode_t * root_inode = block_store_sub_test(ptr_FS->BlockStore_inode, 0) ? inode_get(ptr_FS, 0) : NULL;
+        if(root_inode == NULL || root_inode->fileType != 'd')
+        {
+            block_store_inode_destroy(ptr_FS->BlockStore_inode);
+            block_store_destroy(ptr_FS->BlockStore_whole);
+            lock_destroy(ptr_FS);
+            free(ptr_FS);
+            return NULL;
+        }
+
+        // the map picked at format time
+        ptr_FS->extents = root_inode->mapType == 'e';
+
+        // an image from before directories were hashed has them rewritten first
+        if(dir_upgrade(ptr_FS) != 0)
+        {
+            block_store_inode_destroy(ptr_FS->BlockStore_inode);
+            block_store_destroy(ptr_FS->BlockStore_whole);
+            lock_destroy(ptr_FS);
+            free(ptr_FS);
+            return NULL;
+        }
+
         // since file descriptors are allocated outside of the whole blocks, we can simply reallocate space for it.
         ptr_FS->BlockStore_fd = block_store_fd_create();
 
+        // files removed while the FS was last mounted may not have been reclaimed all the way
+        journal_start(ptr_FS);
+        reclaim_start(ptr_FS);
+        reclaim_recover(ptr_FS);
         return ptr_FS;
     }
 
@@ -234,6 +620,17 @@ int fs_unmount(FS_t *fs)
 {
     if(fs != NULL)
     {	
+        // removed files are reclaimed before anything goes away
+        reclaim_stop(fs);
+        // the last transaction, then the journal is emptied so the next mount has nothing to replay
+        journal_stop(fs);
+        // write back whatever the inode cache is still holding, journal_stop has synced a journaled FS
+        inode_cache_flush(fs);
+        if(!fs->journal)
+        {
+            store_sync(fs);
+        }
+        lock_destroy(fs);
         block_store_inode_destroy(fs->BlockStore_inode);
 
         block_store_destroy(fs->BlockStore_whole);
@@ -244,6 +641,27 @@ int fs_unmount(FS_t *fs)
     }
     return -1;
 } 
+///
+/// Writes everything the FS is holding in memory back to the backing file and waits
+/// for every block written since the last sync to get there
+/// \param fs The FS to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_sync(FS_t *fs)
+{
+    if(fs == NULL)
+    {
+        return -1;
+    }
+    // a commit writes the inode cache back too, and once it returns the changes survive a crash
+    if(fs->journal)
+    {
+        return journal_commit(fs, true);
+    }
+    inode_cache_flush(fs);
+    return store_sync(fs);
+}
+
 ///
 /// Creates a new file at the specified location
 ///   Directories along the path that do not exist are not created
@@ -256,201 +674,193 @@ int fs_create(FS_t *fs, const char *path, file_t type)
 {
     if(fs != NULL && path != NULL && strlen(path) != 0 && (type == FS_REGULAR || type == FS_DIRECTORY))
     {
-        char* copy_path = (char*)calloc(1, 65535);
-        strcpy(copy_path, path); 
-        char** tokens;		// tokens are the directory names along the path. The last one is the name for the new file or dir
-        size_t count = 0;
-        tokens = str_split(copy_path, '/', &count);
-        free(copy_path);
-        if(tokens == NULL)
+        // walk to the directory the new file goes in, the last filename is the new one
+        const char * name = NULL;
+        size_t name_len = 0;
+        size_t parent_inode_ID = resolve_path(fs, path, &name, &name_len);
+        if(parent_inode_ID == SIZE_MAX)
         {
             return -1;
         }
 
-        // let's check if the filenames are valid or not
-        for(size_t n = 0; n < count; n++)
-        {	
-            if(isValidFileName(*(tokens + n)) == false)
-            {
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);
-                return -1;
-            }
+        journal_enter(fs, false);
+        size_t child_inode_ID = inode_allocate(fs);
+        // printf("new child_inode_ID = %zu\n", child_inode_ID);
+        // ugh, inodes are used up
+        if(child_inode_ID == SIZE_MAX)
+        {
+            journal_exit(fs);
+            return -1;	
         }
 
-        size_t parent_inode_ID = 0;	// start from the 1st inode, ie., the inode for root directory
-        // first, let's find the parent dir
-        size_t indicator = 0;
-
-        // we declare parent_inode and parent_data here since it will still be used after the for loop
-        directoryFile_t * parent_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);
+        // the new file has to go in a directory, one that hasn't been removed in the meantime
+        inode_lock(fs, parent_inode_ID, true);
+        inode_t * parent_inode = inode_get(fs, parent_inode_ID);
+        int created = parent_inode->fileType == 'd' && parent_inode->linkCount > 0 ?
+            create_entry(fs, parent_inode_ID, name, name_len, type, child_inode_ID) : -1;
+        inode_unlock(fs, parent_inode_ID);
 
-        inode_t * parent_inode = (inode_t *) calloc(1, sizeof(inode_t));	
-
-        for(size_t i = 0; i < count - 1; i++)
+        if(created != 0)
         {
-            block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);	// read out the parent inode
-            // in case file and dir has the same name
-            if(parent_inode->fileType == 'd')
-            {
-                block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-
-                for(int j = 0; j < folder_number_entries; j++)
-                {
-                    if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + i)) == 0 )
-                    {
-                        parent_inode_ID = (parent_data + j) -> inodeNumber;
-                        indicator++;
-                    }					
-                }
-            }					
+            inode_release(fs, child_inode_ID);
         }
-        //		printf("indicator = %zu\n", indicator);
-        //		printf("parent_inode_ID = %lu\n", parent_inode_ID);
-
-        // read out the parent inode
-        block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);
-        if(indicator == count - 1 && parent_inode->fileType == 'd')
-        {
-            // same file or dir name in the same path is intolerable
-            for(int m = 0; m < folder_number_entries; m++)
-            {
-                // rid out the case of existing same file or dir name
-                if( ((parent_inode->vacantFile >> m) & 1) == 1)
-                {
-                    // before read out parent_data, we need to make sure it does exist!
-                    block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-                    if( strcmp((parent_data + m) -> filename, *(tokens + count - 1)) == 0 )
-                    {
-                        free(parent_data);
-                        free(parent_inode);	
-                        // before any return, we need to free tokens, otherwise memory leakage
-                        for (size_t i = 0; i < count; i++)
-                        {
-                            free(*(tokens + i));
-                        }
-                        free(tokens);
-                        return -1;											
-                    }
-                }
-            }	
-
+        journal_exit(fs);
+        // wow, at last, we make it!
+        return created;
+    }
+    return -1;
+}
 
-            // cannot declare k inside for loop, since it will be used later.
-            int k = 0;
-            for( ; k < folder_number_entries; k++)
-            {
-                if( ((parent_inode->vacantFile >> k) & 1) == 0 )
-                    break;
-            }
 
-            // if k == 0, then we have to declare a new parent data block
-            //			printf("k = %d\n", k);
-            if(k == 0)
-            {
-                size_t parent_data_ID = block_store_allocate(fs->BlockStore_whole);
-                //					printf("parent_data_ID = %zu\n", parent_data_ID);
-                if(parent_data_ID < BLOCK_STORE_AVAIL_BLOCKS)
-                {
-                    parent_inode->directPointer[0] = parent_data_ID;
-                }
-                else
-                {
-                    free(parent_inode);
-                    free(parent_data);
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);
-                    return -1;												
-                }
-            }
+///
+/// Creates a batch of files in one directory
+///   The directory is resolved once and the inodes for the whole batch are allocated in one pass
+/// \param fs The FS containing the directory
+/// \param path Absolute path to the directory
+/// \param names Filenames (not paths) of the files to create
+/// \param count Number of names
+/// \param type Type of the files to create (regular/directory)
+/// \return number of files created, stopping at the first name that can't be created, < 0 on error
+///
+ssize_t fs_create_many(FS_t *fs, const char *path, const char *const *names, size_t count, file_t type)
+{
+    if(fs == NULL || (names == NULL && count != 0) || (type != FS_REGULAR && type != FS_DIRECTORY))
+    {
+        return -1;
+    }
+    size_t parent_inode_ID = resolve_path(fs, path, NULL, NULL);
+    if(parent_inode_ID == SIZE_MAX)
+    {
+        return -1;
+    }
 
-            if(k < folder_number_entries)	// k == folder_number_entries means this directory is full
-            {
-                size_t child_inode_ID = block_store_sub_allocate(fs->BlockStore_inode);
-                // printf("new child_inode_ID = %zu\n", child_inode_ID);
-                // ugh, inodes are used up
-                if(child_inode_ID == SIZE_MAX)
-                {
-                    free(parent_data);
-                    free(parent_inode);
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);
-                    return -1;	
-                }
+    journal_enter(fs, false);
+    size_t inode_IDs[number_inodes];
+    size_t wanted = count < number_inodes ? count : number_inodes;
+    size_t allocated = block_store_sub_allocate_many(fs->BlockStore_inode, wanted, inode_IDs);
+    // removed files may still be holding inodes
+    if(allocated < wanted && reclaim_drain(fs))
+    {
+        allocated += block_store_sub_allocate_many(fs->BlockStore_inode, wanted - allocated, inode_IDs + allocated);
+    }
 
-                // wow, at last, we make it!				
-                // update the parent inode
-                parent_inode->vacantFile |= (1 << k);
-                // in the following cases, we should allocate parent data first: 
-                // 1)the parent dir is not the root dir; 
-                // 2)the file or dir to create is to be the 1st in the parent dir
+    // the whole batch goes in under one lock of the directory
+    inode_lock(fs, parent_inode_ID, true);
+    inode_t * parent_inode = inode_get(fs, parent_inode_ID);
+    bool is_dir = parent_inode->fileType == 'd' && parent_inode->linkCount > 0;
+    size_t created = 0;
+    for( ; is_dir && created < allocated; created++)
+    {
+        const char * name = names[created];
+        size_t name_len = name == NULL ? 0 : strlen(name);
+        if(!isValidName(name, name_len) || memchr(name, '/', name_len) != NULL ||
+                create_entry(fs, parent_inode_ID, name, name_len, type, inode_IDs[created]) != 0)
+        {
+            break;
+        }
+    }
+    inode_unlock(fs, parent_inode_ID);
 
-                block_store_inode_write(fs->BlockStore_inode, parent_inode_ID, parent_inode);	
+    // hand back the inodes of the names that weren't created
+    for(size_t i = created; i < allocated; i++)
+    {
+        inode_release(fs, inode_IDs[i]);
+    }
+    journal_exit(fs);
+    return is_dir ? (ssize_t) created : -1;
+}
 
-                // update the parent directory file block
-                block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-                strcpy((parent_data + k)->filename, *(tokens + count - 1));
-                //				printf("the newly created file's name is: %s\n", (parent_data + k)->filename);
+///
+/// Looks up a batch of files in one directory
+///   The directory is resolved once, each name is one dir_lookup
+/// \param fs The FS containing the directory
+/// \param path Absolute path to the directory
+/// \param names Filenames (not paths) of the files to look up
+/// \param count Number of names
+/// \param stats Filled in for each name, inode is SIZE_MAX for names that don't exist
+/// \return number of names found, < 0 on error
+///
+ssize_t fs_stat_many(FS_t *fs, const char *path, const char *const *names, size_t count, file_stat_t *stats)
+{
+    if(fs == NULL || (count != 0 && (names == NULL || stats == NULL)))
+    {
+        return -1;
+    }
+    size_t parent_inode_ID = resolve_path(fs, path, NULL, NULL);
+    if(parent_inode_ID == SIZE_MAX)
+    {
+        return -1;
+    }
 
-                (parent_data + k)->inodeNumber = child_inode_ID;
-                block_store_write(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
+    // the names are looked up under one lock of the directory, the files are locked one at a time after
+    inode_lock(fs, parent_inode_ID, false);
+    bool is_dir = inode_get(fs, parent_inode_ID)->fileType == 'd';
+    for(size_t i = 0; is_dir && i < count; i++)
+    {
+        const char * name = names[i];
+        size_t name_len = name == NULL ? 0 : strlen(name);
+        memset(&stats[i], 0, sizeof(file_stat_t));
+        stats[i].inode = name_len == 0 ? SIZE_MAX : dir_lookup_locked(fs, parent_inode_ID, name, name_len);
+    }
+    inode_unlock(fs, parent_inode_ID);
+    if(!is_dir)
+    {
+        return -1;
+    }
 
-                // update the newly created inode
-                inode_t * child_inode = (inode_t *) calloc(1, sizeof(inode_t));
-                child_inode->vacantFile = 0;
-                if(type == FS_REGULAR)
-                {
-                    child_inode->fileType = 'r';
-                }
-                else if(type == FS_DIRECTORY)
-                {
-                    child_inode->fileType = 'd';
-                }	
-
-                child_inode->inodeNumber = child_inode_ID;
-                child_inode->fileSize = 0;
-                child_inode->linkCount = 1;
-                block_store_inode_write(fs->BlockStore_inode, child_inode_ID, child_inode);
-
-                //				printf("after creation, parent_inode->vacantFile = %d\n", parent_inode->vacantFile);
-
-                // free the temp space
-                free(parent_inode);
-                free(parent_data);
-                free(child_inode);
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);					
-                return 0;
-            }				
-        }
-        // before any return, we need to free tokens, otherwise memory leakage
-        for (size_t i = 0; i < count; i++)
+    ssize_t found = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t inode_ID = stats[i].inode;
+        if(inode_ID != SIZE_MAX)
         {
-            free(*(tokens + i));
+            inode_lock(fs, inode_ID, false);
+            const inode_t * file_inode = inode_get(fs, inode_ID);
+            stats[i].type = file_inode->fileType == 'd' ? FS_DIRECTORY : FS_REGULAR;
+            stats[i].size = file_inode->fileSize;
+            stats[i].links = file_inode->linkCount;
+            inode_unlock(fs, inode_ID);
+            found++;
         }
-        free(tokens);
-        free(parent_inode);	
-        free(parent_data);
     }
-    return -1;
+    return found;
+}
+
+
+///
+/// Lock a descriptor and load it, for the length of a call on it
+/// \param fs The FS containing the file
+/// \param fd The descriptor, in range
+/// \param file_desc Filled in with the descriptor
+/// \return true with the descriptor locked, false (and not locked) if it isn't open
+///
+static bool fd_acquire(FS_t *fs, int fd, fileDescriptor_t *file_desc)
+{
+    pthread_mutex_lock(&fs->fd_locks[fd]);
+    // an fd fs_open has claimed but not filled in yet is still all zeros, and the root can't be opened
+    if(bitmap_test(block_store_get_bm(fs->BlockStore_fd), fd) &&
+            block_store_fd_read(fs->BlockStore_fd, fd, file_desc) != 0 && file_desc->inodeNum != 0)
+    {
+        return true;
+    }
+    pthread_mutex_unlock(&fs->fd_locks[fd]);
+    return false;
 }
 
+///
+/// Close a descriptor locked by fd_acquire, it stays locked
+/// \param fs The FS containing the file
+/// \param fd The descriptor
+/// \param file_desc The descriptor as fd_acquire loaded it
+///
+static void fd_close_locked(FS_t *fs, int fd, const fileDescriptor_t *file_desc)
+{
+    // drop the pin fs_open took, the inode is written back if nobody else has it open
+    inode_unpin(fs, file_desc->inodeNum);
+    const fileDescriptor_t closed = {0, 0, 0, 0};
+    block_store_fd_write(fs->BlockStore_fd, fd, &closed);
+    block_store_sub_release(fs->BlockStore_fd, fd);
+}
 
 ///
 /// Opens the specified file for use
@@ -464,112 +874,46 @@ int fs_open(FS_t *fs, const char *path)
 {
     if(fs != NULL && path != NULL && strlen(path) != 0)
     {
-        char* copy_path = (char*)calloc(1, 65535);
-        strcpy(copy_path, path);
-        char** tokens;		// tokens are the directory names along the path. The last one is the name for the new file or dir
-        size_t count = 0;
-        tokens = str_split(copy_path, '/', &count);
-        free(copy_path);
-        if(tokens == NULL)
-        {
-            return -1;
-        }
-
-        // let's check if the filenames are valid or not
-        for(size_t n = 0; n < count; n++)
-        {	
-            if(isValidFileName(*(tokens + n)) == false)
-            {
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);
-                return -1;
-            }
-        }	
-
-        size_t parent_inode_ID = 0;	// start from the 1st inode, ie., the inode for root directory
-        // first, let's find the parent dir
-        size_t indicator = 0;
-
-        inode_t * parent_inode = (inode_t *) calloc(1, sizeof(inode_t));
-        directoryFile_t * parent_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);			
-
-        // locate the file
-        for(size_t i = 0; i < count; i++)
-        {		
-            block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);	// read out the parent inode
-            if(parent_inode->fileType == 'd')
-            {
-                block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-                //printf("parent_inode->vacantFile = %d\n", parent_inode->vacantFile);
-                for(int j = 0; j < folder_number_entries; j++)
-                {
-                    //printf("(parent_data + j) -> filename = %s\n", (parent_data + j) -> filename);
-                    if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + i)) == 0 )
-                    {
-                        parent_inode_ID = (parent_data + j) -> inodeNumber;
-                        indicator++;
-                    }					
-                }
-            }					
-        }		
-        free(parent_data);			
-        free(parent_inode);	
-        //printf("indicator = %zu\n", indicator);
-        //printf("count = %zu\n", count);
+        // locate the file, the last filename is looked up again once its directory is locked
+        const char * name = NULL;
+        size_t name_len = 0;
+        size_t parent_inode_ID = resolve_path(fs, path, &name, &name_len);
+        size_t file_inode_ID = parent_inode_ID == SIZE_MAX ? SIZE_MAX : dir_lookup(fs, parent_inode_ID, name, name_len);
         // now let's open the file
-        if(indicator == count)
+        if(file_inode_ID != SIZE_MAX)
         {
             size_t fd_ID = block_store_sub_allocate(fs->BlockStore_fd);
             //printf("fd_ID = %zu\n", fd_ID);
             // it could be possible that fd runs out
             if(fd_ID < number_fd)
             {
-                size_t file_inode_ID = parent_inode_ID;
-                inode_t * file_inode = (inode_t *) calloc(1, sizeof(inode_t));
-                block_store_inode_read(fs->BlockStore_inode, file_inode_ID, file_inode);	// read out the file inode	
-
-                // it's too bad if file to be opened is a dir 
-                if(file_inode->fileType == 'd')
+                pthread_mutex_lock(&fs->fd_locks[fd_ID]);
+                // the file may have been removed or moved since, and it's too bad if file to be opened is a dir
+                inode_lock(fs, parent_inode_ID, false);
+                bool found = dir_lookup_locked(fs, parent_inode_ID, name, name_len) == file_inode_ID &&
+                    inode_get(fs, file_inode_ID)->fileType != 'd';
+                if(found)
                 {
-                    free(file_inode);
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);
-                    return -1;
+                    // assign a file descriptor ID to the open behavior
+                    fileDescriptor_t fd = {0, 0, 0, 0};
+                    fd.inodeNum = file_inode_ID;
+                    fd.usage = 1;
+                    fd.locate_order = 0; // R/W position is set to the beginning of the file (BOF)
+                    fd.locate_offset = 0;
+                    block_store_fd_write(fs->BlockStore_fd, fd_ID, &fd);
+                    // keep the inode cached for as long as the descriptor is open
+                    inode_pin(fs, file_inode_ID);
                 }
+                inode_unlock(fs, parent_inode_ID);
 
-                // assign a file descriptor ID to the open behavior
-                fileDescriptor_t * fd = (fileDescriptor_t *)calloc(1, sizeof(fileDescriptor_t));
-                fd->inodeNum = file_inode_ID;
-                fd->usage = 1;
-                fd->locate_order = 0; // R/W position is set to the beginning of the file (BOF)
-                fd->locate_offset = 0;
-                block_store_fd_write(fs->BlockStore_fd, fd_ID, fd);
-
-                free(file_inode);
-                free(fd);
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
+                if(!found)
                 {
-                    free(*(tokens + i));
+                    block_store_sub_release(fs->BlockStore_fd, fd_ID);
                 }
-                free(tokens);			
-                return fd_ID;
+                pthread_mutex_unlock(&fs->fd_locks[fd_ID]);
+                return found ? (int) fd_ID : -1;
             }	
         }
-        // before any return, we need to free tokens, otherwise memory leakage
-        for (size_t i = 0; i < count; i++)
-        {
-            free(*(tokens + i));
-        }
-        free(tokens);
     }
     return -1;
 }
@@ -586,18 +930,24 @@ int fs_close(FS_t *fs, int fd)
     if(fs != NULL && fd >=0 && fd < number_fd)
     {
         // first, make sure this fd is in use
-        if(block_store_sub_test(fs->BlockStore_fd, fd))
+        // the last close writes the inode back
+        journal_enter(fs, false);
+        fileDescriptor_t file_desc;
+        bool open = fd_acquire(fs, fd, &file_desc);
+        if(open)
         {
-            block_store_sub_release(fs->BlockStore_fd, fd);
-            return 0;
-        }   
+            fd_close_locked(fs, fd, &file_desc);
+            pthread_mutex_unlock(&fs->fd_locks[fd]);
+        }
+        journal_exit(fs);
+        return open ? 0 : -1;
     }
     return -1;
 }
 
 ///
 /// Populates a dyn_array with information about the files in a directory
-///   Array contains up to 15 file_record_t structures
+///   Array contains one file_record_t structure per directory entry
 /// \param fs The FS containing the file
 /// \param path Absolute path to the directory to inspect
 /// \return dyn_array of file records, NULL on error
@@ -606,221 +956,132 @@ dyn_array_t *fs_get_dir(FS_t *fs, const char *path)
 {
     if(fs != NULL && path != NULL && strlen(path) != 0)
     {   
-        char* copy_path = (char*)malloc(200);
-        strcpy(copy_path, path);
-        char** tokens;      // tokens are the directory names along the path. The last one is the name for the new file or dir
-        size_t count = 0;
-        tokens = str_split(copy_path, '/', &count);
-        free(copy_path);
-
-        if(strlen(*tokens) == 0)
-        {
-            // a spcial case: only a slash, no dir names
-            count -= 1;
-        }
-        else
-        {
-            for(size_t n = 0; n < count; n++)
-            {   
-                if(isValidFileName(*(tokens + n)) == false)
-                {
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);       
-                    return NULL;
-
-                }
-            }           
-        }
         // search along the path and find the deepest dir
-        size_t parent_inode_ID = 0; // start from the 1st inode, ie., the inode for root directory
-        // first, let's find the parent dir
-        size_t indicator = 0;
-
-        inode_t * parent_inode = (inode_t *) calloc(1, sizeof(inode_t));
-        directoryFile_t * parent_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);
-        for(size_t i = 0; i < count; i++)
-        {
-            block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);    // read out the parent inode
-            // in case file and dir has the same name. But from the test cases we can see, this case would not happen
-            if(parent_inode->fileType == 'd')
-            {           
-                block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-                for(int j = 0; j < folder_number_entries; j++)
-                {
-                    if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + i)) == 0 )
-                    {
-                        parent_inode_ID = (parent_data + j) -> inodeNumber;
-                        indicator++;
-                    }                   
-                }   
-            }                   
-        }   
-        free(parent_data);
-        free(parent_inode);
+        size_t parent_inode_ID = resolve_path(fs, path, NULL, NULL);
 
         // now let's enumerate the files/dir in it
-        if(indicator == count)
+        if(parent_inode_ID != SIZE_MAX)
         {
-            inode_t * dir_inode = (inode_t *) calloc(1, sizeof(inode_t));
-            block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, dir_inode);   // read out the file inode          
+            // the members can't go away while their directory is locked
+            inode_lock(fs, parent_inode_ID, false);
+            inode_t * dir_inode = inode_get(fs, parent_inode_ID);   // read out the file inode
             if(dir_inode->fileType == 'd')
             {
-                // prepare the data to be read out
-                directoryFile_t * dir_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);
-                block_store_read(fs->BlockStore_whole, dir_inode->directPointer[0], dir_data);
                 // prepare the dyn_array to hold the data
-                dyn_array_t * dynArray = dyn_array_create(15, sizeof(file_record_t), NULL);
+                dyn_array_t * dynArray = dyn_array_create(dir_inode->dirEntries, sizeof(file_record_t), NULL);
 
-                for(int j = 0; j < folder_number_entries; j++)
+                // an empty directory may not have its index yet
+                const dirIndex_t * index = dir_inode->directPointer[0] == 0 ? NULL :
+                    (const dirIndex_t *) block_store_get_const_ptr(fs->BlockStore_whole, dir_inode->directPointer[0]);
+                for(uint32_t i = 0; index != NULL && i < index->count; i++)
                 {
-                    if( ((dir_inode->vacantFile >> j) & 1) == 1 )
+                    const dirLeafHeader_t * leaf = (const dirLeafHeader_t *) block_store_get_const_ptr(fs->BlockStore_whole, index->entry[i].block);
+                    const directoryFile_t * dir_data = (const directoryFile_t *) leaf + 1;
+                    for(int j = 0; j < folder_number_entries; j++)
                     {
-                        file_record_t* fileRec = (file_record_t *)calloc(1, sizeof(file_record_t));
-                        strcpy(fileRec->name, (dir_data + j) -> filename);
-                        // to know fileType of the member in this dir, we have to refer to its inode
-                        inode_t * member_inode = (inode_t *) calloc(1, sizeof(inode_t));
-                        block_store_inode_read(fs->BlockStore_inode, (dir_data + j) -> inodeNumber, member_inode);
-                        if(member_inode->fileType == 'd')
-                        {
-                            fileRec->type = FS_DIRECTORY;
-                        }
-                        else if(member_inode->fileType == 'f')
+                        if( ((leaf->used >> j) & 1) == 1 )
                         {
-                            fileRec->type = FS_REGULAR;
+                            file_record_t* fileRec = (file_record_t *)calloc(1, sizeof(file_record_t));
+                            strcpy(fileRec->name, (dir_data + j) -> filename);
+                            // to know fileType of the member in this dir, we have to refer to its inode
+                            inode_t * member_inode = inode_get(fs, (dir_data + j) -> inodeNumber);
+                            if(member_inode->fileType == 'd')
+                            {
+                                fileRec->type = FS_DIRECTORY;
+                            }
+                            else if(member_inode->fileType == 'r')
+                            {
+                                fileRec->type = FS_REGULAR;
+                            }
+
+                            // now insert the file record into the dyn_array
+                            dyn_array_push_front(dynArray, fileRec);
+                            free(fileRec);
                         }
-
-                        // now insert the file record into the dyn_array
-                        dyn_array_push_front(dynArray, fileRec);
-                        free(fileRec);
-                        free(member_inode);
-                    }                  
-                }
-                free(dir_data);
-                free(dir_inode);
-                // before any return, we need to free tokens, otherwise memory leakage
-                if(strlen(*tokens) == 0)
-                {
-                    // a spcial case: only a slash, no dir names
-                    count += 1;
-                }
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
+                    }
                 }
-                free(tokens);   
+                inode_unlock(fs, parent_inode_ID);
                 return(dynArray);
             }
-            free(dir_inode);
+            inode_unlock(fs, parent_inode_ID);
         }
 
-        // before any return, we need to free tokens, otherwise memory leakage
-        if(strlen(*tokens) == 0)
-        {
-            // a spcial case: only a slash, no dir names
-            count += 1;
-        }
-        for (size_t i = 0; i < count; i++)
-        {
-            free(*(tokens + i));
-        }
-        free(tokens);   
     }
     return NULL;
 
 }
 
-off_t fs_seek(FS_t *fs, int fd, off_t offset, seek_t whence)
-{
-    UNUSED(fs);
-    UNUSED(fd);
-    UNUSED(offset);
-    UNUSED(whence);
-    return 0;
-}
-
 ///
-/// Reads data from the file linked to the given descriptor
-///   Reading past EOF returns data up to EOF
-///   R/W position in incremented by the number of bytes read
+/// Moves the R/W position of the given descriptor to the given location
+///   Seeking past EOF will seek to EOF, seeking before BOF will seek to BOF
 /// \param fs The FS containing the file
-/// \param fd The file to read from
-/// \param dst The buffer to write to
-/// \param nbyte The number of bytes to read
-/// \return number of bytes read (< nbyte IFF read passes EOF), < 0 on error
+/// \param fd The descriptor to seek
+/// \param offset Desired offset relative to whence
+/// \param whence Position from which offset is applied
+/// \return offset from BOF, < 0 on error
 ///
-ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte)
+off_t fs_seek(FS_t *fs, int fd, off_t offset, seek_t whence)
 {
     // error check parameters
-    if(!fs || fd < 0 ||  fd >= number_fd || !dst) {
-        //printf("fail parameter check\n");
+    if(!fs || fd < 0 || fd >= number_fd) {
         return -1;
     }
-
-    // bitmap test using block store bitmap
-    if(!bitmap_test(block_store_get_bm(fs->BlockStore_fd), fd)) {
-        //printf("fsil bitmap test\n");
-        return -2;
-    }
-
-    // error check nbytes
-    if(nbyte == 0) {
-        //printf("nbytes 0\n");
-        return 0;
+    if(whence != FS_SEEK_SET && whence != FS_SEEK_CUR && whence != FS_SEEK_END) {
+        return -1;
     }
-    //printf("current nbyte %zu\n", nbyte);
-
-    // define file descriptor
     fileDescriptor_t file_desc;
-    if(block_store_fd_read(fs->BlockStore_fd, fd, &file_desc) == 0) {
-        //printf("fail fd read\n");
-        return 0;
+    if(!fd_acquire(fs, fd, &file_desc)) {
+        return -2;
     }
-    uint16_t fd_loc = file_desc.locate_order;
-    uint16_t fd_off = file_desc.locate_offset;
-
 
-    // define inode
-    uint8_t fd_inode_id = file_desc.inodeNum;
-    inode_t fd_inode;
-    if(block_store_inode_read(fs->BlockStore_inode, fd_inode_id, &fd_inode) == 0) {
-        //printf("failed inode read \n");
-        return 0;
+    inode_t *fd_inode = inode_get(fs, file_desc.inodeNum);
+    if(fd_inode == NULL) {
+        pthread_mutex_unlock(&fs->fd_locks[fd]);
+        return -3;
     }
-
-    // get previous offset
-    off_t head = getPrevOffset(&file_desc);
-    //if(head == 333)
-    //printf("head 333\n");
-    if(head + nbyte > fd_inode.fileSize) {
-        nbyte = fd_inode.fileSize - head;
+    inode_lock(fs, file_desc.inodeNum, false);
+    const off_t size = fd_inode->fileSize;
+    inode_unlock(fs, file_desc.inodeNum);
+
+    off_t base = 0;
+    if(whence == FS_SEEK_CUR) {
+        base = getPrevOffset(&file_desc);
+    } else if(whence == FS_SEEK_END) {
+        base = size;
     }
 
-    // total bytes read
-    ssize_t total_bytes_read = 0;
-    if(fd_loc < NUM_DIRECT_PTR) {
-        //printf("fd location < num direct pointer\n");
-        total_bytes_read = read_direct_block(fs, &fd_inode, fd_loc, fd_off, dst, nbyte);
-    } else if(fd_loc >= NUM_DIRECT_PTR && fd_loc < NUM_INDIRECT_PTR + NUM_DIRECT_PTR) {
-        //printf("read indirect\n");
-        total_bytes_read = read_indirect_block(fs, &fd_inode, fd_loc, fd_off, dst, nbyte, fd_inode.indirectPointer[0]);
+    // clamp to [BOF, EOF], checking against the distance left so nothing can overflow
+    off_t position;
+    if(offset < 0) {
+        position = offset < -base ? 0 : base + offset;
     } else {
-        //printf("read double direct block\n");
-        total_bytes_read = read_doubleDirect_block(fs, &fd_inode, fd_loc, fd_off, dst, nbyte);
+        position = offset > size - base ? size : base + offset;
     }
 
-    //if(total_bytes_read == 0)
-    //printf("no bytes read\n");
-
-    updateFD(&file_desc, total_bytes_read);
+    setFDPosition(&file_desc, position);
     block_store_fd_write(fs->BlockStore_fd, fd, &file_desc);
+    pthread_mutex_unlock(&fs->fd_locks[fd]);
+    return position;
+}
 
-    //printf("total bytes read %zu\n", total_bytes_read);
-    return total_bytes_read;
-
+///
+/// Reads data from the file linked to the given descriptor
+///   Reading past EOF returns data up to EOF
+///   R/W position in incremented by the number of bytes read
+/// \param fs The FS containing the file
+/// \param fd The file to read from
+/// \param dst The buffer to write to
+/// \param nbyte The number of bytes to read
+/// \return number of bytes read (< nbyte IFF read passes EOF), < 0 on error
+///
+ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte)
+{
+    // error check parameters
+    if(!dst) {
+        return -1;
+    }
+    struct iovec iov = { .iov_base = dst, .iov_len = nbyte };
+    return fs_readv(fs, fd, &iov, 1);
 }
 
 ///
@@ -835,80 +1096,462 @@ ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte)
 /// \return number of bytes written (< nbyte IFF out of space), < 0 on error
 ///
 ssize_t fs_write(FS_t *fs, int fd, const void *src, size_t nbyte)
-{    
+{
+    // error check parameters
+    if(!src) {
+        return -1;
+    }
+    struct iovec iov = { .iov_base = (void *) src, .iov_len = nbyte };
+    return fs_writev(fs, fd, &iov, 1);
+}
+
+///
+/// Reads data from the file linked to the given descriptor into several buffers
+///   Buffers are filled in order, as if fs_read was called once per buffer
+///   The descriptor and inode are loaded and stored once for the whole call
+/// \param fs The FS containing the file
+/// \param fd The file to read from
+/// \param iov The buffers to write to
+/// \param iovcnt Number of buffers in iov
+/// \return number of bytes read (< total length IFF read passes EOF), < 0 on error
+///
+ssize_t fs_readv(FS_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
     // error check parameters
-    if (!fs || fd < 0 || fd >= number_fd || !src) {
-        //printf("failed parameter check\n");
+    if(!fs || fd < 0 || fd >= number_fd || !iov || iovcnt < 0) {
         return -1;
     }
-    // error check bitmap test using block store bitmap
-    if(!bitmap_test(block_store_get_bm(fs->BlockStore_fd), fd)) { 
-        //printf("failt bitmap test\n");
-        return -2; 
+    for(int i = 0; i < iovcnt; i++) {
+        if(!iov[i].iov_base && iov[i].iov_len > 0)
+            return -1;
     }
 
-    // define file descriptor
+    // define file descriptor, it is held until the new position is stored
     fileDescriptor_t file_desc;
-    block_store_fd_read(fs->BlockStore_fd, fd, &file_desc);
-    uint16_t fd_loc = file_desc.locate_order;
-    uint16_t fd_off = file_desc.locate_offset;
+    if(!fd_acquire(fs, fd, &file_desc)) {
+        return -2;
+    }
 
-    // define inode
-    inode_t inode;
-    block_store_inode_read(fs->BlockStore_inode, file_desc.inodeNum, &inode);
+    // define inode, straight from the inode cache
+    inode_t *fd_inode = inode_get(fs, file_desc.inodeNum);
+    if(fd_inode == NULL) {
+        pthread_mutex_unlock(&fs->fd_locks[fd]);
+        return 0;
+    }
+    inode_lock(fs, file_desc.inodeNum, false);
+
+    // reading past EOF returns data up to EOF
+    off_t head = getPrevOffset(&file_desc);
+    size_t left = (size_t) head < fd_inode->fileSize ? fd_inode->fileSize - head : 0;
+
+    // total bytes read
+    ssize_t total_bytes_read = 0;
+    for(int i = 0; i < iovcnt && left > 0; i++) {
+        size_t nbyte = iov[i].iov_len < left ? iov[i].iov_len : left;
+        if(nbyte == 0)
+            continue;
+
+        ssize_t bytes_read = read_from_position(fs, fd_inode, file_desc.locate_order, file_desc.locate_offset, iov[i].iov_base, nbyte);
+        updateFD(&file_desc, bytes_read);
+        total_bytes_read += bytes_read;
+        left -= bytes_read;
+        if((size_t) bytes_read < nbyte)
+            break;
+    }
+    inode_unlock(fs, file_desc.inodeNum);
+
+    block_store_fd_write(fs->BlockStore_fd, fd, &file_desc);
+    pthread_mutex_unlock(&fs->fd_locks[fd]);
+    return total_bytes_read;
+}
+
+///
+/// Writes data from several buffers to the file linked to the descriptor
+///   Buffers are written in order, as if fs_write was called once per buffer
+///   The descriptor and inode are loaded and stored once for the whole call
+/// \param fs The FS containing the file
+/// \param fd The file to write to
+/// \param iov The buffers to read from
+/// \param iovcnt Number of buffers in iov
+/// \return number of bytes written (< total length IFF out of space), < 0 on error
+///
+ssize_t fs_writev(FS_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+    // error check parameters
+    if (!fs || fd < 0 || fd >= number_fd || !iov || iovcnt < 0) {
+        return -1;
+    }
+    size_t nbyte = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (!iov[i].iov_base && iov[i].iov_len > 0)
+            return -1;
+        nbyte += iov[i].iov_len;
+    }
+    // define file descriptor, it is held until the new position is stored
+    journal_enter(fs, false);
+    fileDescriptor_t file_desc;
+    if (!fd_acquire(fs, fd, &file_desc)) {
+        journal_exit(fs);
+        return -2;
+    }
 
+    // define inode, changed in place in the inode cache
+    inode_t *inode = inode_get(fs, file_desc.inodeNum);
+    if (inode == NULL) {
+        pthread_mutex_unlock(&fs->fd_locks[fd]);
+        journal_exit(fs);
+        return 0;
+    }
+    inode_lock(fs, file_desc.inodeNum, true);
+
+    off_t head = getPrevOffset(&file_desc);
     ssize_t total_bytes_written = 0;
 
-    if (fd_loc < NUM_DIRECT_PTR) {
-        total_bytes_written = write_direct_block(fs, &inode, fd_loc, fd_off, src, nbyte);
-    } else if (fd_loc >= NUM_DIRECT_PTR && fd_loc < NUM_INDIRECT_PTR + NUM_DIRECT_PTR) {
-        size_t indir_block_id;
-        if (inode.indirectPointer[0] == 0) {
-            indir_block_id = allocate_indirectPtr_block(fs);
-            if (indir_block_id == SIZE_MAX) {
-                return 0;
-            }
-            inode.indirectPointer[0] = indir_block_id;
-        } else {
-            indir_block_id = inode.indirectPointer[0];
-        }
-        total_bytes_written = write_indirect_block(fs, &inode, fd_loc, fd_off, src, nbyte, indir_block_id);
-    } else if (fd_loc >= NUM_INDIRECT_PTR + NUM_DIRECT_PTR){
-        total_bytes_written = write_double_direct_block(fs, &inode, fd_loc, fd_off, src, nbyte);
+    // grab every new block this write needs in one go rather than one bitmap search per block
+    reserve_write_extent(fs, head, nbyte, inode->fileSize);
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+
+        ssize_t bytes_written = write_to_position(fs, inode, file_desc.locate_order, file_desc.locate_offset, iov[i].iov_base, iov[i].iov_len);
+        updateFD(&file_desc, bytes_written);
+        total_bytes_written += bytes_written;
+        if ((size_t) bytes_written < iov[i].iov_len)
+            break;
     }
+    release_write_extent(fs);
+
+    // update inode, overwriting inside the file doesn't grow it
+    if ((size_t) head + total_bytes_written > inode->fileSize)
+        inode->fileSize = head + total_bytes_written;
+    inode_mark_dirty(fs, file_desc.inodeNum);
+    inode_unlock(fs, file_desc.inodeNum);
 
     // update file descriptor
-    updateFD(&file_desc, total_bytes_written);
     block_store_fd_write(fs->BlockStore_fd, fd, &file_desc);
+    pthread_mutex_unlock(&fs->fd_locks[fd]);
+    journal_exit(fs);
+
+    return total_bytes_written;
+}
+
+///
+/// Reads data from the file linked to the given descriptor at an absolute offset
+///   The R/W position of the descriptor is neither used nor changed
+///   Reading past EOF returns data up to EOF
+/// \param fs The FS containing the file
+/// \param fd The file to read from
+/// \param dst The buffer to write to
+/// \param nbyte The number of bytes to read
+/// \param offset Offset from BOF to start reading at
+/// \return number of bytes read (< nbyte IFF read passes EOF), < 0 on error
+///
+ssize_t fs_pread(FS_t *fs, int fd, void *dst, size_t nbyte, off_t offset)
+{
+    // error check parameters
+    if(!fs || fd < 0 || fd >= number_fd || !dst || offset < 0) {
+        return -1;
+    }
+
+    // the descriptor is only needed to find the inode, it is let go once the inode is locked
+    // so calls at different offsets through one descriptor don't wait on each other
+    fileDescriptor_t file_desc;
+    if(!fd_acquire(fs, fd, &file_desc)) {
+        return -2;
+    }
+    inode_t *fd_inode = inode_get(fs, file_desc.inodeNum);
+    if(fd_inode == NULL) {
+        pthread_mutex_unlock(&fs->fd_locks[fd]);
+        return 0;
+    }
+    inode_lock(fs, file_desc.inodeNum, false);
+    pthread_mutex_unlock(&fs->fd_locks[fd]);
+
+    ssize_t bytes_read = 0;
+    if((size_t) offset < fd_inode->fileSize && nbyte > 0) {
+        if(nbyte > fd_inode->fileSize - offset) {
+            nbyte = fd_inode->fileSize - offset;
+        }
+        // block slot and offset inside it come straight from the byte offset
+        bytes_read = read_from_position(fs, fd_inode, offset / BLOCK_SIZE_BYTES, offset % BLOCK_SIZE_BYTES, dst, nbyte);
+    }
+    inode_unlock(fs, file_desc.inodeNum);
+    return bytes_read;
+}
+
+///
+/// Writes data to the file linked to the given descriptor at an absolute offset
+///   The R/W position of the descriptor is neither used nor changed
+///   Writing past EOF extends the file, the gap is left as a hole that reads as zeros
+///   and takes no blocks
+/// \param fs The FS containing the file
+/// \param fd The file to write to
+/// \param src The buffer to read from
+/// \param nbyte The number of bytes to write
+/// \param offset Offset from BOF to start writing at
+/// \return number of bytes written (< nbyte IFF out of space), < 0 on error
+///
+ssize_t fs_pwrite(FS_t *fs, int fd, const void *src, size_t nbyte, off_t offset)
+{
+    // error check parameters
+    if (!fs || fd < 0 || fd >= number_fd || !src || offset < 0) {
+        return -1;
+    }
+    journal_enter(fs, false);
+    fileDescriptor_t file_desc;
+    if (!fd_acquire(fs, fd, &file_desc)) {
+        journal_exit(fs);
+        return -2;
+    }
+    // locate_order is 16 bits, nothing past that can be addressed
+    if ((uint64_t) offset / BLOCK_SIZE_BYTES > UINT16_MAX) {
+        pthread_mutex_unlock(&fs->fd_locks[fd]);
+        journal_exit(fs);
+        return -1;
+    }
+    inode_t *inode = inode_get(fs, file_desc.inodeNum);
+    if (inode == NULL || nbyte == 0) {
+        pthread_mutex_unlock(&fs->fd_locks[fd]);
+        journal_exit(fs);
+        return 0;
+    }
+    // as with fs_pread the descriptor is only held until the inode is locked
+    inode_lock(fs, file_desc.inodeNum, true);
+    pthread_mutex_unlock(&fs->fd_locks[fd]);
 
-    // update inode
-    inode.fileSize += total_bytes_written;
-    block_store_inode_write(fs->BlockStore_inode, file_desc.inodeNum, &inode);
+    reserve_write_extent(fs, offset, nbyte, inode->fileSize);
+    ssize_t total_bytes_written = write_to_position(fs, inode, offset / BLOCK_SIZE_BYTES, offset % BLOCK_SIZE_BYTES, src, nbyte);
+    release_write_extent(fs);
+
+    // only the inode changes, the descriptor is left alone
+    if ((size_t) offset + total_bytes_written > inode->fileSize)
+        inode->fileSize = offset + total_bytes_written;
+    inode_mark_dirty(fs, file_desc.inodeNum);
+    inode_unlock(fs, file_desc.inodeNum);
+    journal_exit(fs);
 
     return total_bytes_written;
 }
 
+///
+/// Waits for the data written to a file to reach the backing file, only the blocks of
+/// that file written since they were last synced go out. Its size and block pointers
+/// go with a journal commit, or are synced along with it without a journal
+/// \param fs The FS containing the file
+/// \param fd The file to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_fsync(FS_t *fs, int fd)
+{
+    if(!fs || fd < 0 || fd >= number_fd)
+    {
+        return -1;
+    }
+    fileDescriptor_t file_desc;
+    if(!fd_acquire(fs, fd, &file_desc))
+    {
+        return -2;
+    }
+    inode_t *inode = inode_get(fs, file_desc.inodeNum);
+    if(inode == NULL)
+    {
+        pthread_mutex_unlock(&fs->fd_locks[fd]);
+        return -1;
+    }
+    // a read lock keeps writers to the file out, so its blocks stay put while they are synced
+    inode_lock(fs, file_desc.inodeNum, false);
+    pthread_mutex_unlock(&fs->fd_locks[fd]);
+    ssize_t synced = file_sync_blocks(fs, inode, !fs->journal);
+    if(!fs->journal && synced >= 0)
+    {
+        inode_flush(fs, file_desc.inodeNum);
+        // the bitmaps and the inode table, they are few enough to go out whole
+        if(store_sync_metadata(fs) < 0)
+        {
+            synced = -1;
+        }
+    }
+    inode_unlock(fs, file_desc.inodeNum);
+    if(synced < 0)
+    {
+        return -1;
+    }
+    // the data is on disk before the metadata that points at it is committed
+    return journal_commit(fs, false);
+}
+
+///
+/// Deletes the specified file and closes all open descriptors to the file
+///   Directories can only be removed when empty
+///   The blocks and the inode are freed in the background once the last link to the file is gone
+/// \param fs The FS containing the file
+/// \param path Absolute path to file to remove
+/// \return 0 on success, < 0 on error
+///
 int fs_remove(FS_t *fs, const char *path)
 {
-    UNUSED(fs);
-    UNUSED(path);
-    return 0;
+    if(fs != NULL && path != NULL && strlen(path) != 0)
+    {
+        // the root has no parent, resolve_path won't hand it back as a last filename
+        const char * name = NULL;
+        size_t name_len = 0;
+        size_t parent_inode_ID = resolve_path(fs, path, &name, &name_len);
+        size_t file_inode_ID = parent_inode_ID == SIZE_MAX ? SIZE_MAX : dir_lookup(fs, parent_inode_ID, name, name_len);
+        if(file_inode_ID == SIZE_MAX)
+        {
+            return -1;
+        }
+
+        // the name is looked up again with both locked, it may have gone in the meantime.
+        // A directory has to be emptied first
+        journal_enter(fs, false);
+        size_t locked[2] = {parent_inode_ID, file_inode_ID};
+        inode_lock_set(fs, locked, 2);
+        inode_t * file_inode = inode_get(fs, file_inode_ID);
+        if(dir_lookup_locked(fs, parent_inode_ID, name, name_len) != file_inode_ID ||
+                (file_inode->fileType == 'd' && file_inode->dirEntries != 0))
+        {
+            inode_unlock_set(fs, locked, 2);
+            journal_exit(fs);
+            return -1;
+        }
+
+        dir_remove_entry(fs, parent_inode_ID, name, name_len);
+        bool last = --file_inode->linkCount == 0;
+        inode_mark_dirty(fs, file_inode_ID);
+        if(last)
+        {
+            // the orphan mark (linkCount 0) has to reach the inode store, reclaim_step and fs_mount go by it
+            inode_flush(fs, file_inode_ID);
+        }
+        inode_unlock_set(fs, locked, 2);
+        if(!last)
+        {
+            journal_exit(fs);
+            return 0;
+        }
+
+        // last link, nothing can reach the file any more. Once its descriptors are closed
+        // nothing else can change it and the reclaimer can have it
+        for(int fd = 0; fd < number_fd; fd++)
+        {
+            fileDescriptor_t file_desc;
+            if(fd_acquire(fs, fd, &file_desc))
+            {
+                if(file_desc.inodeNum == file_inode_ID)
+                {
+                    fd_close_locked(fs, fd, &file_desc);
+                }
+                pthread_mutex_unlock(&fs->fd_locks[fd]);
+            }
+        }
+        reclaim_queue(fs, file_inode_ID);
+        journal_exit(fs);
+        return 0;
+    }
+    return -1;
 }
 
+///
+/// Moves the file from one location to the other
+///   Only the two directory entries change, the inode and the data stay where they are,
+///   so open descriptors keep working
+/// \param fs The FS containing the file
+/// \param src Absolute path of the file to move
+/// \param dst Absolute path to move the file to
+/// \return 0 on success, < 0 on error
+///
 int fs_move(FS_t *fs, const char *src, const char *dst)
 {
-    UNUSED(fs);
-    UNUSED(src);
-    UNUSED(dst);
-    return 0;
+    if(fs != NULL && src != NULL && dst != NULL)
+    {
+        // neither end can be the root, resolve_path won't hand it back as a last filename.
+        // Moves go one at a time with the links, so the subtree checked below can't change under it
+        journal_enter(fs, false);
+        pthread_mutex_lock(&fs->rename_lock);
+        const char * src_name = NULL, * dst_name = NULL;
+        size_t src_len = 0, dst_len = 0;
+        size_t src_parent_ID = resolve_path(fs, src, &src_name, &src_len);
+        size_t dst_parent_ID = resolve_path(fs, dst, &dst_name, &dst_len);
+        size_t file_inode_ID = src_parent_ID == SIZE_MAX ? SIZE_MAX : dir_lookup(fs, src_parent_ID, src_name, src_len);
+
+        // a directory can't go inside itself
+        if(file_inode_ID == SIZE_MAX || dst_parent_ID == SIZE_MAX || subtree_contains(fs, file_inode_ID, dst_parent_ID))
+        {
+            pthread_mutex_unlock(&fs->rename_lock);
+            journal_exit(fs);
+            return -1;
+        }
+
+        // both names are checked with the directories locked, the source may be gone or the destination
+        // taken by now. The new entry goes in first, the destination may be full
+        size_t locked[2] = {src_parent_ID, dst_parent_ID};
+        inode_lock_set(fs, locked, 2);
+        int moved = -1;
+        if(dir_lookup_locked(fs, src_parent_ID, src_name, src_len) == file_inode_ID &&
+                dir_lookup_locked(fs, dst_parent_ID, dst_name, dst_len) == SIZE_MAX &&
+                inode_get(fs, dst_parent_ID)->linkCount > 0 &&
+                dir_add_entry(fs, dst_parent_ID, dst_name, dst_len, file_inode_ID) == 0)
+        {
+            dir_remove_entry(fs, src_parent_ID, src_name, src_len);
+            moved = 0;
+        }
+        inode_unlock_set(fs, locked, 2);
+        pthread_mutex_unlock(&fs->rename_lock);
+        journal_exit(fs);
+        return moved;
+    }
+    return -1;
 }
 
+///
+/// Link the dst with the src
+///   dst is another directory entry for the inode of src, nothing is copied.
+///   A directory can't be linked inside itself, the cycle would never drop to linkCount 0
+/// \param fs The FS containing the file
+/// \param src Absolute path of the source file
+/// \param dst Absolute path to link the source to
+/// \return 0 on success, < 0 on error
+///
 int fs_link(FS_t *fs, const char *src, const char *dst)
 {
-    UNUSED(fs);
-    UNUSED(src);
-    UNUSED(dst);
-    return 0;
+    if(fs != NULL && src != NULL && dst != NULL)
+    {
+        // links go one at a time with the moves, so the subtree checked below can't change under it
+        journal_enter(fs, false);
+        pthread_mutex_lock(&fs->rename_lock);
+        const char * src_name = NULL, * dst_name = NULL;
+        size_t src_len = 0, dst_len = 0;
+        size_t src_parent_ID = resolve_path(fs, src, &src_name, &src_len);
+        size_t file_inode_ID = src_parent_ID == SIZE_MAX ? SIZE_MAX : dir_lookup(fs, src_parent_ID, src_name, src_len);
+        size_t dst_parent_ID = resolve_path(fs, dst, &dst_name, &dst_len);
+        if(file_inode_ID == SIZE_MAX || dst_parent_ID == SIZE_MAX || subtree_contains(fs, file_inode_ID, dst_parent_ID))
+        {
+            pthread_mutex_unlock(&fs->rename_lock);
+            journal_exit(fs);
+            return -1;
+        }
+
+        // the source has to still be there when the link count goes up, so its directory is locked too
+        size_t locked[3] = {src_parent_ID, dst_parent_ID, file_inode_ID};
+        inode_lock_set(fs, locked, 3);
+        int linked = -1;
+        if(dir_lookup_locked(fs, src_parent_ID, src_name, src_len) == file_inode_ID &&
+                dir_lookup_locked(fs, dst_parent_ID, dst_name, dst_len) == SIZE_MAX &&
+                inode_get(fs, dst_parent_ID)->linkCount > 0 &&
+                dir_add_entry(fs, dst_parent_ID, dst_name, dst_len, file_inode_ID) == 0)
+        {
+            inode_get(fs, file_inode_ID)->linkCount++;
+            inode_mark_dirty(fs, file_inode_ID);
+            linked = 0;
+        }
+        inode_unlock_set(fs, locked, 3);
+        pthread_mutex_unlock(&fs->rename_lock);
+        journal_exit(fs);
+        return linked;
+    }
+    return -1;
 }
 
 
@@ -926,20 +1569,18 @@ int fs_link(FS_t *fs, const char *src, const char *dst)
 ///
 ssize_t read_direct_block(FS_t *fs, inode_t *inode, uint16_t fd_loc,uint16_t fd_off, void *dst, size_t nbyte)
 {
-    // error check parameters
     uint16_t block_id = inode->directPointer[fd_loc];
-    if(block_id == 0)
-        return 0;
 
     size_t blanks = BLOCK_SIZE_BYTES - fd_off;
     if(blanks > nbyte)
         blanks = nbyte;
 
-    uint8_t file_block[BLOCK_SIZE_BYTES];
-    // read entire block store from block id into file block
-    block_store_read(fs->BlockStore_whole, block_id, file_block);
-    // copy to destination
-    memcpy(dst, file_block + fd_off, blanks);
+    // a pointer of 0 is a hole, it reads as zeros without going to the block store.
+    // Otherwise only the requested range is copied out of the block
+    if(block_id == 0)
+        memset(dst, 0, blanks);
+    else if(block_store_n_read(fs->BlockStore_whole, block_id, fd_off, dst, blanks) != blanks)
+        return 0;
 
     // remove blank spaces from nbyte
     nbyte -= blanks;
@@ -964,48 +1605,43 @@ ssize_t read_direct_block(FS_t *fs, inode_t *inode, uint16_t fd_loc,uint16_t fd_
 ///
 ssize_t write_direct_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, const void *src, size_t nbyte)
 {
-    // buffer
-    uint8_t curr_block[BLOCK_SIZE_BYTES];
-    memset(curr_block, '\0', BLOCK_SIZE_BYTES);
-
     size_t blanks = BLOCK_SIZE_BYTES - fd_off;
     if(blanks >  nbyte)
         blanks = nbyte;
 
-    // write source src to current block buffer
     size_t block_id;
     if(inode->directPointer[fd_loc] == 0) {
-        block_id = block_store_allocate(fs->BlockStore_whole);
+        block_id = allocate_data_block(fs, fd_loc > 0 ? inode->directPointer[fd_loc - 1] : 0);
         if(block_id == SIZE_MAX) {
             printf("file block full\n");
             return 0;
         }
         inode->directPointer[fd_loc] = block_id;
-        memcpy(curr_block, src, BLOCK_SIZE_BYTES);
+        // fresh block, don't leave whatever its last owner wrote around the data. A later
+        // write further out would otherwise turn the tail into readable file contents
+        block_store_n_write(fs->BlockStore_whole, block_id, 0, zero_block, fd_off);
+        block_store_n_write(fs->BlockStore_whole, block_id, fd_off + blanks, zero_block, BLOCK_SIZE_BYTES - fd_off - blanks);
     } else {
         block_id = inode->directPointer[fd_loc];
-        block_store_read(fs->BlockStore_whole, block_id, curr_block);
-        memcpy(curr_block + fd_off, src, blanks);
     }
 
-    block_store_write(fs->BlockStore_whole, block_id, curr_block);
+    // only the bytes being written are touched
+    if(block_store_n_write(fs->BlockStore_whole, block_id, fd_off, src, blanks) != blanks)
+        return 0;
 
     nbyte -= blanks;
     if(nbyte == 0)
         return blanks;
-    if(fd_loc + 1 < fd_size) {
+    if(fd_loc + 1 < NUM_DIRECT_PTR) {
         return blanks + write_direct_block(fs, inode, fd_loc + 1, 0, src + blanks, nbyte);
     } else {
         // indirect pointer
         size_t indir_block_id;
         if(inode->indirectPointer[0] == 0) {
-            uint16_t indirectPtr_block_buffer[NUM_INDIRECT_PTR];
-            size_t ind_block_id = block_store_allocate(fs->BlockStore_whole);
-            if(ind_block_id == SIZE_MAX)
-                return 0;
-            memset(indirectPtr_block_buffer, '\0', BLOCK_SIZE_BYTES);
-            block_store_write(fs->BlockStore_whole, ind_block_id, indirectPtr_block_buffer);
-            indir_block_id = ind_block_id;
+            indir_block_id = allocate_indirectPtr_block(fs);
+            if(indir_block_id == SIZE_MAX)
+                return blanks;
+            inode->indirectPointer[0] = indir_block_id;
         } else {
             indir_block_id = inode->indirectPointer[0];
         }
@@ -1026,28 +1662,36 @@ ssize_t write_direct_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t f
 ///
 ssize_t read_indirect_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, void *dst, size_t nbyte, uint16_t indirect_block_id)
 {
-    // error check parameters
-    if(indirect_block_id == 0)
-        return 0;
-
-    uint16_t indirect_ptr_buff[NUM_INDIRECT_PTR];
-    // read indirect block store into indirect ptr buffer
-    block_store_read(fs->BlockStore_whole, indirect_block_id, indirect_ptr_buff);
     uint16_t indirect_ptr_id = (fd_loc - 6) % NUM_DOUBLE_DIRECT_PTR;
     ssize_t bytes_read = 0;
 
+    // no pointer block, every block it would point to is a hole
+    if(indirect_block_id == 0) {
+        size_t hole = (size_t) (NUM_INDIRECT_PTR - indirect_ptr_id) * BLOCK_SIZE_BYTES - fd_off;
+        if(hole > nbyte)
+            hole = nbyte;
+        memset(dst, 0, hole);
+        nbyte -= hole;
+        dst += hole;
+        bytes_read += hole;
+        fd_loc += NUM_INDIRECT_PTR - indirect_ptr_id;
+        fd_off = 0;
+        indirect_ptr_id = NUM_INDIRECT_PTR;
+    }
+
     while(indirect_ptr_id < NUM_INDIRECT_PTR && nbyte > 0) {
-        size_t block_id = indirect_ptr_buff[indirect_ptr_id];
-        if(block_id == 0)
-            return bytes_read;
+        // look up just the pointer we need
+        uint16_t block_id = 0;
+        block_store_n_read(fs->BlockStore_whole, indirect_block_id, indirect_ptr_id * sizeof(uint16_t), &block_id, sizeof(uint16_t));
 
-        uint8_t block_buff[BLOCK_SIZE_BYTES];
-        block_store_read(fs->BlockStore_whole, block_id, block_buff);
         size_t blanks = BLOCK_SIZE_BYTES - fd_off;
 
         if(blanks > nbyte)
             blanks = nbyte;
-        memcpy(dst, block_buff + fd_off, blanks);
+        if(block_id == 0)
+            memset(dst, 0, blanks);
+        else if(block_store_n_read(fs->BlockStore_whole, block_id, fd_off, dst, blanks) != blanks)
+            return bytes_read;
 
         // increment values
         nbyte -= blanks;
@@ -1077,31 +1721,37 @@ ssize_t read_indirect_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t
 ///
 ssize_t write_indirect_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, const void *src, size_t nbyte, size_t indir_block_id)
 {
-    uint16_t indir_ptr_buff[NUM_INDIRECT_PTR];
-    block_store_read(fs->BlockStore_whole, indir_block_id, indir_ptr_buff);
     uint16_t indir_ptr_id = (fd_loc - fd_size) % NUM_DOUBLE_DIRECT_PTR;
     ssize_t bytes_written = 0;
+    // last block of the file seen so far, next allocation goes right after it.
+    // The first entry goes right after the pointer block itself
+    size_t prev_block = indir_block_id;
 
     // write indirect pointer
     while(indir_ptr_id < NUM_INDIRECT_PTR && nbyte > 0) {
-        size_t block_id;
-        if(indir_ptr_buff[indir_ptr_id] == 0) {
-            block_id = block_store_allocate(fs->BlockStore_whole);
-            if(block_id == SIZE_MAX) {
-                block_store_write(fs->BlockStore_whole, indir_block_id, indir_ptr_buff);
-                return bytes_written;
-            }
-            indir_ptr_buff[indir_ptr_id] = block_id;
-        } else {
-            block_id = indir_ptr_buff[indir_ptr_id];
-        }
-
+        const size_t slot = indir_ptr_id * sizeof(uint16_t);
         size_t blanks = BLOCK_SIZE_BYTES - fd_off;
         if(blanks > nbyte)
             blanks = nbyte;
 
-        uint8_t write_buff[BLOCK_SIZE_BYTES];
-        block_store_write(fs->BlockStore_whole, block_id, write_buff);
+        uint16_t block_id = 0;
+        block_store_n_read(fs->BlockStore_whole, indir_block_id, slot, &block_id, sizeof(uint16_t));
+        if(block_id == 0) {
+            size_t new_block = allocate_data_block(fs, prev_block);
+            if(new_block == SIZE_MAX) {
+                return bytes_written;
+            }
+            block_id = new_block;
+            // only the one pointer entry changes
+            block_store_n_write(fs->BlockStore_whole, indir_block_id, slot, &block_id, sizeof(uint16_t));
+            journal_dirty(fs, indir_block_id);
+            block_store_n_write(fs->BlockStore_whole, block_id, 0, zero_block, fd_off);
+            block_store_n_write(fs->BlockStore_whole, block_id, fd_off + blanks, zero_block, BLOCK_SIZE_BYTES - fd_off - blanks);
+        }
+        prev_block = block_id;
+
+        if(block_store_n_write(fs->BlockStore_whole, block_id, fd_off, src, blanks) != blanks)
+            return bytes_written;
 
         nbyte -= blanks;
         indir_ptr_id += 1;
@@ -1111,10 +1761,7 @@ ssize_t write_indirect_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t
         fd_off = 0;
     }
 
-    block_store_write(fs->BlockStore_whole, indir_block_id, indir_ptr_buff);
-
     if(nbyte == 0) {
-        printf("nbyte = 0\n");
         return bytes_written;
     }
 
@@ -1133,19 +1780,15 @@ ssize_t write_indirect_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t
 ///
 ssize_t read_doubleDirect_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, void *dst, size_t nbyte)
 {
-    // error check parameters
-    if(inode->doubleIndirectPointer == 0)
-        return 0;
-
-    uint16_t doub_dir_ptr_buff[NUM_DOUBLE_DIRECT_PTR];
-    block_store_read(fs->BlockStore_whole, inode->doubleIndirectPointer, doub_dir_ptr_buff);
-
-    // check double direct pointer buffer was written to
     int idx = (fd_loc - (6 + NUM_INDIRECT_PTR)) / NUM_DOUBLE_DIRECT_PTR;
-    if(doub_dir_ptr_buff[idx] == 0)
+    if(idx >= NUM_DOUBLE_DIRECT_PTR)
         return 0;
+    uint16_t indir_block_id = 0;
+    if(inode->doubleIndirectPointer != 0)
+        block_store_n_read(fs->BlockStore_whole, inode->doubleIndirectPointer, idx * sizeof(uint16_t), &indir_block_id, sizeof(uint16_t));
 
-    return read_indirect_block(fs, inode, fd_loc, fd_off, dst, nbyte, doub_dir_ptr_buff[idx]);
+    // a missing pointer block is a hole, read_indirect_block zero fills it
+    return read_indirect_block(fs, inode, fd_loc, fd_off, dst, nbyte, indir_block_id);
 }
 
 ///
@@ -1162,64 +1805,232 @@ ssize_t write_double_direct_block(FS_t *fs, inode_t *inode, uint16_t fd_loc, uin
 {
     size_t doub_dir_block_id;
     if(inode->doubleIndirectPointer == 0) {
-        uint16_t indir_ptr_block_buff[NUM_INDIRECT_PTR];
-        size_t block_id = block_store_allocate(fs->BlockStore_whole);
-        if(block_id == SIZE_MAX) {
-            printf("block id == size max\n");
+        doub_dir_block_id = allocate_indirectPtr_block(fs);
+        if(doub_dir_block_id == SIZE_MAX) {
             return 0;
         }
-        memset(indir_ptr_block_buff, '\0', BLOCK_SIZE_BYTES);
-        block_store_write(fs->BlockStore_whole, block_id, indir_ptr_block_buff);
-        doub_dir_block_id = block_id;
-
         inode->doubleIndirectPointer = doub_dir_block_id;
     } else {
         doub_dir_block_id = inode->doubleIndirectPointer;
     }
 
-    uint16_t doub_dir_ptr_buff[NUM_DOUBLE_DIRECT_PTR];
-    block_store_read(fs->BlockStore_whole, doub_dir_block_id, doub_dir_ptr_buff);
-    int idx = (fd_loc - (fd_size + NUM_INDIRECT_PTR)) / NUM_DOUBLE_DIRECT_PTR;
+    int idx = (fd_loc - (NUM_DIRECT_PTR + NUM_INDIRECT_PTR)) / NUM_DOUBLE_DIRECT_PTR;
+    if(idx >= NUM_DOUBLE_DIRECT_PTR)
+        return 0;
 
-    size_t indir_block_id;
-    if(doub_dir_ptr_buff[idx] == 0) {
-        uint16_t indir_ptr_block_buff[NUM_INDIRECT_PTR];
-        size_t block_id = block_store_allocate(fs->BlockStore_whole);
-        if(block_id == SIZE_MAX) {
-            printf("block id == size max\n");
+    uint16_t entry = 0;
+    block_store_n_read(fs->BlockStore_whole, doub_dir_block_id, idx * sizeof(uint16_t), &entry, sizeof(uint16_t));
+    size_t indir_block_id = entry;
+    if(indir_block_id == 0) {
+        indir_block_id = allocate_indirectPtr_block(fs);
+        if(indir_block_id == SIZE_MAX) {
             return 0;
         }
-        memset(indir_ptr_block_buff, '\0', BLOCK_SIZE_BYTES);
-        block_store_write(fs->BlockStore_whole, block_id, indir_ptr_block_buff);
-        indir_block_id = block_id;
-
-        doub_dir_ptr_buff[idx] = indir_block_id;
-        block_store_write(fs->BlockStore_whole, doub_dir_block_id, doub_dir_ptr_buff);
-    } else {
-        indir_block_id = doub_dir_ptr_buff[idx];
+        entry = indir_block_id;
+        block_store_n_write(fs->BlockStore_whole, doub_dir_block_id, idx * sizeof(uint16_t), &entry, sizeof(uint16_t));
+        journal_dirty(fs, doub_dir_block_id);
     }
 
     return write_indirect_block(fs, inode, fd_loc, fd_off, src, nbyte, indir_block_id);
 }
 
+///
+/// Byte of the inline data of a tiny file. The inline_data_max bytes are kept in two pieces
+/// so the fields keep their offsets: the first inline_head in owner, the rest in place of
+/// the block pointers
+/// \param inode inode with mapType 'i'
+/// \param pos byte of the data, below inline_data_max
+/// \param span set to the bytes from there to the end of its piece
+/// \return the byte in the inode
+///
+static uint8_t* inline_at(inode_t *inode, size_t pos, size_t *span)
+{
+    if(pos < inline_head)
+    {
+        *span = inline_head - pos;
+        return (uint8_t *) inode->owner + pos;
+    }
+    // the rest runs on past directPointer into the other block pointers, so it is addressed from the inode
+    *span = inline_data_max - pos;
+    return (uint8_t *) inode + offsetof(inode_t, directPointer) + pos - inline_head;
+}
+
+///
+/// Copy out of the inline data of a tiny file
+/// \param inode inode with mapType 'i'
+/// \param pos first byte to copy
+/// \param dst destination
+/// \param nbyte bytes to copy, pos + nbyte is at most inline_data_max
+///
+static void inline_load(inode_t *inode, size_t pos, void *dst, size_t nbyte)
+{
+    while(nbyte > 0)
+    {
+        size_t span;
+        const uint8_t *from = inline_at(inode, pos, &span);
+        if(span > nbyte)
+            span = nbyte;
+        memcpy(dst, from, span);
+        dst = (uint8_t *) dst + span;
+        pos += span;
+        nbyte -= span;
+    }
+}
+
+///
+/// Copy into the inline data of a tiny file
+/// \param inode inode with mapType 'i'
+/// \param pos first byte to copy to
+/// \param src source
+/// \param nbyte bytes to copy, pos + nbyte is at most inline_data_max
+///
+static void inline_store(inode_t *inode, size_t pos, const void *src, size_t nbyte)
+{
+    while(nbyte > 0)
+    {
+        size_t span;
+        uint8_t *to = inline_at(inode, pos, &span);
+        if(span > nbyte)
+            span = nbyte;
+        memcpy(to, src, span);
+        src = (const uint8_t *) src + span;
+        pos += span;
+        nbyte -= span;
+    }
+}
+
+///
+/// Zero the inline data of a tiny file, so nothing reads it as block pointers
+/// \param inode inode with mapType 'i'
+///
+static void inline_clear(inode_t *inode)
+{
+    memset(inode->owner, 0, inline_head);
+    memset((uint8_t *) inode + offsetof(inode_t, directPointer), 0, inline_data_max - inline_head);
+}
+
+///
+/// Move the data of a file that outgrew its inode out to a block, switching it over to the
+/// block map picked at fs_format_map. Either all of the data moves or none of it
+/// \param fs File system
+/// \param inode inode with mapType 'i'
+/// \return 0 on success, < 0 if there is no block for it
+///
+static int inline_spill(FS_t *fs, inode_t *inode)
+{
+    uint8_t data[inline_data_max];
+    inline_load(inode, 0, data, inline_data_max);
+    inline_clear(inode);
+    inode->mapType = fs->extents ? 'e' : 'p';
+    if(inode->fileSize > 0 && (size_t) write_to_position(fs, inode, 0, 0, data, inode->fileSize) != inode->fileSize) {
+        inode->mapType = 'i';
+        inline_store(inode, 0, data, inline_data_max);
+        return -1;
+    }
+    return 0;
+}
+
+///
+/// Read from the file starting at the given block position, picking the direct,
+/// indirect or double indirect range the position falls in
+/// \param fs File system
+/// \param inode source to be read from
+/// \param fd_loc file directory locator
+/// \param fd_off file directory locator offset
+/// \param dst destination to write to
+/// \param nbyte bytes to read
+/// \return bytes read, else 0
+///
+ssize_t read_from_position(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, void *dst, size_t nbyte)
+{
+    if(inode->mapType == 'e') {
+        return read_extents(fs, inode, fd_loc, fd_off, dst, nbyte);
+    }
+    if(inode->mapType == 'i') {
+        // no data block to go to, the inode has it all
+        size_t pos = (size_t) fd_loc * BLOCK_SIZE_BYTES + fd_off;
+        if(pos >= inline_data_max)
+            return 0;
+        if(nbyte > inline_data_max - pos)
+            nbyte = inline_data_max - pos;
+        inline_load(inode, pos, dst, nbyte);
+        return nbyte;
+    }
+    if(fd_loc < NUM_DIRECT_PTR) {
+        return read_direct_block(fs, inode, fd_loc, fd_off, dst, nbyte);
+    } else if(fd_loc < NUM_INDIRECT_PTR + NUM_DIRECT_PTR) {
+        return read_indirect_block(fs, inode, fd_loc, fd_off, dst, nbyte, inode->indirectPointer[0]);
+    }
+    return read_doubleDirect_block(fs, inode, fd_loc, fd_off, dst, nbyte);
+}
+
+///
+/// Write to the file starting at the given block position, picking the direct,
+/// indirect or double indirect range the position falls in
+/// \param fs File system
+/// \param inode destination to write to
+/// \param fd_loc fd locator
+/// \param fd_off fd offset
+/// \param src source to be written
+/// \param nbyte bytes to write
+/// \return written, else 0
+///
+ssize_t write_to_position(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, const void *src, size_t nbyte)
+{
+    if (inode->mapType == 'i') {
+        size_t pos = (size_t) fd_loc * BLOCK_SIZE_BYTES + fd_off;
+        if (pos + nbyte <= inline_data_max) {
+            inline_store(inode, pos, src, nbyte);
+            return nbyte;
+        }
+        if (inline_spill(fs, inode) != 0) {
+            return 0;
+        }
+    }
+    if (inode->mapType == 'e') {
+        return write_extents(fs, inode, fd_loc, fd_off, src, nbyte);
+    }
+    if (fd_loc < NUM_DIRECT_PTR) {
+        return write_direct_block(fs, inode, fd_loc, fd_off, src, nbyte);
+    } else if (fd_loc < NUM_INDIRECT_PTR + NUM_DIRECT_PTR) {
+        if (inode->indirectPointer[0] == 0) {
+            size_t indir_block_id = allocate_indirectPtr_block(fs);
+            if (indir_block_id == SIZE_MAX) {
+                return 0;
+            }
+            inode->indirectPointer[0] = indir_block_id;
+        }
+        return write_indirect_block(fs, inode, fd_loc, fd_off, src, nbyte, inode->indirectPointer[0]);
+    }
+    return write_double_direct_block(fs, inode, fd_loc, fd_off, src, nbyte);
+}
+
 ///
 /// Update file directory
 /// \param fd file descriptor
 /// \param nbyte byte count to add to offset
 /// 
 void updateFD(fileDescriptor_t* fd, ssize_t nbyte) {
-    uint16_t blanks = BLOCK_SIZE_BYTES - fd->locate_offset;
-    if (blanks >= nbyte) {
-        fd->locate_offset += nbyte;
-        if (fd->locate_offset == 1024) {
-            fd->locate_order += 1;
-            fd->locate_offset = 0;
-        }
+    setFDPosition(fd, getPrevOffset(fd) + nbyte);
+}
+
+///
+/// Set the file descriptor to the given byte offset. locate_order is the block index
+/// within the file, usage says which pointer range (direct/indirect/double indirect) it is in.
+/// Plain arithmetic on the layout, no blocks are touched
+/// \param fd file descriptor
+/// \param offset offset from BOF
+///
+void setFDPosition(fileDescriptor_t* fd, off_t offset) {
+    size_t order = offset / BLOCK_SIZE_BYTES;
+    fd->locate_order = order;
+    fd->locate_offset = offset % BLOCK_SIZE_BYTES;
+    if (order < NUM_DIRECT_PTR) {
+        fd->usage = 1;
+    } else if (order < NUM_DIRECT_PTR + NUM_INDIRECT_PTR) {
+        fd->usage = 2;
     } else {
-        nbyte -= blanks;
-        fd->locate_order += 1;
-        fd->locate_order += nbyte / BLOCK_SIZE_BYTES;
-        fd->locate_offset = nbyte % BLOCK_SIZE_BYTES;
+        fd->usage = 4;
     }
 }
 
@@ -1229,39 +2040,1924 @@ void updateFD(fileDescriptor_t* fd, ssize_t nbyte) {
 /// \return block id allocated for indirect pointer, eles SIZE_MAX on error
 ///
 size_t allocate_indirectPtr_block(FS_t* fs) {
-    uint16_t indir_ptr_block_buff[NUM_INDIRECT_PTR];
-    size_t block_id = block_store_allocate(fs->BlockStore_whole);
+    size_t block_id = allocate_data_block(fs, 0);
     if (block_id == SIZE_MAX) {
         return SIZE_MAX;
     }
-    memset(indir_ptr_block_buff, '\0', BLOCK_SIZE_BYTES);
-    block_store_write(fs->BlockStore_whole, block_id, indir_ptr_block_buff);
+    // a pointer of 0 means not allocated yet, so the block has to start out zeroed
+    block_store_write(fs->BlockStore_whole, block_id, zero_block);
+    journal_dirty(fs, block_id);
+    return block_id;
+}
+
+///
+/// Allocate a data block, preferring the one right after the previous block of the file
+/// \param fs File system
+/// \param prev_block block id of the previous block in the file, 0 if there is none
+/// \return allocated block id, SIZE_MAX on error
+///
+size_t allocate_data_block(FS_t* fs, size_t prev_block) {
+    // blocks reserved for the current write come first
+    if (write_extent_count > 0) {
+        write_extent_count--;
+        return write_extent_start++;
+    }
+    // block 0 is never file data, so 0 means no hint and this thread's cursor in the store decides
+    size_t block_id = block_store_allocate_near(fs->BlockStore_whole, prev_block ? prev_block + 1 : SIZE_MAX);
+    // the store may only be full of removed files
+    if (block_id == SIZE_MAX && reclaim_drain(fs)) {
+        return allocate_data_block(fs, prev_block);
+    }
     return block_id;
 }
 
 ///
-/// Get previous file directory offset
+/// Reserve the blocks a write will add past the end of the file as one contiguous extent.
+/// Only the blocks the write covers count, a write far past EOF leaves a hole in between
+/// \param fs File system
+/// \param pos byte offset the write starts at
+/// \param nbyte bytes to be written
+/// \param file_size current size of the file in bytes
+///
+void reserve_write_extent(FS_t* fs, off_t pos, size_t nbyte, size_t file_size) {
+    size_t have = (file_size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    size_t first = (size_t) pos / BLOCK_SIZE_BYTES;
+    if (have < first)
+        have = first;
+    size_t need = ((size_t) pos + nbyte + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    // one block is no better than allocating it on the spot. A fragmented store may not have
+    // the whole run, so settle for shorter ones, whatever isn't covered is allocated per block.
+    for (size_t count = need > have ? need - have : 0; count > 1; count /= 2) {
+        if (block_store_allocate_extent(fs->BlockStore_whole, count, &write_extent_start)) {
+            write_extent_count = count;
+            break;
+        }
+    }
+}
+
+///
+/// Hand back whatever is left of the extent reserved for a write
+/// \param fs File system
+///
+void release_write_extent(FS_t* fs) {
+    if (write_extent_count > 0) {
+        block_store_release_extent(fs->BlockStore_whole, write_extent_start, write_extent_count);
+        write_extent_count = 0;
+    }
+}
+
+///
+/// Get previous file directory offset, the inverse of setFDPosition
 /// \param fd file descriptor to find offset
 /// \return offset result
 /// 
 off_t getPrevOffset(fileDescriptor_t* fileDescriptor) 
 {
-    // define variables
-    off_t res = 0;
-    uint16_t loc = fileDescriptor->locate_order;
-    uint16_t off = fileDescriptor->locate_offset;
-    if (loc == 0) {
-        //printf("offset %u\n", off);
-        return off;
-    }
-    //if(loc == 333)
-    //printf("location 333\n");
-    if (off != 0) {
-        res += (loc - 1) * BLOCK_SIZE_BYTES;
-        res += off;
+    return (off_t) fileDescriptor->locate_order * BLOCK_SIZE_BYTES + fileDescriptor->locate_offset;
+}
+
+///
+/// Get an inode from the inode cache, reading it from the inode store the first time.
+/// Changes are made in place, call inode_mark_dirty after changing it
+/// \param fs File system
+/// \param inode_id inode to get
+/// \return the cached inode, valid until the FS is unmounted, NULL on error
+///
+inode_t* inode_get(FS_t* fs, size_t inode_id) {
+    if (inode_id >= number_inodes) {
+        return NULL;
+    }
+    inodeCacheEntry_t* entry = &fs->inode_cache[inode_id];
+    if (!__atomic_load_n(&entry->loaded, __ATOMIC_ACQUIRE)) {
+        // two threads can miss at once, the second one finds it loaded under the lock
+        pthread_mutex_lock(&fs->cache_lock);
+        bool loaded = __atomic_load_n(&entry->loaded, __ATOMIC_RELAXED);
+        if (!loaded && block_store_inode_read(fs->BlockStore_inode, inode_id, &entry->inode) != 0) {
+            __atomic_store_n(&entry->dirty, false, __ATOMIC_RELAXED);
+            __atomic_store_n(&entry->loaded, true, __ATOMIC_RELEASE);
+            loaded = true;
+        }
+        pthread_mutex_unlock(&fs->cache_lock);
+        if (!loaded) {
+            return NULL;
+        }
+    }
+    return &entry->inode;
+}
+
+///
+/// Pin an inode for an open descriptor
+/// \param fs File system
+/// \param inode_id inode to pin
+/// \return the cached inode, NULL on error
+///
+inode_t* inode_pin(FS_t* fs, size_t inode_id) {
+    inode_t* inode = inode_get(fs, inode_id);
+    if (inode) {
+        __atomic_add_fetch(&fs->inode_cache[inode_id].refcount, 1, __ATOMIC_RELAXED);
+    }
+    return inode;
+}
+
+///
+/// Drop a pin taken by inode_pin, the inode is written back once the last pin is gone
+/// \param fs File system
+/// \param inode_id inode to unpin
+///
+void inode_unpin(FS_t* fs, size_t inode_id) {
+    if (inode_id >= number_inodes) {
+        return;
+    }
+    uint32_t* refcount = &fs->inode_cache[inode_id].refcount;
+    uint32_t pins = __atomic_load_n(refcount, __ATOMIC_RELAXED);
+    while (pins > 0 && !__atomic_compare_exchange_n(refcount, &pins, pins - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    }
+    if (pins == 1) {
+        inode_lock(fs, inode_id, false);
+        inode_flush(fs, inode_id);
+        inode_unlock(fs, inode_id);
+    }
+}
+
+///
+/// Note that a cached inode was changed and has to be written back
+/// \param fs File system
+/// \param inode_id changed inode
+///
+void inode_mark_dirty(FS_t* fs, size_t inode_id) {
+    if (inode_id < number_inodes && __atomic_load_n(&fs->inode_cache[inode_id].loaded, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&fs->inode_cache[inode_id].dirty, true, __ATOMIC_RELAXED);
+    }
+}
+
+///
+/// Write a cached inode back to the inode store if it is dirty.
+/// The caller holds the inode's lock, a read lock is enough
+/// \param fs File system
+/// \param inode_id inode to write back
+///
+void inode_flush(FS_t* fs, size_t inode_id) {
+    // readers can flush side by side, only the one that clears dirty writes
+    if (inode_id < number_inodes && __atomic_exchange_n(&fs->inode_cache[inode_id].dirty, false, __ATOMIC_ACQ_REL)) {
+        block_store_inode_write(fs->BlockStore_inode, inode_id, &fs->inode_cache[inode_id].inode);
+    }
+}
+
+///
+/// Write every dirty cached inode back to the inode store
+/// \param fs File system
+///
+void inode_cache_flush(FS_t* fs) {
+    for (size_t i = 0; i < number_inodes; i++) {
+        if (__atomic_load_n(&fs->inode_cache[i].dirty, __ATOMIC_RELAXED)) {
+            inode_lock(fs, i, false);
+            inode_flush(fs, i);
+            inode_unlock(fs, i);
+        }
+    }
+}
+
+///
+/// Lock an inode. A read lock is enough to read the inode and the blocks it maps,
+/// anything that changes either takes the write lock
+/// \param fs File system
+/// \param inode_id inode to lock
+/// \param write true for the write lock
+///
+void inode_lock(FS_t* fs, size_t inode_id, bool write) {
+    if (write) {
+        pthread_rwlock_wrlock(&fs->inode_cache[inode_id].lock);
     } else {
-        res += loc * BLOCK_SIZE_BYTES;
+        pthread_rwlock_rdlock(&fs->inode_cache[inode_id].lock);
+    }
+}
+
+///
+/// Unlock an inode locked by inode_lock
+/// \param fs File system
+/// \param inode_id inode to unlock
+///
+void inode_unlock(FS_t* fs, size_t inode_id) {
+    pthread_rwlock_unlock(&fs->inode_cache[inode_id].lock);
+}
+
+///
+/// Write lock several inodes, for operations on a directory and the files in it. They are taken
+/// in ascending inode number, so two calls over overlapping sets can't wait on each other
+/// \param fs File system
+/// \param ids inodes to lock, sorted in place. An inode listed twice is locked once
+/// \param count number of inodes, a handful at most
+///
+void inode_lock_set(FS_t* fs, size_t* ids, size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        size_t id = ids[i];
+        size_t j = i;
+        for (; j > 0 && ids[j - 1] > id; j--) {
+            ids[j] = ids[j - 1];
+        }
+        ids[j] = id;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || ids[i] != ids[i - 1]) {
+            inode_lock(fs, ids[i], true);
+        }
+    }
+}
+
+///
+/// Unlock the inodes locked by inode_lock_set
+/// \param fs File system
+/// \param ids inodes as inode_lock_set left them
+/// \param count number of inodes
+///
+void inode_unlock_set(FS_t* fs, const size_t* ids, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || ids[i] != ids[i - 1]) {
+            inode_unlock(fs, ids[i]);
+        }
+    }
+}
+
+///
+/// Set up the locks of a new FS_t, apart from the ones reclaim_start looks after
+/// \param fs File system
+///
+void lock_init(FS_t* fs) {
+    pthread_mutex_init(&fs->cache_lock, NULL);
+    pthread_mutex_init(&fs->rename_lock, NULL);
+    for (size_t i = 0; i < number_inodes; i++) {
+        pthread_rwlock_init(&fs->inode_cache[i].lock, NULL);
+    }
+    for (size_t i = 0; i < dentry_lock_count; i++) {
+        pthread_mutex_init(&fs->dentry_locks[i], NULL);
+    }
+    for (size_t i = 0; i < number_fd; i++) {
+        pthread_mutex_init(&fs->fd_locks[i], NULL);
+    }
+}
+
+///
+/// Tear down the locks set up by lock_init
+/// \param fs File system
+///
+void lock_destroy(FS_t* fs) {
+    for (size_t i = 0; i < number_fd; i++) {
+        pthread_mutex_destroy(&fs->fd_locks[i]);
+    }
+    for (size_t i = 0; i < dentry_lock_count; i++) {
+        pthread_mutex_destroy(&fs->dentry_locks[i]);
+    }
+    for (size_t i = 0; i < number_inodes; i++) {
+        pthread_rwlock_destroy(&fs->inode_cache[i].lock);
+    }
+    pthread_mutex_destroy(&fs->rename_lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+}
+
+///
+/// FNV-1a hash of a name
+/// \param hash starting value
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return the hash
+///
+static uint32_t fnv1a(uint32_t hash, const char* name, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
     }
-    //printf("result %zu\n", res);
-    return res; 
+    return hash;
+}
+
+///
+/// Find the dentry cache slot for a name in a directory
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return the slot the name hashes to
+///
+static dentryCacheEntry_t* dentry_slot(FS_t* fs, size_t parent_id, const char* name, size_t len) {
+    // seeded with the parent so the same name in different directories spreads out
+    uint32_t hash = fnv1a(2166136261u ^ (uint32_t) parent_id, name, len);
+    return &fs->dentry_cache[hash & (dentry_cache_size - 1)];
+}
+
+///
+/// Lock guarding a dentry cache slot
+/// \param fs File system
+/// \param entry the slot
+/// \return the slot's lock
+///
+static pthread_mutex_t* dentry_lock(FS_t* fs, const dentryCacheEntry_t* entry) {
+    return &fs->dentry_locks[(entry - fs->dentry_cache) % dentry_lock_count];
+}
+
+///
+/// Check whether a dentry cache slot holds the given name in the given directory
+/// \param entry slot to check
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return true on a hit
+///
+static bool dentry_matches(const dentryCacheEntry_t* entry, size_t parent_id, const char* name, size_t len) {
+    return entry->valid && entry->parent == parent_id && len < dentry_name_max &&
+        memcmp(entry->name, name, len) == 0 && entry->name[len] == '\0';
+}
+
+///
+/// Remember what a name in a directory refers to
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \param inode_id inode the name refers to, SIZE_MAX if the name doesn't exist
+///
+void dentry_insert(FS_t* fs, size_t parent_id, const char* name, size_t len, size_t inode_id) {
+    if (len >= dentry_name_max) {
+        return;
+    }
+    dentryCacheEntry_t* entry = dentry_slot(fs, parent_id, name, len);
+    pthread_mutex_lock(dentry_lock(fs, entry));
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->parent = parent_id;
+    entry->inode = inode_id == SIZE_MAX ? dentry_negative : inode_id;
+    entry->valid = true;
+    pthread_mutex_unlock(dentry_lock(fs, entry));
+}
+
+///
+/// Forget a name in a directory, for when the directory entry is changed or removed
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+///
+void dentry_invalidate(FS_t* fs, size_t parent_id, const char* name, size_t len) {
+    dentryCacheEntry_t* entry = dentry_slot(fs, parent_id, name, len);
+    pthread_mutex_lock(dentry_lock(fs, entry));
+    if (dentry_matches(entry, parent_id, name, len)) {
+        entry->valid = false;
+    }
+    pthread_mutex_unlock(dentry_lock(fs, entry));
+}
+
+///
+/// Look a name up in the dentry cache only
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \param inode_id set to the inode the name refers to on a hit, SIZE_MAX for a negative entry
+/// \return true on a hit
+///
+static bool dentry_find(FS_t* fs, size_t parent_id, const char* name, size_t len, size_t* inode_id) {
+    dentryCacheEntry_t* entry = dentry_slot(fs, parent_id, name, len);
+    pthread_mutex_lock(dentry_lock(fs, entry));
+    bool hit = dentry_matches(entry, parent_id, name, len);
+    if (hit) {
+        *inode_id = entry->inode == dentry_negative ? SIZE_MAX : entry->inode;
+    }
+    pthread_mutex_unlock(dentry_lock(fs, entry));
+    return hit;
+}
+
+///
+/// Hash of a name in a directory, decides which leaf block the name goes in.
+/// Stored in the leaf headers, so it can't change without reformatting
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return the hash
+///
+static uint32_t dir_hash(const char* name, size_t len) {
+    return fnv1a(2166136261u, name, len);
+}
+
+///
+/// Find the index entry of the leaf a hash falls in
+/// \param index directory index block
+/// \param hash dir_hash of a name
+/// \return position of the last index entry starting at or below the hash
+///
+static uint32_t dir_index_find(const dirIndex_t* index, uint32_t hash) {
+    uint32_t low = 0, high = index->count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (index->entry[mid].hash <= hash) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+///
+/// Allocate a zeroed block for a directory index or leaf
+/// \param fs File system
+/// \return block id, SIZE_MAX on error
+///
+static size_t dir_allocate_block(FS_t* fs) {
+    size_t block_id = allocate_data_block(fs, 0);
+    if (block_id != SIZE_MAX) {
+        block_store_write(fs->BlockStore_whole, block_id, zero_block);
+        journal_dirty(fs, block_id);
+    }
+    return block_id;
+}
+
+///
+/// Search a directory for a name, bypassing the dentry cache. Reads the index block and
+/// the one leaf the name hashes to, however many entries the directory has
+/// \param fs File system
+/// \param dir inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return inode of the file, SIZE_MAX if it isn't in the directory
+///
+static size_t dir_find(FS_t* fs, const inode_t* dir, const char* name, size_t len) {
+    if (dir->directPointer[0] == 0 || len >= sizeof(((directoryFile_t*) NULL)->filename)) {
+        return SIZE_MAX;
+    }
+    const dirIndex_t* index = (const dirIndex_t*) block_store_get_const_ptr(fs->BlockStore_whole, dir->directPointer[0]);
+    uint32_t hash = dir_hash(name, len);
+    const dirLeafHeader_t* leaf = (const dirLeafHeader_t*) block_store_get_const_ptr(fs->BlockStore_whole, index->entry[dir_index_find(index, hash)].block);
+    const directoryFile_t* entries = (const directoryFile_t*) leaf + 1;
+    for (int k = 0; k < folder_number_entries; k++) {
+        if (((leaf->used >> k) & 1) == 1 && leaf->hash[k] == hash &&
+                memcmp(entries[k].filename, name, len) == 0 && entries[k].filename[len] == '\0') {
+            return entries[k].inodeNumber;
+        }
+    }
+    return SIZE_MAX;
+}
+
+///
+/// Look a name up in a directory, through the dentry cache. Misses scan the directory
+/// under its read lock and leave an entry behind, negative if the name isn't there.
+/// Nothing is held afterwards, callers about to change the directory look again with dir_lookup_locked
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return inode of the file, SIZE_MAX if it doesn't exist or parent_id isn't a directory
+///
+size_t dir_lookup(FS_t* fs, size_t parent_id, const char* name, size_t len) {
+    // only directories ever get entries, a hit needs no look at the parent
+    size_t inode_id;
+    if (dentry_find(fs, parent_id, name, len, &inode_id)) {
+        return inode_id;
+    }
+    if (parent_id >= number_inodes) {
+        return SIZE_MAX;
+    }
+    inode_lock(fs, parent_id, false);
+    inode_id = dir_lookup_locked(fs, parent_id, name, len);
+    inode_unlock(fs, parent_id);
+    return inode_id;
+}
+
+///
+/// dir_lookup for a caller already holding the directory's lock
+/// \param fs File system
+/// \param parent_id inode of the directory, locked
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return inode of the file, SIZE_MAX if it doesn't exist or parent_id isn't a directory
+///
+size_t dir_lookup_locked(FS_t* fs, size_t parent_id, const char* name, size_t len) {
+    inode_t* parent = inode_get(fs, parent_id);
+    if (parent == NULL || parent->fileType != 'd') {
+        return SIZE_MAX;
+    }
+
+    size_t inode_id;
+    if (dentry_find(fs, parent_id, name, len, &inode_id)) {
+        return inode_id;
+    }
+    inode_id = dir_find(fs, parent, name, len);
+    dentry_insert(fs, parent_id, name, len, inode_id);
+    return inode_id;
+}
+
+///
+/// Take a name out of a directory. Leaves aren't merged, an emptied leaf stays in the index
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \return inode the name referred to, SIZE_MAX if it wasn't in the directory
+///
+size_t dir_remove_entry(FS_t* fs, size_t parent_id, const char* name, size_t len) {
+    inode_t* dir = inode_get(fs, parent_id);
+    if (dir == NULL || dir->fileType != 'd' || dir->directPointer[0] == 0) {
+        return SIZE_MAX;
+    }
+    const dirIndex_t* index = (const dirIndex_t*) block_store_get_const_ptr(fs->BlockStore_whole, dir->directPointer[0]);
+    uint32_t hash = dir_hash(name, len);
+    dirLeafHeader_t* leaf = (dirLeafHeader_t*) block_store_get_ptr(fs->BlockStore_whole, index->entry[dir_index_find(index, hash)].block);
+    const directoryFile_t* entries = (const directoryFile_t*) leaf + 1;
+    for (int k = 0; k < folder_number_entries && len < sizeof(entries[k].filename); k++) {
+        if (((leaf->used >> k) & 1) == 1 && leaf->hash[k] == hash &&
+                memcmp(entries[k].filename, name, len) == 0 && entries[k].filename[len] == '\0') {
+            leaf->used &= ~(1u << k);
+            journal_dirty_ptr(fs, leaf);
+            dir->dirEntries--;
+            inode_mark_dirty(fs, parent_id);
+            dentry_invalidate(fs, parent_id, name, len);
+            return entries[k].inodeNumber;
+        }
+    }
+    return SIZE_MAX;
+}
+
+///
+/// Split a full directory leaf, moving the upper half of its hashes to a new leaf
+/// \param fs File system
+/// \param index directory index block
+/// \param pos index entry of the full leaf
+/// \return 0 on success, < 0 if the index is full or the names all share one hash
+///
+static int dir_split_leaf(FS_t* fs, dirIndex_t* index, uint32_t pos) {
+    if (index->count == dir_index_max) {
+        return -1;
+    }
+    dirLeafHeader_t* leaf = (dirLeafHeader_t*) block_store_get_ptr(fs->BlockStore_whole, index->entry[pos].block);
+
+    // order the entries by hash
+    uint8_t order[folder_number_entries];
+    for (int i = 0; i < folder_number_entries; i++) {
+        int j = i;
+        for (; j > 0 && leaf->hash[order[j - 1]] > leaf->hash[i]; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    // split in the middle, moved along while that would put one hash in both leaves
+    int mid = folder_number_entries / 2;
+    while (mid < folder_number_entries && leaf->hash[order[mid]] == leaf->hash[order[mid - 1]]) {
+        mid++;
+    }
+    if (mid == folder_number_entries) {
+        for (mid = folder_number_entries / 2; mid > 0 && leaf->hash[order[mid]] == leaf->hash[order[mid - 1]]; mid--) {
+        }
+        if (mid == 0) {
+            return -1;
+        }
+    }
+
+    size_t new_id = dir_allocate_block(fs);
+    if (new_id == SIZE_MAX) {
+        return -1;
+    }
+    dirLeafHeader_t* new_leaf = (dirLeafHeader_t*) block_store_get_ptr(fs->BlockStore_whole, new_id);
+    directoryFile_t* from = (directoryFile_t*) leaf + 1;
+    directoryFile_t* to = (directoryFile_t*) new_leaf + 1;
+    uint32_t split_hash = leaf->hash[order[mid]];
+    for (int i = mid; i < folder_number_entries; i++) {
+        int k = order[i];
+        to[i - mid] = from[k];
+        new_leaf->hash[i - mid] = leaf->hash[k];
+        new_leaf->used |= 1u << (i - mid);
+        leaf->used &= ~(1u << k);
+    }
+
+    memmove(&index->entry[pos + 2], &index->entry[pos + 1], (index->count - pos - 1) * sizeof(dirIndexEntry_t));
+    index->entry[pos + 1].hash = split_hash;
+    index->entry[pos + 1].block = new_id;
+    index->count++;
+    journal_dirty(fs, new_id);
+    journal_dirty_ptr(fs, leaf);
+    journal_dirty_ptr(fs, index);
+    return 0;
+}
+
+///
+/// Add a name to a directory. The index block and the first leaf are allocated with the first
+/// entry, leaves are split as they fill up. The name must not be in the directory already
+/// \param fs File system
+/// \param parent_id inode of the directory
+/// \param name file name, not terminated
+/// \param len length of the name
+/// \param inode_id inode the name refers to
+/// \return 0 on success, < 0 if parent_id isn't a directory or the directory can't grow
+///
+int dir_add_entry(FS_t* fs, size_t parent_id, const char* name, size_t len, size_t inode_id) {
+    inode_t* dir = inode_get(fs, parent_id);
+    if (dir == NULL || dir->fileType != 'd' || len >= sizeof(((directoryFile_t*) NULL)->filename)) {
+        return -1;
+    }
+
+    if (dir->directPointer[0] == 0) {
+        size_t index_id = dir_allocate_block(fs);
+        size_t leaf_id = index_id == SIZE_MAX ? SIZE_MAX : dir_allocate_block(fs);
+        if (leaf_id == SIZE_MAX) {
+            if (index_id != SIZE_MAX) {
+                journal_free(fs, index_id, 1);
+                block_store_release(fs->BlockStore_whole, index_id);
+            }
+            return -1;
+        }
+        dirIndex_t* index = (dirIndex_t*) block_store_get_ptr(fs->BlockStore_whole, index_id);
+        index->count = 1;
+        index->entry[0].hash = 0;
+        index->entry[0].block = leaf_id;
+        dir->directPointer[0] = index_id;
+    }
+
+    dirIndex_t* index = (dirIndex_t*) block_store_get_ptr(fs->BlockStore_whole, dir->directPointer[0]);
+    uint32_t hash = dir_hash(name, len);
+    uint32_t pos = dir_index_find(index, hash);
+    dirLeafHeader_t* leaf = (dirLeafHeader_t*) block_store_get_ptr(fs->BlockStore_whole, index->entry[pos].block);
+    if (leaf->used == dir_leaf_full) {
+        if (dir_split_leaf(fs, index, pos) != 0) {
+            return -1;
+        }
+        pos = dir_index_find(index, hash);
+        leaf = (dirLeafHeader_t*) block_store_get_ptr(fs->BlockStore_whole, index->entry[pos].block);
+    }
+
+    int k = 0;
+    while (((leaf->used >> k) & 1) == 1) {
+        k++;
+    }
+    directoryFile_t* entry = (directoryFile_t*) leaf + 1 + k;
+    memset(entry, '\0', sizeof(directoryFile_t));
+    memcpy(entry->filename, name, len);
+    entry->inodeNumber = inode_id;
+    leaf->hash[k] = hash;
+    leaf->used |= 1u << k;
+    journal_dirty_ptr(fs, leaf);
+    journal_dirty_ptr(fs, index);
+
+    dir->dirEntries++;
+    inode_mark_dirty(fs, parent_id);
+    // replaces any negative entry a lookup of the name left behind
+    dentry_insert(fs, parent_id, name, len, inode_id);
+    return 0;
+}
+
+///
+/// Rewrite the directories of an image formatted before they were hashed. Each one kept up to
+/// folder_number_entries entries in the block at directPointer[0], with a bitmap of the slots
+/// in use where dirEntries is now. Such an image is told apart by the mapType of its root, which
+/// fs_format_map has always set. The rewritten image is synced before anything else can happen
+/// \param fs File system, for fs_mount before the journal and reclaimer are started
+/// \return 0 on success or if there was nothing to rewrite, < 0 if the image is left as it was
+///  because the new blocks don't fit
+///
+int dir_upgrade(FS_t* fs) {
+    inode_t* root = inode_get(fs, 0);
+    if (root->mapType != 0) {
+        return 0;
+    }
+
+    // a directory with entries gives up its block for an index block and one leaf
+    size_t needed = 0;
+    for (size_t inode_id = 0; inode_id < number_inodes; inode_id++) {
+        if (block_store_sub_test(fs->BlockStore_inode, inode_id)) {
+            inode_t* dir = inode_get(fs, inode_id);
+            needed += dir->fileType == 'd' && dir->dirEntries != 0 && dir->directPointer[0] != 0;
+        }
+    }
+    if (block_store_get_free_blocks(fs->BlockStore_whole) < needed) {
+        return -1;
+    }
+
+    for (size_t inode_id = 0; inode_id < number_inodes; inode_id++) {
+        if (!block_store_sub_test(fs->BlockStore_inode, inode_id)) {
+            continue;
+        }
+        inode_t* dir = inode_get(fs, inode_id);
+        if (dir->fileType != 'd') {
+            continue;
+        }
+        uint32_t vacant = dir->dirEntries;
+        size_t block_id = dir->directPointer[0];
+        dir->dirEntries = 0;
+        dir->directPointer[0] = 0;
+        inode_mark_dirty(fs, inode_id);
+        if (vacant == 0 || block_id == 0) {
+            continue;
+        }
+        directoryFile_t entries[folder_number_entries];
+        block_store_n_read(fs->BlockStore_whole, block_id, 0, entries, sizeof(entries));
+        block_store_release(fs->BlockStore_whole, block_id);
+        for (int k = 0; k < folder_number_entries; k++) {
+            if (((vacant >> k) & 1) == 1) {
+                dir_add_entry(fs, inode_id, entries[k].filename,
+                        strnlen(entries[k].filename, sizeof(entries[k].filename)), entries[k].inodeNumber);
+            }
+        }
+    }
+
+    // files of such an image all use block pointers
+    root->mapType = 'p';
+    inode_mark_dirty(fs, 0);
+    inode_cache_flush(fs);
+    return store_sync(fs);
+}
+
+///
+/// Free a run of blocks collected by free_run_add
+/// \param fs File system
+/// \param run run to free, left empty
+///
+static void free_run_flush(FS_t* fs, blockRun_t* run) {
+    if (run->count > 0) {
+        journal_free(fs, run->start, run->count);
+        block_store_release_extent(fs->BlockStore_whole, run->start, run->count);
+        run->freed += run->count;
+        run->count = 0;
+    }
+}
+
+///
+/// Queue contiguous blocks to be freed. Files are mostly laid out in extents, so blocks are
+/// gathered into runs and each run is cleared from the free block map in one go
+/// \param fs File system
+/// \param run run collected so far, freed first if the blocks don't extend it
+/// \param start first block to free, 0 (never allocated) is skipped
+/// \param count number of blocks
+///
+static void free_run_add_range(FS_t* fs, blockRun_t* run, size_t start, size_t count) {
+    if (start == 0 || count == 0) {
+        return;
+    }
+    if (run->count > 0 && start == run->start + run->count) {
+        run->count += count;
+        return;
+    }
+    free_run_flush(fs, run);
+    run->start = start;
+    run->count = count;
+}
+
+///
+/// Queue a block to be freed, see free_run_add_range
+/// \param fs File system
+/// \param run run collected so far
+/// \param block_id block to free, 0 (never allocated) is skipped
+///
+static void free_run_add(FS_t* fs, blockRun_t* run, size_t block_id) {
+    free_run_add_range(fs, run, block_id, 1);
+}
+
+///
+/// Queue an indirect pointer block and every block it points to. The pointers are copied
+/// out first, once a run is flushed its blocks can be handed out again. The pointer block
+/// comes first, that is the order write_to_position allocates them in
+/// \param fs File system
+/// \param run run collected so far
+/// \param indir_block_id indirect pointer block
+///
+static void free_run_add_indirect(FS_t* fs, blockRun_t* run, size_t indir_block_id) {
+    uint16_t pointers[NUM_INDIRECT_PTR];
+    memcpy(pointers, block_store_get_const_ptr(fs->BlockStore_whole, indir_block_id), sizeof(pointers));
+    free_run_add(fs, run, indir_block_id);
+    for (int i = 0; i < NUM_INDIRECT_PTR; i++) {
+        free_run_add(fs, run, pointers[i]);
+    }
+}
+
+///
+/// Copy the extent tree root out of an inode
+/// \param inode extent mapped inode
+/// \param root filled with the root, only the first extent_root_entries entries are used
+///
+static void extent_root_load(const inode_t* inode, extentNode_t* root) {
+    memcpy(root, (const uint8_t*) inode + offsetof(inode_t, directPointer), extent_root_size);
+}
+
+///
+/// Copy the extent tree root back into an inode, in place of the block pointers
+/// \param inode extent mapped inode
+/// \param root root to store
+///
+static void extent_root_store(inode_t* inode, const extentNode_t* root) {
+    memcpy((uint8_t*) inode + offsetof(inode_t, directPointer), root, extent_root_size);
+}
+
+///
+/// Binary search a node for a file block
+/// \param node node to search
+/// \param logical file block
+/// \return number of entries starting at or before the block
+///
+static size_t extent_search(const extentNode_t* node, size_t logical) {
+    size_t lo = 0;
+    size_t hi = node->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (node->entry[mid].logical <= logical) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+///
+/// Find the block holding a file block. An index entry only bounds its subtree from below,
+/// blocks in front of the first entry belong to the first child
+/// \param fs File system
+/// \param inode extent mapped inode
+/// \param logical file block
+/// \param run set to how many file blocks from logical on are contiguous on the store, or
+///            for a hole how many file blocks it has left
+/// \return the block, 0 for a hole
+///
+static size_t extent_find(FS_t* fs, const inode_t* inode, size_t logical, size_t* run) {
+    extentNode_t root;
+    extent_root_load(inode, &root);
+    const extentNode_t* node = &root;
+    size_t next = extent_logical_end;  // the next entry past the block on the way down
+    for (;;) {
+        size_t pos = extent_search(node, logical);
+        if (node->depth == 0) {
+            if (pos < node->count && node->entry[pos].logical < next) {
+                next = node->entry[pos].logical;
+            }
+            if (pos > 0) {
+                const extent_t* extent = &node->entry[pos - 1];
+                if (logical < (size_t) extent->logical + extent->count) {
+                    *run = extent->logical + extent->count - logical;
+                    return extent->start + (logical - extent->logical);
+                }
+            }
+            *run = next - logical;
+            return 0;
+        }
+        size_t child = pos > 0 ? pos - 1 : 0;
+        if (child + 1 < node->count && node->entry[child + 1].logical < next) {
+            next = node->entry[child + 1].logical;
+        }
+        node = (const extentNode_t*) block_store_get_const_ptr(fs->BlockStore_whole, node->entry[child].start);
+    }
+}
+
+///
+/// Allocate a block for an extent tree node. It doesn't come out of the extent reserved for
+/// the write in progress, that would split the run of data blocks the write is laying down
+/// \param fs File system
+/// \return block id, SIZE_MAX if the store is full
+///
+static size_t extent_allocate_node(FS_t* fs) {
+    size_t block_id = block_store_allocate_near(fs->BlockStore_whole, SIZE_MAX);
+    if (block_id == SIZE_MAX && reclaim_drain(fs)) {
+        return extent_allocate_node(fs);
+    }
+    return block_id;
+}
+
+///
+/// Try to map a file block by growing the extent next to it, the common case for a file
+/// written from front to back. The tree doesn't change shape
+/// \param fs File system
+/// \param root tree root, changed in place
+/// \param logical file block, a hole
+/// \param block block to map it to
+/// \return true if an extent took the block
+///
+static bool extent_merge(FS_t* fs, extentNode_t* root, size_t logical, size_t block) {
+    extentNode_t* node = root;
+    while (node->depth > 0) {
+        size_t pos = extent_search(node, logical);
+        node = (extentNode_t*) block_store_get_ptr(fs->BlockStore_whole, node->entry[pos > 0 ? pos - 1 : 0].start);
+    }
+    size_t pos = extent_search(node, logical);
+    if (pos > 0) {
+        extent_t* prev = &node->entry[pos - 1];
+        if ((size_t) prev->logical + prev->count == logical && (size_t) prev->start + prev->count == block && prev->count < UINT16_MAX) {
+            prev->count++;
+            journal_dirty_ptr(fs, node);
+            return true;
+        }
+    }
+    // moving the start of the next extent back is fine, the block was routed to this leaf
+    if (pos < node->count) {
+        extent_t* next = &node->entry[pos];
+        if (next->logical == logical + 1 && next->start == block + 1 && next->count < UINT16_MAX) {
+            next->logical--;
+            next->start--;
+            next->count++;
+            journal_dirty_ptr(fs, node);
+            return true;
+        }
+    }
+    return false;
+}
+
+///
+/// Map a file block to a block of the store, adding an extent for it unless the one next to it
+/// can grow. Full nodes are split on the way down, so there is always room for the new entry.
+/// A full root moves down into a block of its own and the tree gets one level deeper
+/// \param fs File system
+/// \param inode extent mapped inode, changed in place
+/// \param logical file block, a hole
+/// \param block block to map it to
+/// \return 0 on success, < 0 if there is no block left for a tree node
+///
+static int extent_add(FS_t* fs, inode_t* inode, size_t logical, size_t block) {
+    extentNode_t root;
+    extent_root_load(inode, &root);
+    if (extent_merge(fs, &root, logical, block)) {
+        extent_root_store(inode, &root);
+        return 0;
+    }
+
+    int result = 0;
+    if (root.count == extent_root_entries) {
+        size_t node_id = extent_allocate_node(fs);
+        if (node_id == SIZE_MAX) {
+            return -1;
+        }
+        extentNode_t* moved = (extentNode_t*) block_store_get_ptr(fs->BlockStore_whole, node_id);
+        moved->count = root.count;
+        moved->depth = root.depth;
+        memcpy(moved->entry, root.entry, root.count * sizeof(extent_t));
+        journal_dirty(fs, node_id);
+        root.count = 1;
+        root.depth++;
+        root.entry[0].logical = moved->entry[0].logical;
+        root.entry[0].start = node_id;
+        root.entry[0].count = 0;
+    }
+
+    extentNode_t* node = &root;
+    while (node->depth > 0) {
+        size_t pos = extent_search(node, logical);
+        pos = pos > 0 ? pos - 1 : 0;
+        extentNode_t* child = (extentNode_t*) block_store_get_ptr(fs->BlockStore_whole, node->entry[pos].start);
+        if (child->count == extent_node_entries) {
+            size_t right_id = extent_allocate_node(fs);
+            if (right_id == SIZE_MAX) {
+                result = -1;
+                break;
+            }
+            // the upper half goes to the new node, which is entered in the parent right after the child
+            extentNode_t* right = (extentNode_t*) block_store_get_ptr(fs->BlockStore_whole, right_id);
+            size_t half = child->count / 2;
+            right->count = child->count - half;
+            right->depth = child->depth;
+            memcpy(right->entry, &child->entry[half], right->count * sizeof(extent_t));
+            child->count = half;
+            memmove(&node->entry[pos + 2], &node->entry[pos + 1], (node->count - pos - 1) * sizeof(extent_t));
+            node->entry[pos + 1].logical = right->entry[0].logical;
+            node->entry[pos + 1].start = right_id;
+            node->entry[pos + 1].count = 0;
+            node->count++;
+            journal_dirty(fs, right_id);
+            journal_dirty_ptr(fs, child);
+            journal_dirty_ptr(fs, node);
+            if (logical >= right->entry[0].logical) {
+                child = right;
+            }
+        }
+        node = child;
+    }
+
+    if (result == 0) {
+        size_t pos = extent_search(node, logical);
+        memmove(&node->entry[pos + 1], &node->entry[pos], (node->count - pos) * sizeof(extent_t));
+        node->entry[pos].logical = logical;
+        node->entry[pos].start = block;
+        node->entry[pos].count = 1;
+        node->count++;
+        journal_dirty_ptr(fs, node);
+    }
+    extent_root_store(inode, &root);
+    return result;
+}
+
+///
+/// Queue every block of an extent tree to be freed, the nodes and the extents they hold.
+/// Each node is copied out first, once a run is flushed its blocks can be handed out again
+/// \param fs File system
+/// \param run run collected so far
+/// \param node node to free the subtree of, the root is left alone
+///
+static void extent_free(FS_t* fs, blockRun_t* run, const extentNode_t* node) {
+    for (size_t i = 0; i < node->count; i++) {
+        if (node->depth == 0) {
+            free_run_add_range(fs, run, node->entry[i].start, node->entry[i].count);
+        } else {
+            extentNode_t child;
+            memcpy(&child, block_store_get_const_ptr(fs->BlockStore_whole, node->entry[i].start), sizeof(child));
+            free_run_add(fs, run, node->entry[i].start);
+            extent_free(fs, run, &child);
+        }
+    }
+}
+
+///
+/// Sync a run of blocks collected by sync_run_add, only the ones written since they were last synced go out
+/// \param fs File system
+/// \param run run to sync, left empty
+/// \return false if the sync failed
+///
+static bool sync_run_flush(FS_t* fs, blockRun_t* run) {
+    if (run->count == 0) {
+        return true;
+    }
+    size_t synced = block_store_sync_dirty(fs->BlockStore_whole, run->start, run->count);
+    run->count = 0;
+    if (synced == SIZE_MAX) {
+        return false;
+    }
+    run->freed += synced;
+    return true;
+}
+
+///
+/// Queue contiguous blocks to be synced, gathered into runs like free_run_add_range so an
+/// extent goes out as one range
+/// \param fs File system
+/// \param run run collected so far, synced first if the blocks don't extend it
+/// \param start first block, 0 (a hole) is skipped
+/// \param count number of blocks
+/// \return false if a sync failed
+///
+static bool sync_run_add(FS_t* fs, blockRun_t* run, size_t start, size_t count) {
+    if (start == 0 || count == 0) {
+        return true;
+    }
+    if (run->count > 0 && start == run->start + run->count) {
+        run->count += count;
+        return true;
+    }
+    bool ok = sync_run_flush(fs, run);
+    run->start = start;
+    run->count = count;
+    return ok;
+}
+
+///
+/// Queue the blocks an indirect pointer block points to, and the block itself if metadata is set
+/// \param fs File system
+/// \param run run collected so far
+/// \param indir_block_id indirect pointer block, 0 is skipped
+/// \param metadata whether the pointer block goes too
+/// \return false if a sync failed
+///
+static bool sync_run_add_indirect(FS_t* fs, blockRun_t* run, size_t indir_block_id, bool metadata) {
+    if (indir_block_id == 0) {
+        return true;
+    }
+    bool ok = !metadata || sync_run_add(fs, run, indir_block_id, 1);
+    const uint16_t* pointers = (const uint16_t*) block_store_get_const_ptr(fs->BlockStore_whole, indir_block_id);
+    for (int i = 0; i < NUM_INDIRECT_PTR; i++) {
+        ok = sync_run_add(fs, run, pointers[i], 1) && ok;
+    }
+    return ok;
+}
+
+///
+/// Queue the extents of an extent tree, and its nodes if metadata is set
+/// \param fs File system
+/// \param run run collected so far
+/// \param node node to walk, the root is left alone
+/// \param metadata whether the nodes go too
+/// \return false if a sync failed
+///
+static bool sync_run_add_extents(FS_t* fs, blockRun_t* run, const extentNode_t* node, bool metadata) {
+    bool ok = true;
+    for (size_t i = 0; i < node->count; i++) {
+        if (node->depth == 0) {
+            ok = sync_run_add(fs, run, node->entry[i].start, node->entry[i].count) && ok;
+        } else {
+            if (metadata) {
+                ok = sync_run_add(fs, run, node->entry[i].start, 1) && ok;
+            }
+            const extentNode_t* child = (const extentNode_t*) block_store_get_const_ptr(fs->BlockStore_whole, node->entry[i].start);
+            ok = sync_run_add_extents(fs, run, child, metadata) && ok;
+        }
+    }
+    return ok;
+}
+
+///
+/// Wait for the blocks of a regular file written since they were last synced to reach the backing file
+/// \param fs File system
+/// \param inode the file, the caller holds its lock
+/// \param metadata whether the blocks that map the file (indirect blocks, extent tree nodes) go too
+/// \return number of blocks synced, < 0 on error
+///
+ssize_t file_sync_blocks(FS_t* fs, const inode_t* inode, bool metadata) {
+    blockRun_t run = {0, 0, 0};
+    bool ok = true;
+    if (inode->fileType != 'r' || inode->mapType == 'i') {
+        // a directory is metadata through and through, an inline file is kept in its inode
+        return 0;
+    } else if (inode->mapType == 'e') {
+        extentNode_t root;
+        extent_root_load(inode, &root);
+        ok = sync_run_add_extents(fs, &run, &root, metadata);
+    } else {
+        for (int i = 0; i < NUM_DIRECT_PTR; i++) {
+            ok = sync_run_add(fs, &run, inode->directPointer[i], 1) && ok;
+        }
+        ok = sync_run_add_indirect(fs, &run, inode->indirectPointer[0], metadata) && ok;
+        if (inode->doubleIndirectPointer != 0) {
+            if (metadata) {
+                ok = sync_run_add(fs, &run, inode->doubleIndirectPointer, 1) && ok;
+            }
+            const uint16_t* pointers = (const uint16_t*) block_store_get_const_ptr(fs->BlockStore_whole, inode->doubleIndirectPointer);
+            for (int i = 0; i < NUM_DOUBLE_DIRECT_PTR; i++) {
+                ok = sync_run_add_indirect(fs, &run, pointers[i], metadata) && ok;
+            }
+        }
+    }
+    ok = sync_run_flush(fs, &run) && ok;
+    return ok ? (ssize_t) run.freed : -1;
+}
+
+///
+/// Wait for the inode bitmap, the inode table and the free block map to reach the backing file.
+/// They are written without going through the whole store, so they aren't tracked as dirty
+/// \param fs File system
+/// \return 0 on success, < 0 on error
+///
+int store_sync_metadata(FS_t* fs) {
+    if (!block_store_sync(fs->BlockStore_whole, 0, FS_JOURNAL_START) ||
+            !block_store_sync(fs->BlockStore_whole, BLOCK_STORE_AVAIL_BLOCKS, BLOCK_STORE_NUM_BLOCKS - BLOCK_STORE_AVAIL_BLOCKS)) {
+        return -1;
+    }
+    return 0;
+}
+
+///
+/// Wait for every block written since it was last synced to reach the backing file, see store_sync_metadata
+/// \param fs File system
+/// \return 0 on success, < 0 on error
+///
+int store_sync(FS_t* fs) {
+    if (block_store_sync_dirty(fs->BlockStore_whole, 0, BLOCK_STORE_AVAIL_BLOCKS) == SIZE_MAX) {
+        return -1;
+    }
+    return store_sync_metadata(fs);
+}
+
+///
+/// Read from an extent mapped file starting at the given block position. There is one tree
+/// lookup per extent, the blocks of an extent follow each other on the store and are copied in one go
+/// \param fs File system
+/// \param inode source to be read from
+/// \param fd_loc file block to start at
+/// \param fd_off offset within that block
+/// \param dst destination to write to
+/// \param nbyte bytes to read
+/// \return bytes read
+///
+ssize_t read_extents(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, void *dst, size_t nbyte) {
+    size_t logical = fd_loc;
+    size_t offset = fd_off;
+    ssize_t bytes_read = 0;
+    while (nbyte > 0 && logical < extent_logical_end) {
+        size_t run;
+        size_t block_id = extent_find(fs, inode, logical, &run);
+        size_t span = run * BLOCK_SIZE_BYTES - offset;
+        if (span > nbyte) {
+            span = nbyte;
+        }
+        // holes read as zeros
+        if (block_id == 0) {
+            memset(dst, 0, span);
+        } else {
+            memcpy(dst, block_store_get_const_ptr(fs->BlockStore_whole, block_id) + offset, span);
+        }
+        dst = (uint8_t*) dst + span;
+        nbyte -= span;
+        bytes_read += span;
+        logical += (offset + span) / BLOCK_SIZE_BYTES;
+        offset = (offset + span) % BLOCK_SIZE_BYTES;
+    }
+    return bytes_read;
+}
+
+///
+/// Write to an extent mapped file starting at the given block position. Blocks already mapped
+/// are written a whole extent at a time, each hole gets a block allocated right after the one
+/// in front of it so a file written in order stays one extent
+/// \param fs File system
+/// \param inode destination to write to, changed in place
+/// \param fd_loc file block to start at
+/// \param fd_off offset within that block
+/// \param src source to be written
+/// \param nbyte bytes to write
+/// \return bytes written (< nbyte IFF out of space)
+///
+ssize_t write_extents(FS_t *fs, inode_t *inode, uint16_t fd_loc, uint16_t fd_off, const void *src, size_t nbyte) {
+    size_t logical = fd_loc;
+    size_t offset = fd_off;
+    ssize_t bytes_written = 0;
+    size_t run;
+    size_t prev_block = logical > 0 ? extent_find(fs, inode, logical - 1, &run) : 0;
+    while (nbyte > 0 && logical < extent_logical_end) {
+        size_t block_id = extent_find(fs, inode, logical, &run);
+        size_t span;
+        if (block_id == 0) {
+            block_id = allocate_data_block(fs, prev_block);
+            if (block_id == SIZE_MAX) {
+                break;
+            }
+            if (extent_add(fs, inode, logical, block_id) != 0) {
+                block_store_release(fs->BlockStore_whole, block_id);
+                break;
+            }
+            span = BLOCK_SIZE_BYTES - offset;
+            if (span > nbyte) {
+                span = nbyte;
+            }
+            // fresh block, don't leave whatever its last owner wrote around the data
+            block_store_n_write(fs->BlockStore_whole, block_id, 0, zero_block, offset);
+            block_store_n_write(fs->BlockStore_whole, block_id, offset + span, zero_block, BLOCK_SIZE_BYTES - offset - span);
+        } else {
+            span = run * BLOCK_SIZE_BYTES - offset;
+            if (span > nbyte) {
+                span = nbyte;
+            }
+        }
+        memcpy(block_store_get_ptr(fs->BlockStore_whole, block_id) + offset, src, span);
+        prev_block = block_id + (offset + span - 1) / BLOCK_SIZE_BYTES;
+        // the copy can cover a whole extent, every block of it has to be synced
+        block_store_mark_dirty(fs->BlockStore_whole, block_id, prev_block - block_id + 1);
+        src = (const uint8_t*) src + span;
+        nbyte -= span;
+        bytes_written += span;
+        logical += (offset + span) / BLOCK_SIZE_BYTES;
+        offset = (offset + span) % BLOCK_SIZE_BYTES;
+    }
+    return bytes_written;
+}
+
+///
+/// Free the next part of an orphan: the direct blocks (or for a directory its index and
+/// leaves), the indirect tree, one double indirect entry, and last the double indirect
+/// block and the inode itself. An extent mapped file goes in one step, its extents are freed
+/// a run at a time anyway. Each pointer is cleared in the inode store before the blocks
+/// it leads to are freed, so an interrupted reclaim never frees blocks twice
+/// \param fs File system
+/// \param orphan orphan to work on, its stage is moved along
+/// \param freed set to the number of blocks freed
+/// \return true once the inode has been released
+///
+static bool reclaim_step(FS_t* fs, orphan_t* orphan, size_t* freed) {
+    inode_t inode;
+    block_store_inode_read(fs->BlockStore_inode, orphan->inode, &inode);
+    blockRun_t run = {0, 0, 0};
+
+    if (orphan->stage == reclaim_stage_direct && inode.mapType == 'i' && inode.fileType == 'r') {
+        // the data goes with the inode, there are no blocks. It is cleared so nothing reads it as block pointers
+        inode_t cleared = inode;
+        inline_clear(&cleared);
+        block_store_inode_write(fs->BlockStore_inode, orphan->inode, &cleared);
+        orphan->stage = reclaim_stage_inode;
+    } else if (orphan->stage == reclaim_stage_direct && inode.mapType == 'e' && inode.fileType == 'r') {
+        inode_t cleared = inode;
+        memset((uint8_t*) &cleared + offsetof(inode_t, directPointer), 0, extent_root_size);
+        block_store_inode_write(fs->BlockStore_inode, orphan->inode, &cleared);
+        extentNode_t root;
+        extent_root_load(&inode, &root);
+        extent_free(fs, &run, &root);
+        orphan->stage = reclaim_stage_inode;
+    } else if (orphan->stage == reclaim_stage_direct) {
+        inode_t cleared = inode;
+        memset(cleared.directPointer, 0, sizeof(cleared.directPointer));
+        block_store_inode_write(fs->BlockStore_inode, orphan->inode, &cleared);
+        if (inode.fileType == 'd') {
+            if (inode.directPointer[0] != 0) {
+                dirIndex_t index;
+                memcpy(&index, block_store_get_const_ptr(fs->BlockStore_whole, inode.directPointer[0]), sizeof(index));
+                free_run_add(fs, &run, inode.directPointer[0]);
+                for (uint32_t i = 0; i < index.count; i++) {
+                    free_run_add(fs, &run, index.entry[i].block);
+                }
+            }
+            orphan->stage = reclaim_stage_inode;
+        } else {
+            for (int i = 0; i < NUM_DIRECT_PTR; i++) {
+                free_run_add(fs, &run, inode.directPointer[i]);
+            }
+            orphan->stage = reclaim_stage_indirect;
+        }
+    } else if (orphan->stage == reclaim_stage_indirect) {
+        if (inode.indirectPointer[0] != 0) {
+            inode_t cleared = inode;
+            cleared.indirectPointer[0] = 0;
+            block_store_inode_write(fs->BlockStore_inode, orphan->inode, &cleared);
+            free_run_add_indirect(fs, &run, inode.indirectPointer[0]);
+        }
+        orphan->stage = reclaim_stage_double;
+    } else if (orphan->stage < reclaim_stage_inode) {
+        int i = orphan->stage - reclaim_stage_double;
+        if (inode.doubleIndirectPointer == 0) {
+            i = NUM_DOUBLE_DIRECT_PTR;
+        } else {
+            // the double indirect block is freed last, until then its entries can be cleared in place
+            uint16_t* pointers = (uint16_t*) block_store_get_ptr(fs->BlockStore_whole, inode.doubleIndirectPointer);
+            // holes don't need a step of their own
+            while (i < NUM_DOUBLE_DIRECT_PTR && pointers[i] == 0) {
+                i++;
+            }
+            if (i < NUM_DOUBLE_DIRECT_PTR) {
+                size_t indir_block_id = pointers[i];
+                pointers[i] = 0;
+                journal_dirty(fs, inode.doubleIndirectPointer);
+                free_run_add_indirect(fs, &run, indir_block_id);
+                i++;
+            }
+        }
+        orphan->stage = reclaim_stage_double + i;
+    } else {
+        inode_t cleared;
+        memset(&cleared, '\0', sizeof(inode_t));
+        block_store_inode_write(fs->BlockStore_inode, orphan->inode, &cleared);
+        free_run_add(fs, &run, inode.doubleIndirectPointer);
+        free_run_flush(fs, &run);
+        *freed = run.freed;
+
+        // nobody can reach the cached copy, it is brought in line before the inode can be handed out again.
+        // Its lock keeps out an fs_sync still looking at it
+        inode_lock(fs, orphan->inode, true);
+        fs->inode_cache[orphan->inode].inode = cleared;
+        __atomic_store_n(&fs->inode_cache[orphan->inode].dirty, false, __ATOMIC_RELAXED);
+        __atomic_store_n(&fs->inode_cache[orphan->inode].loaded, true, __ATOMIC_RELEASE);
+        block_store_sub_release(fs->BlockStore_inode, orphan->inode);
+        inode_unlock(fs, orphan->inode);
+        return true;
+    }
+
+    free_run_flush(fs, &run);
+    *freed = run.freed;
+    return false;
+}
+
+///
+/// Reclaim an orphan all the way, on the calling thread
+/// \param fs File system
+/// \param inode_id orphaned inode
+///
+void reclaim_inode(FS_t* fs, size_t inode_id) {
+    orphan_t orphan = {inode_id, reclaim_stage_direct};
+    size_t freed;
+    bool done = false;
+    while (!done) {
+        journal_enter(fs, true);
+        done = reclaim_step(fs, &orphan, &freed);
+        journal_exit(fs);
+    }
+}
+
+///
+/// Reclaim every orphan left in the inode store, for fs_mount before anything else can happen
+/// \param fs File system
+///
+void reclaim_recover(FS_t* fs) {
+    // the root is never removed
+    for (size_t inode_id = 1; inode_id < number_inodes; inode_id++) {
+        if (block_store_sub_test(fs->BlockStore_inode, inode_id) && inode_get(fs, inode_id)->linkCount == 0) {
+            reclaim_inode(fs, inode_id);
+        }
+    }
+}
+
+///
+/// Reclaimer thread. Works through the orphan list one reclaim_step at a time, sleeping
+/// every reclaim_blocks_per_tick blocks unless someone is waiting on it or it is stopping
+/// \param arg File system
+/// \return NULL
+///
+static void* reclaim_thread(void* arg) {
+    FS_t* fs = (FS_t*) arg;
+    size_t budget = reclaim_blocks_per_tick;
+    pthread_mutex_lock(&fs->reclaim_lock);
+    for (;;) {
+        while (fs->orphan_count == 0 && !fs->reclaim_stop) {
+            pthread_cond_wait(&fs->reclaim_wake, &fs->reclaim_lock);
+        }
+        if (fs->orphan_count == 0) {
+            break;
+        }
+        // only this thread takes orphans off the list, so the first one stays put while unlocked
+        orphan_t orphan = fs->orphans[0];
+        bool limited = fs->reclaim_urgent == 0 && !fs->reclaim_stop;
+        pthread_mutex_unlock(&fs->reclaim_lock);
+
+        size_t freed;
+        journal_enter(fs, true);
+        bool done = reclaim_step(fs, &orphan, &freed);
+        journal_exit(fs);
+        budget = freed < budget ? budget - freed : 0;
+        if (budget == 0) {
+            if (limited) {
+                struct timespec tick = {0, reclaim_tick_ns};
+                nanosleep(&tick, NULL);
+            }
+            budget = reclaim_blocks_per_tick;
+        }
+
+        pthread_mutex_lock(&fs->reclaim_lock);
+        if (done) {
+            fs->orphans[0] = fs->orphans[--fs->orphan_count];
+            if (fs->orphan_count == 0) {
+                pthread_cond_broadcast(&fs->reclaim_idle);
+            }
+        } else {
+            fs->orphans[0].stage = orphan.stage;
+        }
+    }
+    pthread_mutex_unlock(&fs->reclaim_lock);
+    return NULL;
+}
+
+///
+/// Set up the locks and start the reclaimer thread
+/// \param fs File system
+///
+void reclaim_start(FS_t* fs) {
+    pthread_mutex_init(&fs->reclaim_lock, NULL);
+    pthread_cond_init(&fs->reclaim_wake, NULL);
+    pthread_cond_init(&fs->reclaim_idle, NULL);
+    fs->orphan_count = 0;
+    fs->reclaim_urgent = 0;
+    fs->reclaim_stop = false;
+    pthread_create(&fs->reclaimer, NULL, reclaim_thread, fs);
+}
+
+///
+/// Stop the reclaimer thread once the orphan list is empty and tear down the locks
+/// \param fs File system
+///
+void reclaim_stop(FS_t* fs) {
+    pthread_mutex_lock(&fs->reclaim_lock);
+    fs->reclaim_stop = true;
+    pthread_cond_signal(&fs->reclaim_wake);
+    pthread_mutex_unlock(&fs->reclaim_lock);
+    pthread_join(fs->reclaimer, NULL);
+
+    pthread_cond_destroy(&fs->reclaim_idle);
+    pthread_cond_destroy(&fs->reclaim_wake);
+    pthread_mutex_destroy(&fs->reclaim_lock);
+}
+
+///
+/// Hand an orphan to the reclaimer thread
+/// \param fs File system
+/// \param inode_id orphaned inode, linkCount 0 in the inode store
+///
+void reclaim_queue(FS_t* fs, size_t inode_id) {
+    pthread_mutex_lock(&fs->reclaim_lock);
+    fs->orphans[fs->orphan_count].inode = inode_id;
+    fs->orphans[fs->orphan_count].stage = reclaim_stage_direct;
+    fs->orphan_count++;
+    pthread_cond_signal(&fs->reclaim_wake);
+    pthread_mutex_unlock(&fs->reclaim_lock);
+}
+
+///
+/// Wait for the reclaimer to empty the orphan list, with its rate limit off.
+/// For allocations that came up empty
+/// \param fs File system
+/// \return true if there were orphans, so trying again may work
+///
+bool reclaim_drain(FS_t* fs) {
+    pthread_mutex_lock(&fs->reclaim_lock);
+    bool pending = fs->orphan_count > 0;
+    if (pending) {
+        fs->reclaim_urgent++;
+        pthread_cond_signal(&fs->reclaim_wake);
+        while (fs->orphan_count > 0) {
+            pthread_cond_wait(&fs->reclaim_idle, &fs->reclaim_lock);
+        }
+        fs->reclaim_urgent--;
+    }
+    pthread_mutex_unlock(&fs->reclaim_lock);
+    return pending;
+}
+
+///
+/// Allocate an inode, waiting on the reclaimer if removed files are holding the last ones
+/// \param fs File system
+/// \return inode id, SIZE_MAX if there are none left
+///
+size_t inode_allocate(FS_t* fs) {
+    size_t inode_id = block_store_sub_allocate(fs->BlockStore_inode);
+    if (inode_id == SIZE_MAX && reclaim_drain(fs)) {
+        return inode_allocate(fs);
+    }
+    return inode_id;
+}
+
+///
+/// Give back an inode that was allocated but never used
+/// \param fs File system
+/// \param inode_id inode to release
+///
+void inode_release(FS_t* fs, size_t inode_id) {
+    block_store_sub_release(fs->BlockStore_inode, inode_id);
+}
+
+///
+/// Pointer to a block of the whole store, unlike block_store_get_ptr the free block map is in reach
+/// \param fs File system
+/// \param block_id block
+/// \return first byte of the block
+///
+static uint8_t* journal_block(FS_t* fs, size_t block_id) {
+    return block_store_Data_location(fs->BlockStore_whole) + block_id * BLOCK_SIZE_BYTES;
+}
+
+///
+/// Checksum of a transaction, over the home blocks in its descriptor and the images that follow it
+/// \param fs File system
+/// \param descriptor descriptor block of the transaction
+/// \param first_image block the first image is in
+/// \return the checksum
+///
+static uint32_t journal_checksum(FS_t* fs, const journalRecord_t* descriptor, size_t first_image) {
+    uint32_t hash = fnv1a(2166136261u ^ descriptor->sequence, (const char*) descriptor->block, descriptor->count * sizeof(uint16_t));
+    for (uint32_t i = 0; i < descriptor->count; i++) {
+        hash = fnv1a(hash, (const char*) journal_block(fs, first_image + i), BLOCK_SIZE_BYTES);
+    }
+    return hash;
+}
+
+///
+/// Empty the journal, the next transaction goes in right after the header
+/// \param fs File system
+///
+static void journal_reset(FS_t* fs) {
+    journalHeader_t* header = (journalHeader_t*) journal_block(fs, FS_JOURNAL_START);
+    header->magic = journal_header_magic;
+    header->sequence = fs->journal_sequence;
+    header->blocks = FS_JOURNAL_BLOCKS;
+    block_store_sync(fs->BlockStore_whole, FS_JOURNAL_START, 1);
+    fs->journal_head = FS_JOURNAL_START + 1;
+}
+
+///
+/// bitmap_for_each callback, waits for one block to reach the backing file
+/// \param block_id block
+/// \param arg File system
+///
+static void journal_sync_block(size_t block_id, void* arg) {
+    block_store_sync(((FS_t*) arg)->BlockStore_whole, block_id, 1);
+}
+
+///
+/// bitmap_for_each callback, adds a block to a descriptor
+/// \param block_id block
+/// \param arg descriptor
+///
+static void journal_add_block(size_t block_id, void* arg) {
+    journalRecord_t* descriptor = (journalRecord_t*) arg;
+    descriptor->block[descriptor->count++] = block_id;
+}
+
+///
+/// Write the blocks the journal holds back home and empty it. Right after a commit their home
+/// copies match the journal, so a crash in the middle leaves nothing replay can't put right
+/// \param fs File system
+///
+static void journal_checkpoint(FS_t* fs) {
+    bitmap_for_each(fs->journal_logged_map, journal_sync_block, fs);
+    bitmap_format(fs->journal_logged_map, 0);
+    journal_reset(fs);
+    __atomic_store_n(&fs->journal_checkpoint_due, false, __ATOMIC_RELAXED);
+}
+
+///
+/// Write every block changed since the last commit to the journal as one transaction.
+/// Nothing can change the metadata while it runs, see journal_commit
+/// \param fs File system
+///
+static void journal_write(FS_t* fs) {
+    inode_cache_flush(fs);
+    // blocks waiting in the magazines are set in the free block map, after a crash nothing would free them
+    block_store_flush_magazines(fs->BlockStore_whole);
+    // the bitmaps and the inode table change with nearly every call, every transaction carries them
+    for (size_t i = 0; i < FS_JOURNAL_START; i++) {
+        bitmap_set(fs->journal_dirty_map, i);
+    }
+    bitmap_set(fs->journal_dirty_map, BLOCK_STORE_AVAIL_BLOCKS);
+    bitmap_set(fs->journal_dirty_map, BLOCK_STORE_AVAIL_BLOCKS + 1);
+
+    // a burst bigger than the room left. The blocks in the journal go home as they are now, which
+    // is past their last commit, so this one isn't atomic. journal_checkpoint_room makes it rare
+    size_t count = bitmap_total_set(fs->journal_dirty_map);
+    if (fs->journal_head + count + 2 > FS_JOURNAL_START + FS_JOURNAL_BLOCKS) {
+        journal_checkpoint(fs);
+    }
+
+    if (count > journal_tx_max) {
+        // more than the journal can hold, it goes straight home. Not atomic, but the journal is empty
+        // so replay can't roll any of it back
+        bitmap_for_each(fs->journal_dirty_map, journal_sync_block, fs);
+    } else {
+        journalRecord_t* descriptor = (journalRecord_t*) journal_block(fs, fs->journal_head);
+        memset(descriptor, 0, BLOCK_SIZE_BYTES);
+        descriptor->magic = journal_descriptor_magic;
+        descriptor->sequence = fs->journal_sequence;
+        bitmap_for_each(fs->journal_dirty_map, journal_add_block, descriptor);
+        for (uint32_t i = 0; i < descriptor->count; i++) {
+            memcpy(journal_block(fs, fs->journal_head + 1 + i), journal_block(fs, descriptor->block[i]), BLOCK_SIZE_BYTES);
+            bitmap_set(fs->journal_logged_map, descriptor->block[i]);
+        }
+
+        // the commit block makes it count, a torn transaction fails the checksum and isn't replayed
+        journalRecord_t* commit = (journalRecord_t*) journal_block(fs, fs->journal_head + 1 + count);
+        memset(commit, 0, BLOCK_SIZE_BYTES);
+        commit->magic = journal_commit_magic;
+        commit->sequence = fs->journal_sequence;
+        commit->count = count;
+        commit->checksum = journal_checksum(fs, descriptor, fs->journal_head + 1);
+        block_store_sync(fs->BlockStore_whole, fs->journal_head, count + 2);
+        fs->journal_head += count + 2;
+        fs->journal_sequence++;
+    }
+    bitmap_format(fs->journal_dirty_map, 0);
+    __atomic_store_n(&fs->journal_dirty_count, 0, __ATOMIC_RELAXED);
+
+    // a block freed since it was logged may hold file data by now, replay must not put the old image back
+    if (__atomic_load_n(&fs->journal_checkpoint_due, __ATOMIC_RELAXED) ||
+            fs->journal_head + journal_checkpoint_room > FS_JOURNAL_START + FS_JOURNAL_BLOCKS) {
+        journal_checkpoint(fs);
+    }
+}
+
+///
+/// Committer thread. Once a call has changed something it gives the calls of the next
+/// journal_commit_s a chance to join in, then commits them all as one transaction
+/// \param arg File system
+/// \return NULL
+///
+static void* journal_thread(void* arg) {
+    FS_t* fs = (FS_t*) arg;
+    pthread_mutex_lock(&fs->journal_lock);
+    while (!fs->journal_stop) {
+        if (fs->journal_changes == 0) {
+            pthread_cond_wait(&fs->journal_wake, &fs->journal_lock);
+            continue;
+        }
+        // cut short by a transaction that has grown big or by journal_stop. journal_enter wakes it
+        // too once a commit (fs_sync) got there first, that doesn't end the wait
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += journal_commit_s;
+        while (!fs->journal_stop && fs->journal_changes > 0 &&
+                __atomic_load_n(&fs->journal_dirty_count, __ATOMIC_RELAXED) < journal_commit_blocks &&
+                pthread_cond_timedwait(&fs->journal_wake, &fs->journal_lock, &until) != ETIMEDOUT) {
+        }
+        pthread_mutex_unlock(&fs->journal_lock);
+        // the data is left to fs_sync and fs_fsync
+        journal_commit(fs, false);
+        pthread_mutex_lock(&fs->journal_lock);
+    }
+    pthread_mutex_unlock(&fs->journal_lock);
+    return NULL;
+}
+
+///
+/// Reserve the journal area of a new FS and write its header
+/// \param fs File system, formatted up to the inode table
+///
+void journal_format(FS_t* fs) {
+    for (size_t i = 0; i < FS_JOURNAL_BLOCKS; i++) {
+        block_store_request(fs->BlockStore_whole, FS_JOURNAL_START + i);
+    }
+    fs->journal = true;
+    fs->journal_sequence = 1;
+    journal_reset(fs);
+    // the empty FS is where replay starts from
+    block_store_sync(fs->BlockStore_whole, 0, FS_JOURNAL_START);
+    block_store_sync(fs->BlockStore_whole, BLOCK_STORE_AVAIL_BLOCKS, BLOCK_STORE_NUM_BLOCKS - BLOCK_STORE_AVAIL_BLOCKS);
+}
+
+///
+/// Find the journal of a freshly opened store and put back every transaction committed to it,
+/// in order, stopping at the first one that is missing or torn. For fs_mount before anything
+/// is read from the store. Only the journal is read, however big the FS is
+/// \param fs File system
+/// \return true if anything was put back, the free block map has changed under the store
+///
+bool journal_replay(FS_t* fs) {
+    const journalHeader_t* header = (const journalHeader_t*) journal_block(fs, FS_JOURNAL_START);
+    // formatted before there was a journal, block 5 is just the first block of some file
+    fs->journal = header->magic == journal_header_magic && header->blocks == FS_JOURNAL_BLOCKS;
+    if (!fs->journal) {
+        return false;
+    }
+    fs->journal_sequence = header->sequence;
+
+    bitmap_t* replayed = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+    size_t head = FS_JOURNAL_START + 1;
+    while (head + 2 <= FS_JOURNAL_START + FS_JOURNAL_BLOCKS) {
+        const journalRecord_t* descriptor = (const journalRecord_t*) journal_block(fs, head);
+        if (descriptor->magic != journal_descriptor_magic || descriptor->sequence != fs->journal_sequence ||
+                descriptor->count > journal_tx_max || head + descriptor->count + 2 > FS_JOURNAL_START + FS_JOURNAL_BLOCKS) {
+            break;
+        }
+        const journalRecord_t* commit = (const journalRecord_t*) journal_block(fs, head + 1 + descriptor->count);
+        if (commit->magic != journal_commit_magic || commit->sequence != descriptor->sequence ||
+                commit->count != descriptor->count || commit->checksum != journal_checksum(fs, descriptor, head + 1)) {
+            break;
+        }
+        for (uint32_t i = 0; i < descriptor->count; i++) {
+            memcpy(journal_block(fs, descriptor->block[i]), journal_block(fs, head + 1 + i), BLOCK_SIZE_BYTES);
+            bitmap_set(replayed, descriptor->block[i]);
+        }
+        head += descriptor->count + 2;
+        fs->journal_sequence++;
+    }
+
+    // the blocks go home for good before the journal forgets them
+    bool any = bitmap_total_set(replayed) > 0;
+    if (any) {
+        bitmap_for_each(replayed, journal_sync_block, fs);
+        journal_reset(fs);
+    }
+    bitmap_destroy(replayed);
+    return any;
+}
+
+///
+/// Set up the journal of a mounted FS and start the committer thread
+/// \param fs File system, after journal_format or journal_replay
+///
+void journal_start(FS_t* fs) {
+    if (!fs->journal) {
+        return;
+    }
+    pthread_mutex_init(&fs->journal_lock, NULL);
+    pthread_cond_init(&fs->journal_wake, NULL);
+    pthread_cond_init(&fs->journal_idle, NULL);
+    fs->journal_dirty_map = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+    fs->journal_logged_map = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+    fs->journal_head = FS_JOURNAL_START + 1;
+    fs->journal_checkpoint_due = false;
+    fs->journal_dirty_count = 0;
+    fs->journal_changes = 0;
+    fs->journal_active = 0;
+    fs->journal_pending = false;
+    fs->journal_committing = false;
+    fs->journal_stop = false;
+    pthread_create(&fs->committer, NULL, journal_thread, fs);
+}
+
+///
+/// Stop the committer thread, commit what is left and empty the journal, for fs_unmount
+/// \param fs File system
+///
+void journal_stop(FS_t* fs) {
+    if (!fs->journal) {
+        return;
+    }
+    pthread_mutex_lock(&fs->journal_lock);
+    fs->journal_stop = true;
+    pthread_cond_signal(&fs->journal_wake);
+    pthread_mutex_unlock(&fs->journal_lock);
+    pthread_join(fs->committer, NULL);
+
+    journal_commit(fs, true);
+    journal_checkpoint(fs);
+    bitmap_destroy(fs->journal_logged_map);
+    bitmap_destroy(fs->journal_dirty_map);
+    pthread_cond_destroy(&fs->journal_idle);
+    pthread_cond_destroy(&fs->journal_wake);
+    pthread_mutex_destroy(&fs->journal_lock);
+}
+
+///
+/// Start a call that may change metadata, waiting out a commit in progress or about to start.
+/// Taken before any other lock, calls nested on the same thread only count once
+/// \param fs File system
+/// \param reclaimer true for the reclaimer thread. A call in progress may be waiting on it
+///                  (see reclaim_drain), so it only waits for a commit nobody is holding up
+///
+void journal_enter(FS_t* fs, bool reclaimer) {
+    if (!fs->journal || journal_depth++ > 0) {
+        return;
+    }
+    pthread_mutex_lock(&fs->journal_lock);
+    while (fs->journal_committing || (fs->journal_pending && (!reclaimer || fs->journal_active == 0))) {
+        pthread_cond_wait(&fs->journal_idle, &fs->journal_lock);
+    }
+    fs->journal_active++;
+    if (fs->journal_changes++ == 0) {
+        pthread_cond_signal(&fs->journal_wake);
+    }
+    pthread_mutex_unlock(&fs->journal_lock);
+}
+
+///
+/// End a call started by journal_enter
+/// \param fs File system
+///
+void journal_exit(FS_t* fs) {
+    if (!fs->journal || --journal_depth > 0) {
+        return;
+    }
+    pthread_mutex_lock(&fs->journal_lock);
+    if (--fs->journal_active == 0 && fs->journal_pending) {
+        pthread_cond_broadcast(&fs->journal_idle);
+    }
+    pthread_mutex_unlock(&fs->journal_lock);
+}
+
+///
+/// Note that a metadata block changed, once the change is made. It goes in the next
+/// transaction, and the next fs_sync syncs it like blocks written with block_store_write
+/// \param fs File system
+/// \param block_id changed block
+///
+void journal_dirty(FS_t* fs, size_t block_id) {
+    block_store_mark_dirty(fs->BlockStore_whole, block_id, 1);
+    if (fs->journal && bitmap_claim(fs->journal_dirty_map, block_id) &&
+            __atomic_add_fetch(&fs->journal_dirty_count, 1, __ATOMIC_RELAXED) == journal_commit_blocks) {
+        // no need to sit out the rest of journal_commit_s
+        pthread_cond_signal(&fs->journal_wake);
+    }
+}
+
+///
+/// journal_dirty for whatever block a pointer is in. Copies outside the store, like an
+/// extent tree root taken out of its inode, are left alone
+/// \param fs File system
+/// \param ptr pointer into a block
+///
+void journal_dirty_ptr(FS_t* fs, const void* ptr) {
+    uintptr_t base = (uintptr_t) block_store_Data_location(fs->BlockStore_whole);
+    if ((uintptr_t) ptr >= base && (uintptr_t) ptr < base + BLOCK_STORE_NUM_BYTES) {
+        journal_dirty(fs, ((uintptr_t) ptr - base) / BLOCK_SIZE_BYTES);
+    }
+}
+
+///
+/// Note that blocks were freed. Changes to them since the last commit are dropped, and
+/// if the journal holds one of them the next commit empties it
+/// \param fs File system
+/// \param start first freed block
+/// \param count number of blocks
+///
+void journal_free(FS_t* fs, size_t start, size_t count) {
+    if (!fs->journal) {
+        return;
+    }
+    for (size_t i = start; i < start + count; i++) {
+        if (bitmap_test(fs->journal_dirty_map, i)) {
+            bitmap_reset(fs->journal_dirty_map, i);
+        }
+        // journal_logged_map only changes while no call is in progress
+        if (bitmap_test(fs->journal_logged_map, i)) {
+            __atomic_store_n(&fs->journal_checkpoint_due, true, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+///
+/// Commit every change made so far as one transaction. Calls coming in wait until it is done,
+/// the ones in progress are let finish first
+/// \param fs File system
+/// \param data whether every block written since the last sync is synced too, while nothing can write
+/// \return 0 on success, < 0 on error
+///
+int journal_commit(FS_t* fs, bool data) {
+    if (!fs->journal) {
+        return 0;
+    }
+    pthread_mutex_lock(&fs->journal_lock);
+    // one commit at a time, a second one commits whatever came in during the first
+    while (fs->journal_pending || fs->journal_committing) {
+        pthread_cond_wait(&fs->journal_idle, &fs->journal_lock);
+    }
+    bool changed = fs->journal_changes > 0;
+    if (!changed && !data) {
+        pthread_mutex_unlock(&fs->journal_lock);
+        return 0;
+    }
+    fs->journal_pending = true;
+    while (fs->journal_active > 0) {
+        pthread_cond_wait(&fs->journal_idle, &fs->journal_lock);
+    }
+    fs->journal_pending = false;
+    fs->journal_committing = true;
+    fs->journal_changes = 0;
+    pthread_mutex_unlock(&fs->journal_lock);
+
+    if (changed) {
+        journal_write(fs);
+    }
+    // after the transaction, a home block synced ahead of it could leave a crash half way between two commits
+    int result = data ? store_sync(fs) : 0;
+
+    pthread_mutex_lock(&fs->journal_lock);
+    fs->journal_committing = false;
+    pthread_cond_broadcast(&fs->journal_idle);
+    pthread_mutex_unlock(&fs->journal_lock);
+    return result;
 }
@@ -0,0 +1,374 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "block_store.h"
+#include "FS.h"
+
+#define BENCH_FILE "benchmark.bs"
+#define DEFAULT_ITERATIONS 2000
+
+// Fill levels to sample, in percent of the available blocks
+static const unsigned fill_levels[] = {0, 10, 25, 50, 75, 90, 99};
+
+///
+/// Monotonic clock in nanoseconds
+///
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+///
+/// The old bit-by-bit search, kept here as the reference point
+/// \param bitmap the bitmap to search
+/// \return first zero bit, SIZE_MAX if there is none
+///
+static size_t ffz_bit_by_bit(const bitmap_t *const bitmap)
+{
+    size_t bit = 0;
+    const size_t bits = bitmap_get_bits(bitmap);
+    for (; bit < bits && bitmap_test(bitmap, bit); ++bit) {
+    }
+    return bit == bits ? SIZE_MAX : bit;
+}
+
+///
+/// Allocation latency against fill level. The store is packed from block 0
+/// so every search has to get past all of the used blocks first (worst case for ffz).
+/// \param iterations number of allocate/release pairs timed per fill level
+/// \return EXIT_SUCCESS, EXIT_FAILURE on error
+///
+static int bench_alloc(const size_t iterations)
+{
+    block_store_t *bs = block_store_create(BENCH_FILE);
+    if (!bs) {
+        fprintf(stderr, "could not create %s\n", BENCH_FILE);
+        return EXIT_FAILURE;
+    }
+    bitmap_t *fbm = block_store_get_bm(bs);
+    const size_t total = block_store_get_total_blocks();
+
+    printf("| Fill %% | Used blocks | block_store_allocate (ns/op) | bit-by-bit ffz (ns/op) |\n");
+    printf("|--------|-------------|------------------------------|------------------------|\n");
+
+    size_t used = 0;
+    for (size_t level = 0; level < sizeof(fill_levels) / sizeof(fill_levels[0]); ++level) {
+        const size_t target = total * fill_levels[level] / 100;
+        for (; used < target; ++used) {
+            block_store_request(bs, used);
+        }
+
+        double start = now_ns();
+        for (size_t i = 0; i < iterations; ++i) {
+            size_t id = block_store_allocate(bs);
+            block_store_release(bs, id);
+        }
+        const double fast = (now_ns() - start) / iterations;
+
+        volatile size_t sink = 0;
+        start = now_ns();
+        for (size_t i = 0; i < iterations; ++i) {
+            sink += ffz_bit_by_bit(fbm);
+        }
+        const double slow = (now_ns() - start) / iterations;
+        (void) sink;
+
+        printf("| %6u | %11zu | %28.1f | %22.1f |\n", fill_levels[level], used, fast, slow);
+    }
+
+    block_store_destroy(bs);
+    remove(BENCH_FILE);
+    return EXIT_SUCCESS;
+}
+
+///
+/// Path resolution throughput. Builds a 4 deep directory chain, fills the bottom
+/// directories with files and then opens/closes one of them over and over.
+/// \param iterations number of open/close pairs timed
+/// \return EXIT_SUCCESS, EXIT_FAILURE on error
+///
+static int bench_path(const size_t iterations)
+{
+    static const char *const dirs[] = {"/usr", "/usr/local", "/usr/local/share", "/usr/local/share/docs"};
+    const size_t n_dirs = sizeof(dirs) / sizeof(dirs[0]);
+    const size_t n_files = 30;
+    const size_t rounds = 3;
+    char path[128];
+
+    // creates, on a fresh FS each round so every round fills the same empty directories
+    // (removed files are reclaimed in the background, which would land in the timings)
+    double create_ns = 0;
+    size_t creates = 0;
+    for (size_t round = 0; round < rounds; ++round) {
+        FS_t *fs = fs_format(BENCH_FILE);
+        if (!fs) {
+            fprintf(stderr, "could not format %s\n", BENCH_FILE);
+            return EXIT_FAILURE;
+        }
+        const double start = now_ns();
+        for (size_t d = 0; d < n_dirs; ++d, ++creates) {
+            if (fs_create(fs, dirs[d], FS_DIRECTORY) < 0) {
+                fprintf(stderr, "create %s failed\n", dirs[d]);
+                return EXIT_FAILURE;
+            }
+        }
+        for (size_t d = 0; d < n_dirs; ++d) {
+            for (size_t f = 0; f < n_files; ++f, ++creates) {
+                snprintf(path, sizeof(path), "%s/file_%zu", dirs[d], f);
+                if (fs_create(fs, path, FS_REGULAR) < 0) {
+                    fprintf(stderr, "create %s failed\n", path);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        create_ns += now_ns() - start;
+        if (round + 1 < rounds) {
+            fs_unmount(fs);
+            continue;
+        }
+
+        // opens, deepest directory, files picked round robin
+        const double open_start = now_ns();
+        for (size_t i = 0; i < iterations; ++i) {
+            snprintf(path, sizeof(path), "%s/file_%zu", dirs[n_dirs - 1], i % n_files);
+            const int fd = fs_open(fs, path);
+            if (fd < 0) {
+                fprintf(stderr, "open %s failed\n", path);
+                return EXIT_FAILURE;
+            }
+            fs_close(fs, fd);
+        }
+        const double open_ns = now_ns() - open_start;
+        fs_unmount(fs);
+
+        printf("| Operation | Ops | ops/sec |\n");
+        printf("|-----------|-----|---------|\n");
+        printf("| fs_create | %zu | %.0f |\n", creates, creates / (create_ns / 1e9));
+        printf("| fs_open + fs_close (depth 5) | %zu | %.0f |\n", iterations, iterations / (open_ns / 1e9));
+    }
+
+    remove(BENCH_FILE);
+    return EXIT_SUCCESS;
+}
+
+///
+/// Remove latency against file size. Each file is written sequentially into a fresh FS
+/// and then removed, the largest reaches well into the double indirect range.
+/// \param iterations unused, every size is removed once
+/// \return EXIT_SUCCESS, EXIT_FAILURE on error
+///
+static int bench_remove(const size_t iterations)
+{
+    static const size_t sizes_mib[] = {1, 16, 64, 128, 240};
+    const size_t chunk = BLOCK_SIZE_BYTES * 64;
+    uint8_t *data = calloc(1, chunk);
+    (void) iterations;
+
+    printf("| File size (MiB) | Blocks | fs_remove (ms) | reclaimed, rate limit off (ms) |\n");
+    printf("|-----------------|--------|----------------|--------------------------------|\n");
+    for (size_t s = 0; s < sizeof(sizes_mib) / sizeof(sizes_mib[0]); ++s) {
+        FS_t *fs = fs_format(BENCH_FILE);
+        if (!fs || !data || fs_create(fs, "/file", FS_REGULAR) < 0) {
+            fprintf(stderr, "could not set up %s\n", BENCH_FILE);
+            free(data);
+            return EXIT_FAILURE;
+        }
+        const int fd = fs_open(fs, "/file");
+        const size_t bytes = sizes_mib[s] << 20;
+        for (size_t done = 0; done < bytes; done += chunk) {
+            if (fs_write(fs, fd, data, chunk) != (ssize_t) chunk) {
+                fprintf(stderr, "write failed at %zu bytes\n", done);
+                free(data);
+                return EXIT_FAILURE;
+            }
+        }
+        fs_close(fs, fd);
+
+        const double start = now_ns();
+        if (fs_remove(fs, "/file") < 0) {
+            fprintf(stderr, "remove failed\n");
+            free(data);
+            return EXIT_FAILURE;
+        }
+        const double elapsed = now_ns() - start;
+        reclaim_drain(fs);
+        const double reclaimed = now_ns() - start;
+        fs_unmount(fs);
+
+        printf("| %15zu | %6zu | %14.3f | %30.3f |\n", sizes_mib[s], bytes / BLOCK_SIZE_BYTES, elapsed / 1e6, reclaimed / 1e6);
+    }
+
+    free(data);
+    remove(BENCH_FILE);
+    return EXIT_SUCCESS;
+}
+
+///
+/// Sequential throughput of a large file with either block map. The file is written and
+/// read front to back in 256 KiB calls, well into the double indirect range
+/// \param iterations number of times the whole file is read
+/// \return EXIT_SUCCESS, EXIT_FAILURE on error
+///
+static int bench_read(const size_t iterations)
+{
+    static const char *const names[] = {"block pointers", "extents"};
+    static const map_t maps[] = {FS_MAP_POINTERS, FS_MAP_EXTENTS};
+    const size_t chunk = BLOCK_SIZE_BYTES * 64;
+    const size_t bytes = (size_t) 200 << 20;
+    const size_t rounds = iterations < 20 ? iterations : 20;
+    uint8_t *data = calloc(1, chunk);
+
+    printf("| Block map | write (MiB/s) | sequential read (MiB/s) |\n");
+    printf("|-----------|---------------|-------------------------|\n");
+    for (size_t m = 0; m < sizeof(maps) / sizeof(maps[0]); ++m) {
+        FS_t *fs = fs_format_map(BENCH_FILE, maps[m]);
+        if (!fs || !data || fs_create(fs, "/file", FS_REGULAR) < 0) {
+            fprintf(stderr, "could not set up %s\n", BENCH_FILE);
+            free(data);
+            return EXIT_FAILURE;
+        }
+        const int fd = fs_open(fs, "/file");
+        double start = now_ns();
+        for (size_t done = 0; done < bytes; done += chunk) {
+            if (fs_write(fs, fd, data, chunk) != (ssize_t) chunk) {
+                fprintf(stderr, "write failed at %zu bytes\n", done);
+                free(data);
+                return EXIT_FAILURE;
+            }
+        }
+        const double written = now_ns() - start;
+
+        start = now_ns();
+        for (size_t round = 0; round < rounds; ++round) {
+            fs_seek(fs, fd, 0, FS_SEEK_SET);
+            while (fs_read(fs, fd, data, chunk) > 0) {
+            }
+        }
+        const double read = now_ns() - start;
+        fs_close(fs, fd);
+        fs_unmount(fs);
+
+        const double mib = (double) (bytes >> 20);
+        printf("| %s | %.0f | %.0f |\n", names[m], mib / (written / 1e9), mib * rounds / (read / 1e9));
+    }
+
+    free(data);
+    remove(BENCH_FILE);
+    return EXIT_SUCCESS;
+}
+
+// one thread of bench_threads, its own file in its own directory
+typedef struct {
+    FS_t *fs;
+    int id;
+    size_t bytes;
+    int failed;
+} bench_thread_t;
+
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *self = (bench_thread_t *) arg;
+    const size_t chunk = BLOCK_SIZE_BYTES * 16;
+    uint8_t *data = calloc(1, chunk);
+    char path[32];
+    snprintf(path, sizeof(path), "/dir%d", self->id);
+    fs_create(self->fs, path, FS_DIRECTORY);
+    snprintf(path, sizeof(path), "/dir%d/file", self->id);
+    const int fd = fs_create(self->fs, path, FS_REGULAR) == 0 ? fs_open(self->fs, path) : -1;
+    self->failed = fd < 0 || !data;
+    for (size_t done = 0; !self->failed && done < self->bytes; done += chunk) {
+        self->failed = fs_write(self->fs, fd, data, chunk) != (ssize_t) chunk;
+    }
+    for (size_t done = 0; !self->failed && done < self->bytes; done += chunk) {
+        self->failed = fs_pread(self->fs, fd, data, chunk, done) != (ssize_t) chunk;
+    }
+    fs_close(self->fs, fd);
+    free(data);
+    return NULL;
+}
+
+///
+/// Throughput of independent files against thread count. Every thread writes a file
+/// of its own in a directory of its own and reads it back, 192 MiB in total (most of the
+/// 256 MiB store, leaving room for the metadata) is spread over the threads
+/// \param iterations number of rounds averaged per thread count
+/// \return EXIT_SUCCESS, EXIT_FAILURE on error
+///
+static int bench_threads(const size_t iterations)
+{
+    static const int counts[] = {1, 2, 4, 8};
+    const size_t bytes = (size_t) 192 << 20;
+    const size_t rounds = iterations < 5 ? iterations : 5;
+    bench_thread_t threads[8];
+    pthread_t ids[8];
+
+    printf("| Threads | MiB/s (write + read back) | speedup |\n");
+    printf("|---------|---------------------------|---------|\n");
+    double base = 0;
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+        double elapsed = 0;
+        for (size_t round = 0; round < rounds; ++round) {
+            FS_t *fs = fs_format(BENCH_FILE);
+            if (!fs) {
+                fprintf(stderr, "could not format %s\n", BENCH_FILE);
+                return EXIT_FAILURE;
+            }
+            const double start = now_ns();
+            for (int t = 0; t < counts[c]; ++t) {
+                threads[t] = (bench_thread_t) {fs, t, bytes / counts[c], 0};
+                pthread_create(&ids[t], NULL, bench_thread, &threads[t]);
+            }
+            for (int t = 0; t < counts[c]; ++t) {
+                pthread_join(ids[t], NULL);
+                if (threads[t].failed) {
+                    fprintf(stderr, "thread %d failed\n", t);
+                    return EXIT_FAILURE;
+                }
+            }
+            elapsed += now_ns() - start;
+            fs_unmount(fs);
+        }
+        const double rate = 2.0 * (bytes >> 20) * rounds / (elapsed / 1e9);
+        if (c == 0) {
+            base = rate;
+        }
+        printf("| %7d | %25.0f | %6.2fx |\n", counts[c], rate, rate / base);
+    }
+
+    remove(BENCH_FILE);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    const char *suite = argc > 1 ? argv[1] : "alloc";
+    size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_ITERATIONS;
+    if (!iterations) {
+        iterations = DEFAULT_ITERATIONS;
+    }
+
+    if (strcmp(suite, "alloc") == 0) {
+        return bench_alloc(iterations);
+    }
+    if (strcmp(suite, "path") == 0) {
+        return bench_path(iterations);
+    }
+    if (strcmp(suite, "remove") == 0) {
+        return bench_remove(iterations);
+    }
+    if (strcmp(suite, "read") == 0) {
+        return bench_read(iterations);
+    }
+    if (strcmp(suite, "threads") == 0) {
+        return bench_threads(iterations);
+    }
+
+    printf("%s [alloc|path|remove|read|threads] [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+}
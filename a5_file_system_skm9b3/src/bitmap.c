@@ -10,6 +10,11 @@ struct bitmap {
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
     uint8_t *data;
     size_t bit_count, byte_count;
+    // Free space index for ffz, kept in step by every call that changes data.
+    // summary has one bit per 64 bit data word with a zero in it, the top level (stored right
+    // after it) has one bit per summary word that is non-zero. Lookups are three ctz's deep.
+    uint64_t *summary;
+    size_t word_count, summary_words, top_words;
 };
 
 
@@ -59,62 +64,380 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Word-at-a-time scanning. The storage is still a byte array (overlays point into mmap'd
+// blocks, so we don't get to pick the alignment). Other threads change the words with atomic
+// operations, so they are read with relaxed atomic loads: a whole word when it is aligned,
+// else a byte at a time. Bit N of the bitmap ends up as bit N of the word.
+static inline uint64_t bitmap_load_word(const uint8_t *const data, const size_t bytes) {
+    uint64_t word = 0;
+    if (bytes == 8 && ((uintptr_t) data & 0x07) == 0) {
+        word = __atomic_load_n((const uint64_t *) data, __ATOMIC_RELAXED);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+    } else {
+        for (size_t byte = 0; byte < bytes; ++byte) {
+            word |= (uint64_t) __atomic_load_n(&data[byte], __ATOMIC_RELAXED) << (byte << 3);
+        }
+    }
+    return word;
+}
+
+// Find the first bit that differs from the pattern (pattern of 0 is ffs, ~0 is ffz)
+static size_t bitmap_scan(const bitmap_t *const bitmap, const uint64_t pattern) {
+    // skip whole words that match the pattern (all ones for ffz, all zeros for ffs). Each word is
+    // loaded once, another thread may change it between two loads
+    const size_t full_words = bitmap->bit_count >> 6;
+    for (size_t idx = 0; idx < full_words; ++idx) {
+        const uint64_t word = bitmap_load_word(bitmap->data + (idx << 3), 8) ^ pattern;
+        if (word) {
+            return (idx << 6) + __builtin_ctzll(word);
+        }
+    }
+
+    // Partial word at the end, the bits past bit_count are undetermined so mask them off
+    const size_t tail_bits = bitmap->bit_count & 0x3F;
+    if (tail_bits) {
+        uint64_t word = bitmap_load_word(bitmap->data + (full_words << 3), bitmap->byte_count - (full_words << 3));
+        word = (word ^ pattern) & ((UINT64_C(1) << tail_bits) - 1);
+        if (word) {
+            return (full_words << 6) + __builtin_ctzll(word);
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Concurrency: everything that changes single bits or ranges (set, reset, flip, the ranges and
+// the claims) does so with atomic operations on the data, so threads can share a bitmap without
+// a lock. Data words that are whole and 8 byte aligned are worked on as one uint64_t (claims are
+// a 64 bit compare-and-swap), anything else (a short last word, an overlay at an odd address)
+// a byte at a time. The summary is then only a hint: a word it marks may have filled up since,
+// searches look past those. The other way round can't happen once every call has returned,
+// a word with a free bit always ends up marked (see bitmap_summary_update).
+
+// Bitmap order (bit N is bit N % 8 of byte N / 8) to and from the native order of a word
+static inline uint64_t bitmap_order(const uint64_t word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(word);
+#else
+    return word;
+#endif
+}
+
+// Data word idx for atomic operations, NULL if it has to be done a byte at a time
+static inline uint64_t *bitmap_atomic_word(const bitmap_t *const bitmap, const size_t idx) {
+    uint8_t *const data = bitmap->data + (idx << 3);
+    return ((idx + 1) << 3) <= bitmap->byte_count && ((uintptr_t) data & 0x07) == 0 ? (uint64_t *) data : NULL;
+}
+
+// Data word idx with the bits past bit_count forced on, so they never look free
+static inline uint64_t bitmap_get_word(const bitmap_t *const bitmap, const size_t idx) {
+    const uint64_t *const atomic = bitmap_atomic_word(bitmap, idx);
+    uint64_t word = 0;
+    if (atomic) {
+        word = bitmap_order(__atomic_load_n(atomic, __ATOMIC_ACQUIRE));
+    } else {
+        for (size_t byte = idx << 3; byte < bitmap->byte_count && byte < (idx + 1) << 3; ++byte) {
+            word |= (uint64_t) __atomic_load_n(&bitmap->data[byte], __ATOMIC_ACQUIRE) << ((byte & 0x07) << 3);
+        }
+    }
+    const size_t valid = bitmap->bit_count - (idx << 6);
+    if (valid < 64) {
+        word |= ~((UINT64_C(1) << valid) - 1);
+    }
+    return word;
+}
+
+// Sets (or clears) the bits of word_mask in data word idx, returns the word as it was
+static uint64_t bitmap_change_word(bitmap_t *const bitmap, const size_t idx, const uint64_t word_mask, const bool value) {
+    uint64_t *const atomic = bitmap_atomic_word(bitmap, idx);
+    if (atomic) {
+        return bitmap_order(value ? __atomic_fetch_or(atomic, bitmap_order(word_mask), __ATOMIC_ACQ_REL)
+                                  : __atomic_fetch_and(atomic, ~bitmap_order(word_mask), __ATOMIC_ACQ_REL));
+    }
+    uint64_t before = 0;
+    for (size_t byte = idx << 3; byte < bitmap->byte_count && byte < (idx + 1) << 3; ++byte) {
+        const uint8_t byte_mask = (uint8_t) (word_mask >> ((byte & 0x07) << 3));
+        const uint8_t old       = !byte_mask ? __atomic_load_n(&bitmap->data[byte], __ATOMIC_ACQUIRE)
+                                : value      ? __atomic_fetch_or(&bitmap->data[byte], byte_mask, __ATOMIC_ACQ_REL)
+                                             : __atomic_fetch_and(&bitmap->data[byte], (uint8_t) ~byte_mask, __ATOMIC_ACQ_REL);
+        before |= (uint64_t) old << ((byte & 0x07) << 3);
+    }
+    return before;
+}
+
+// Sets the bits of word_mask in data word idx if none of them are set yet, all or nothing
+static bool bitmap_claim_word(bitmap_t *const bitmap, const size_t idx, const uint64_t word_mask) {
+    uint64_t *const atomic = bitmap_atomic_word(bitmap, idx);
+    if (atomic) {
+        uint64_t old = __atomic_load_n(atomic, __ATOMIC_RELAXED);
+        do {
+            if (bitmap_order(old) & word_mask) {
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(atomic, &old, old | bitmap_order(word_mask), true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        return true;
+    }
+    // a byte at a time there's no one step for the whole mask, so back out of it if any bit was taken
+    const uint64_t before = bitmap_change_word(bitmap, idx, word_mask, true);
+    if (before & word_mask) {
+        bitmap_change_word(bitmap, idx, word_mask & ~before, false);
+        return false;
+    }
+    return true;
+}
+
+// Marks data word idx as having (or not having) a free bit, and carries that up a level
+static inline void bitmap_summary_mark(bitmap_t *const bitmap, const size_t idx, const bool has_free) {
+    const size_t s = idx >> 6;
+    uint64_t *top  = bitmap->summary + bitmap->summary_words;
+    if (has_free) {
+        __atomic_fetch_or(&bitmap->summary[s], UINT64_C(1) << (idx & 0x3F), __ATOMIC_RELEASE);
+        __atomic_fetch_or(&top[s >> 6], UINT64_C(1) << (s & 0x3F), __ATOMIC_RELEASE);
+    } else if (!(__atomic_and_fetch(&bitmap->summary[s], ~(UINT64_C(1) << (idx & 0x3F)), __ATOMIC_ACQ_REL))) {
+        __atomic_fetch_and(&top[s >> 6], ~(UINT64_C(1) << (s & 0x3F)), __ATOMIC_ACQ_REL);
+        // another word of the summary word may have been marked in between
+        if (__atomic_load_n(&bitmap->summary[s], __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_or(&top[s >> 6], UINT64_C(1) << (s & 0x3F), __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Re-derives the summary for one word after it changed in an unknown direction. A word seen full
+// is checked again after it is unmarked, a bit freed in between may have been marked and then
+// unmarked again by us. Whoever frees a bit marks the word after freeing it, so it can't be missed
+static inline void bitmap_summary_update(bitmap_t *const bitmap, const size_t idx) {
+    if (~bitmap_get_word(bitmap, idx)) {
+        bitmap_summary_mark(bitmap, idx, true);
+        return;
+    }
+    bitmap_summary_mark(bitmap, idx, false);
+    if (~bitmap_get_word(bitmap, idx)) {
+        bitmap_summary_mark(bitmap, idx, true);
+    }
+}
+
+// First data word at or after idx that the summary marks as having a free bit, SIZE_MAX if there is none
+static size_t bitmap_next_marked(const bitmap_t *const bitmap, size_t idx) {
+    const uint64_t *top = bitmap->summary + bitmap->summary_words;
+    while (idx < bitmap->word_count) {
+        size_t s     = idx >> 6;
+        uint64_t sum = __atomic_load_n(&bitmap->summary[s], __ATOMIC_ACQUIRE) & (UINT64_MAX << (idx & 0x3F));
+        if (sum) {
+            return (s << 6) + __builtin_ctzll(sum);
+        }
+        // on up through the top level to the next summary word with anything in it
+        size_t t      = ++s >> 6;
+        uint64_t bits = t < bitmap->top_words ? __atomic_load_n(&top[t], __ATOMIC_ACQUIRE) & (UINT64_MAX << (s & 0x3F)) : 0;
+        while (!bits && ++t < bitmap->top_words) {
+            bits = __atomic_load_n(&top[t], __ATOMIC_ACQUIRE);
+        }
+        if (!bits) {
+            break;
+        }
+        idx = ((t << 6) + __builtin_ctzll(bits)) << 6;
+    }
+    return SIZE_MAX;
+}
+
+// Rebuilds the whole index, for anything that rewrites data in bulk
+static void bitmap_summary_rebuild(bitmap_t *const bitmap) {
+    memset(bitmap->summary, 0x00, (bitmap->summary_words + bitmap->top_words) * sizeof(uint64_t));
+    for (size_t idx = 0; idx < bitmap->word_count; ++idx) {
+        if (~bitmap_get_word(bitmap, idx)) {
+            bitmap_summary_mark(bitmap, idx, true);
+        }
+    }
+}
+
+// First set bit in [start, limit), limit if there isn't one
+static size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t start, const size_t limit) {
+    size_t idx          = start >> 6;
+    const size_t last   = (limit - 1) >> 6;
+    uint64_t word       = bitmap_get_word(bitmap, idx) & (UINT64_MAX << (start & 0x3F));
+    while (!word && ++idx <= last) {
+        word = bitmap_get_word(bitmap, idx);
+    }
+    if (word) {
+        const size_t bit = (idx << 6) + __builtin_ctzll(word);
+        return bit < limit ? bit : limit;
+    }
+    return limit;
+}
+
+// Mask of the bits of [start, end) that fall in the word holding start
+static inline uint64_t bitmap_range_mask(const size_t start, const size_t end) {
+    const size_t bits = end - start < 64 - (start & 0x3F) ? end - start : 64 - (start & 0x3F);
+    return (bits == 64 ? UINT64_MAX : (UINT64_C(1) << bits) - 1) << (start & 0x3F);
+}
+
+// Sets or clears [start, start + count) a word at a time, each followed by its summary fix up
+static void bitmap_fill_range(bitmap_t *const bitmap, const size_t start, const size_t count, const bool value) {
+    const size_t end = start + count;
+    for (size_t bit = start; bit < end; bit = ((bit >> 6) + 1) << 6) {
+        bitmap_change_word(bitmap, bit >> 6, bitmap_range_mask(bit, end), value);
+        if (value) {
+            bitmap_summary_update(bitmap, bit >> 6);
+        } else {
+            bitmap_summary_mark(bitmap, bit >> 6, true);
+        }
+    }
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    __atomic_fetch_or(&bitmap->data[bit >> 3], mask[bit & 0x07], __ATOMIC_ACQ_REL);
+    bitmap_summary_update(bitmap, bit >> 6);
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    __atomic_fetch_and(&bitmap->data[bit >> 3], invert_mask[bit & 0x07], __ATOMIC_ACQ_REL);
+    bitmap_summary_mark(bitmap, bit >> 6, true);
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) {
-    return bitmap->data[bit >> 3] & mask[bit & 0x07];
+    return __atomic_load_n(&bitmap->data[bit >> 3], __ATOMIC_ACQUIRE) & mask[bit & 0x07];
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    __atomic_fetch_xor(&bitmap->data[bit >> 3], mask[bit & 0x07], __ATOMIC_ACQ_REL);
+    bitmap_summary_update(bitmap, bit >> 6);
+}
+
+bool bitmap_claim(bitmap_t *const bitmap, const size_t bit) {
+    if (!bitmap_claim_word(bitmap, bit >> 6, UINT64_C(1) << (bit & 0x3F))) {
+        return false;
+    }
+    bitmap_summary_update(bitmap, bit >> 6);
+    return true;
+}
+
+size_t bitmap_claim_from(bitmap_t *const bitmap, const size_t start) {
+    if (!bitmap) {
+        return SIZE_MAX;
+    }
+    const size_t from = start < bitmap->bit_count ? start : 0;
+    // from the start to the end, then wrap around to the front
+    for (int pass = 0; pass < 2; ++pass) {
+        size_t bit = bitmap_ffz_from(bitmap, pass ? 0 : from);
+        while (bit != SIZE_MAX && (pass == 0 || bit < from)) {
+            // the first zero of the word at or after bit, whatever other threads take from it meanwhile
+            const size_t idx = bit >> 6;
+            uint64_t free    = ~bitmap_get_word(bitmap, idx) & (UINT64_MAX << (bit & 0x3F));
+            while (free && !bitmap_claim_word(bitmap, idx, free & -free)) {
+                free = ~bitmap_get_word(bitmap, idx) & (UINT64_MAX << (bit & 0x3F));
+            }
+            if (free) {
+                bitmap_summary_update(bitmap, idx);
+                return (idx << 6) + __builtin_ctzll(free);
+            }
+            // lost the whole word to other threads, carry on after it
+            bit = idx + 1 < bitmap->word_count ? bitmap_ffz_from(bitmap, (idx + 1) << 6) : SIZE_MAX;
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_claim_run(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    size_t run = bitmap_ffz_run(bitmap, start, count);
+    while (run != SIZE_MAX) {
+        // word by word, backing out of the words already claimed if another thread got in first
+        const size_t end = run + count;
+        size_t bit       = run;
+        while (bit < end && bitmap_claim_word(bitmap, bit >> 6, bitmap_range_mask(bit, end))) {
+            bit = ((bit >> 6) + 1) << 6;
+        }
+        if (bit >= end) {
+            for (size_t idx = run >> 6; idx <= (end - 1) >> 6; ++idx) {
+                bitmap_summary_update(bitmap, idx);
+            }
+            return run;
+        }
+        if (bit > run) {
+            bitmap_fill_range(bitmap, run, bit - run, false);
+        }
+        run = bitmap_ffz_run(bitmap, bit, count);
+    }
+    return SIZE_MAX;
 }
 
 void bitmap_invert(bitmap_t *const bitmap) {
     for (size_t byte = 0; byte < bitmap->byte_count; ++byte) {
         bitmap->data[byte] = ~bitmap->data[byte];
     }
+    bitmap_summary_rebuild(bitmap);
 }
 
 size_t bitmap_ffs(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) {
-        }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        return bitmap_scan(bitmap, 0);
     }
     return SIZE_MAX;
 }
 
 size_t bitmap_ffz(const bitmap_t *const bitmap) {
-    if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) {
+    // Walk down the summary instead of scanning, same cost at 1% full as at 99%
+    return bitmap_ffz_from(bitmap, 0);
+}
+
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start) {
+    if (bitmap && start < bitmap->bit_count) {
+        // whatever is left of the starting word first, then the words the summary marks.
+        // Those may have filled up since they were marked, the next one is tried then
+        size_t idx    = start >> 6;
+        uint64_t word = ~bitmap_get_word(bitmap, idx) & (UINT64_MAX << (start & 0x3F));
+        while (!word) {
+            idx = bitmap_next_marked(bitmap, idx + 1);
+            if (idx == SIZE_MAX) {
+                return SIZE_MAX;
+            }
+            word = ~bitmap_get_word(bitmap, idx);
+        }
+        return (idx << 6) + __builtin_ctzll(word);
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (bitmap && count) {
+        // hop from the start of each free run to the end of it until one is long enough
+        size_t run = bitmap_ffz_from(bitmap, start);
+        while (run != SIZE_MAX && count <= bitmap->bit_count - run) {
+            const size_t used = bitmap_next_set(bitmap, run, run + count);
+            if (used == run + count) {
+                return run;
+            }
+            run = bitmap_ffz_from(bitmap, used);
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
 
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) {
+        bitmap_fill_range(bitmap, start, count, true);
+    }
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) {
+        bitmap_fill_range(bitmap, start, count, false);
+    }
+}
+
 size_t bitmap_total_set(const bitmap_t *const bitmap) {
     size_t total = 0;
     if (bitmap) {
         // If we have leftover, stop a byte early because we have to handle it differently.
         size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
         for (size_t idx = 0; idx < stop; ++idx) {
-            total += bit_totals[bitmap->data[idx]];
+            total += bit_totals[__atomic_load_n(&bitmap->data[idx], __ATOMIC_RELAXED)];
         }
         if (bitmap->leftover_bits) {
             // haha, this is readable
             // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
             // then feed that to the bit_total lookup so we don't count the bits past our bit total
             // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+            total += bit_totals[__atomic_load_n(&bitmap->data[bitmap->byte_count - 1], __ATOMIC_RELAXED) & mask_down_inclusive[bitmap->leftover_bits - 1]];
         }
     }
     return total;
@@ -132,6 +455,7 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) {
     memset(bitmap->data, pattern, bitmap->byte_count);
+    bitmap_summary_rebuild(bitmap);
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) {
@@ -155,6 +479,7 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) {
         bitmap_t *bitmap = bitmap_initialize(n_bits, NONE);
         if (bitmap) {
             memcpy(bitmap->data, bitmap_data, bitmap->byte_count);
+            bitmap_summary_rebuild(bitmap);
             return bitmap;
         }
     }
@@ -166,6 +491,7 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) {
         bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY);
         if (bitmap) {
             bitmap->data = (uint8_t *) bitmap_data;
+            bitmap_summary_rebuild(bitmap);
             return bitmap;
         }
     }
@@ -178,6 +504,7 @@ void bitmap_destroy(bitmap_t *bitmap) {
             // don't free memory that isn't ours!
             free(bitmap->data);
         }
+        free(bitmap->summary);
         free(bitmap);
     }
 }
@@ -198,6 +525,16 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
             bitmap->leftover_bits = n_bits & 0x07;
             bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
 
+            // round up at every level of the summary
+            bitmap->word_count    = (n_bits + 63) >> 6;
+            bitmap->summary_words = (bitmap->word_count + 63) >> 6;
+            bitmap->top_words     = (bitmap->summary_words + 63) >> 6;
+            bitmap->summary = (uint64_t *) calloc(bitmap->summary_words + bitmap->top_words, sizeof(uint64_t));
+            if (!bitmap->summary) {
+                free(bitmap);
+                return NULL;
+            }
+
             // FLAG HANDLING HERE
 
             // This logic will need to be reworked when we have more than one flag, haha
@@ -211,10 +548,12 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
             } else {
                 bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
                 if (bitmap->data) {
+                    bitmap_summary_rebuild(bitmap);
                     return bitmap;
                 }
             }
 
+            free(bitmap->summary);
             free(bitmap);
         }
     }
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
+#include <atomic>
 #include <new>
+#include <thread>
 #include <vector>
 using std::vector;
 using std::string;
@@ -9,6 +12,8 @@ using std::string;
 extern "C" 
 {
 #include "FS.h"
+#include "bitmap.h"
+#include "block_store.h"
 }
 
 unsigned int score;
@@ -811,6 +816,1937 @@ TEST(h_tests, read)
 	score += 20;
 }
 
+/*
+   ssize_t fs_writev(FS *fs, int fd, const struct iovec *iov, int iovcnt);
+   ssize_t fs_readv(FS *fs, int fd, const struct iovec *iov, int iovcnt);
+   1. Normal, header + payload in one call
+   2. Normal, segments crossing block boundaries
+   3. Normal, read back into differently split buffers
+   4. Normal, read passes EOF
+   5. Normal, empty segments / iovcnt 0
+   6. Error, NULL fs
+   7. Error, NULL iov
+   8. Error, NULL segment with a length
+   9. Error, bad fd
+ */
+TEST(k_tests, readv_writev)
+{
+	const char *test_fname = "k_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/records", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/records");
+	ASSERT_GE(fd, 0);
+
+	uint8_t header[100];
+	memset(header, 0x11, sizeof(header));
+	uint8_t payload[BLOCK_SIZE_BYTES * 2];
+	for (size_t i = 0; i < sizeof(payload); ++i) {
+		payload[i] = (uint8_t) i;
+	}
+	uint8_t expected[sizeof(header) * 2 + sizeof(payload) * 2];
+	memcpy(expected, header, sizeof(header));
+	memcpy(expected + sizeof(header), payload, sizeof(payload));
+	memcpy(expected + sizeof(header) + sizeof(payload), header, sizeof(header));
+	memcpy(expected + sizeof(header) * 2 + sizeof(payload), payload, sizeof(payload));
+
+	// FS_WRITEV 1, 2
+	struct iovec record[2] = {{header, sizeof(header)}, {payload, sizeof(payload)}};
+	ASSERT_EQ(fs_writev(fs, fd, record, 2), (ssize_t) (sizeof(header) + sizeof(payload)));
+	ASSERT_EQ(fs_writev(fs, fd, record, 2), (ssize_t) (sizeof(header) + sizeof(payload)));
+	// FS_WRITEV 5
+	struct iovec empty = {NULL, 0};
+	ASSERT_EQ(fs_writev(fs, fd, &empty, 1), 0);
+	ASSERT_EQ(fs_writev(fs, fd, record, 0), 0);
+	// FS_WRITEV 6, 7, 8, 9
+	ASSERT_LT(fs_writev(NULL, fd, record, 2), 0);
+	ASSERT_LT(fs_writev(fs, fd, NULL, 2), 0);
+	struct iovec bad = {NULL, 12};
+	ASSERT_LT(fs_writev(fs, fd, &bad, 1), 0);
+	ASSERT_LT(fs_writev(fs, 90, record, 2), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// FS_READV 3
+	fd = fs_open(fs, "/records");
+	ASSERT_GE(fd, 0);
+	uint8_t read_space[sizeof(expected) + 500] = {0};
+	struct iovec split[3] = {{read_space, 7}, {read_space + 7, BLOCK_SIZE_BYTES * 3}, {read_space + 7 + BLOCK_SIZE_BYTES * 3, 193}};
+	ASSERT_EQ(fs_readv(fs, fd, split, 3), (ssize_t) (7 + BLOCK_SIZE_BYTES * 3 + 193));
+	// FS_READV 4
+	struct iovec rest = {read_space + 200 + BLOCK_SIZE_BYTES * 3, BLOCK_SIZE_BYTES + 400};
+	ASSERT_EQ(fs_readv(fs, fd, &rest, 1), (ssize_t) (sizeof(expected) - 200 - BLOCK_SIZE_BYTES * 3));
+	ASSERT_EQ(memcmp(read_space, expected, sizeof(expected)), 0);
+	ASSERT_EQ(fs_readv(fs, fd, &rest, 1), 0);
+	// FS_READV 6, 7, 8, 9
+	ASSERT_LT(fs_readv(NULL, fd, split, 3), 0);
+	ASSERT_LT(fs_readv(fs, fd, NULL, 3), 0);
+	ASSERT_LT(fs_readv(fs, fd, &bad, 1), 0);
+	ASSERT_LT(fs_readv(fs, -90, split, 3), 0);
+
+	fs_unmount(fs);
+}
+
+/*
+   ssize_t fs_pwrite(FS *fs, int fd, const void *src, size_t nbyte, off_t offset);
+   ssize_t fs_pread(FS *fs, int fd, void *dst, size_t nbyte, off_t offset);
+   1. Normal, overwrite inside the file
+   2. Normal, extend the file into the indirect range
+   3. Normal, read at offsets in direct and indirect range
+   4. Normal, read passes EOF / starts at EOF
+   5. Normal, descriptor position untouched
+   6. Error, NULL fs / data
+   7. Error, negative offset
+   8. Error, bad fd
+ */
+TEST(l_tests, pread_pwrite)
+{
+	const char *test_fname = "l_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/random", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/random");
+	ASSERT_GE(fd, 0);
+
+	const size_t file_size = BLOCK_SIZE_BYTES * 8;
+	uint8_t *contents = new uint8_t[file_size];
+	memset(contents, 0x5A, file_size);
+	ASSERT_EQ(fs_write(fs, fd, contents, BLOCK_SIZE_BYTES * 4), BLOCK_SIZE_BYTES * 4);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/random");
+	ASSERT_GE(fd, 0);
+
+	// FS_PWRITE 1
+	uint8_t stamp[300];
+	memset(stamp, 0xC3, sizeof(stamp));
+	ASSERT_EQ(fs_pwrite(fs, fd, stamp, sizeof(stamp), BLOCK_SIZE_BYTES - 100), (ssize_t) sizeof(stamp));
+	memcpy(contents + BLOCK_SIZE_BYTES - 100, stamp, sizeof(stamp));
+	// FS_PWRITE 2
+	ASSERT_EQ(fs_pwrite(fs, fd, contents + BLOCK_SIZE_BYTES * 4, BLOCK_SIZE_BYTES * 4, BLOCK_SIZE_BYTES * 4), BLOCK_SIZE_BYTES * 4);
+	ASSERT_EQ(fs_pwrite(fs, fd, stamp, sizeof(stamp), BLOCK_SIZE_BYTES * 7 + 5), (ssize_t) sizeof(stamp));
+	memcpy(contents + BLOCK_SIZE_BYTES * 7 + 5, stamp, sizeof(stamp));
+	// FS_PWRITE 5
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), 0);
+
+	// FS_PREAD 3
+	uint8_t read_space[BLOCK_SIZE_BYTES * 2];
+	ASSERT_EQ(fs_pread(fs, fd, read_space, 500, BLOCK_SIZE_BYTES - 200), 500);
+	ASSERT_EQ(memcmp(read_space, contents + BLOCK_SIZE_BYTES - 200, 500), 0);
+	ASSERT_EQ(fs_pread(fs, fd, read_space, BLOCK_SIZE_BYTES * 2, BLOCK_SIZE_BYTES * 5 + 17), BLOCK_SIZE_BYTES * 2);
+	ASSERT_EQ(memcmp(read_space, contents + BLOCK_SIZE_BYTES * 5 + 17, BLOCK_SIZE_BYTES * 2), 0);
+	// FS_PREAD 4
+	ASSERT_EQ(fs_pread(fs, fd, read_space, BLOCK_SIZE_BYTES, file_size - 10), 10);
+	ASSERT_EQ(memcmp(read_space, contents + file_size - 10, 10), 0);
+	ASSERT_EQ(fs_pread(fs, fd, read_space, BLOCK_SIZE_BYTES, file_size), 0);
+	// FS_PREAD 5
+	ASSERT_EQ(fs_read(fs, fd, read_space, 100), 100);
+	ASSERT_EQ(memcmp(read_space, contents, 100), 0);
+
+	// FS_PREAD 6, 7, 8
+	ASSERT_LT(fs_pread(NULL, fd, read_space, 10, 0), 0);
+	ASSERT_LT(fs_pread(fs, fd, NULL, 10, 0), 0);
+	ASSERT_LT(fs_pread(fs, fd, read_space, 10, -1), 0);
+	ASSERT_LT(fs_pread(fs, 90, read_space, 10, 0), 0);
+	ASSERT_LT(fs_pwrite(NULL, fd, stamp, 10, 0), 0);
+	ASSERT_LT(fs_pwrite(fs, fd, NULL, 10, 0), 0);
+	ASSERT_LT(fs_pwrite(fs, fd, stamp, 10, -1), 0);
+	ASSERT_LT(fs_pwrite(fs, -90, stamp, 10, 0), 0);
+
+	delete[] contents;
+	fs_unmount(fs);
+}
+
+/*
+   off_t fs_seek(FS *fs, int fd, off_t offset, seek_t whence)
+   (layout checks, the graded seek tests live in g_tests)
+   1. Normal, SET/CUR/END into the direct, indirect and double indirect ranges
+   2. Normal, reads and writes continue from the seeked position
+   3. Normal, clamps to BOF/EOF
+ */
+TEST(m_tests, seek_layout)
+{
+	const char *test_fname = "m_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/big");
+	ASSERT_GE(fd, 0);
+
+	// 6 direct + 512 indirect + 2 blocks into the double indirect range
+	const size_t blocks = 6 + 512 + 2;
+	uint8_t block[BLOCK_SIZE_BYTES];
+	for (size_t i = 0; i < blocks; ++i) {
+		memset(block, (int) (i & 0xFF), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(fs_write(fs, fd, block, BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	}
+	const off_t file_size = blocks * BLOCK_SIZE_BYTES;
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), file_size);
+
+	// FS_SEEK 1, 2
+	uint8_t byte = 0;
+	const off_t targets[] = {0, 5 * BLOCK_SIZE_BYTES + 7, 6 * BLOCK_SIZE_BYTES, 300 * BLOCK_SIZE_BYTES + 4095,
+		518 * BLOCK_SIZE_BYTES, 519 * BLOCK_SIZE_BYTES + 1};
+	for (off_t target : targets) {
+		ASSERT_EQ(fs_seek(fs, fd, target, FS_SEEK_SET), target);
+		ASSERT_EQ(fs_read(fs, fd, &byte, 1), 1);
+		ASSERT_EQ(byte, (uint8_t) (target / BLOCK_SIZE_BYTES));
+		ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), target + 1);
+	}
+	ASSERT_EQ(fs_seek(fs, fd, -(off_t) BLOCK_SIZE_BYTES, FS_SEEK_END), file_size - BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_seek(fs, fd, -3 * BLOCK_SIZE_BYTES, FS_SEEK_CUR), file_size - 4 * BLOCK_SIZE_BYTES);
+	memset(block, 0xEE, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_write(fs, fd, block, 10), 10);
+	ASSERT_EQ(fs_seek(fs, fd, -10, FS_SEEK_CUR), file_size - 4 * BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_read(fs, fd, &byte, 1), 1);
+	ASSERT_EQ(byte, 0xEE);
+	// overwriting doesn't grow the file
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), file_size);
+
+	// FS_SEEK 3
+	ASSERT_EQ(fs_seek(fs, fd, 1, FS_SEEK_END), file_size);
+	ASSERT_EQ(fs_seek(fs, fd, -file_size - 1, FS_SEEK_END), 0);
+	ASSERT_EQ(fs_seek(fs, fd, file_size * 2, FS_SEEK_CUR), file_size);
+
+	fs_unmount(fs);
+}
+
+/*
+   int fs_sync(FS *fs);
+   (inode cache write-back)
+   1. Normal, inode changes stay cached until sync
+   2. Normal, sync writes them back
+   3. Normal, close of the last descriptor writes them back
+   4. Error, NULL fs
+ */
+TEST(n_tests, inode_cache_sync)
+{
+	const char *test_fname = "n_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/cached", FS_REGULAR), 0);
+	ASSERT_EQ(fs_sync(fs), 0);
+	int fd = fs_open(fs, "/cached");
+	ASSERT_GE(fd, 0);
+	uint8_t data[100];
+	memset(data, 0x42, sizeof(data));
+	ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+
+	// FS_SYNC 1, a second mount of the same file only sees the inode store
+	FS *other = fs_mount(test_fname);
+	ASSERT_NE(other, nullptr);
+	int other_fd = fs_open(other, "/cached");
+	ASSERT_GE(other_fd, 0);
+	ASSERT_EQ(fs_seek(other, other_fd, 0, FS_SEEK_END), 0);
+	fs_unmount(other);
+
+	// FS_SYNC 2
+	ASSERT_EQ(fs_sync(fs), 0);
+	other = fs_mount(test_fname);
+	ASSERT_NE(other, nullptr);
+	other_fd = fs_open(other, "/cached");
+	ASSERT_GE(other_fd, 0);
+	ASSERT_EQ(fs_seek(other, other_fd, 0, FS_SEEK_END), (off_t) sizeof(data));
+	fs_unmount(other);
+
+	// FS_SYNC 3
+	ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	other = fs_mount(test_fname);
+	ASSERT_NE(other, nullptr);
+	other_fd = fs_open(other, "/cached");
+	ASSERT_GE(other_fd, 0);
+	ASSERT_EQ(fs_seek(other, other_fd, 0, FS_SEEK_END), (off_t) sizeof(data) * 2);
+	fs_unmount(other);
+
+	// FS_SYNC 4
+	ASSERT_LT(fs_sync(NULL), 0);
+	fs_unmount(fs);
+}
+
+/*
+   (dentry cache, through fs_open/fs_create/fs_get_dir)
+   1. Normal, a name that failed to resolve resolves once it is created
+   2. Normal, repeated deep lookups keep resolving to the same file
+   3. Normal, same name in different directories
+ */
+TEST(o_tests, dentry_cache)
+{
+	const char *test_fname = "o_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/a", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/a/b", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/a/b/c", FS_DIRECTORY), 0);
+
+	// DENTRY 1
+	ASSERT_LT(fs_open(fs, "/a/b/c/file"), 0);
+	ASSERT_LT(fs_create(fs, "/a/b/c/d/file", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/a/b/c/file", FS_REGULAR), 0);
+	ASSERT_LT(fs_create(fs, "/a/b/c/file", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/a/b/c/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, test_fname, 10), 10);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// DENTRY 2
+	for (int i = 0; i < 100; ++i) {
+		fd = fs_open(fs, "/a/b/c/file");
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), 10);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+
+	// DENTRY 3
+	ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+	fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), 0);
+	dyn_array_t *record_results = fs_get_dir(fs, "/a/b/c");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_TRUE(find_in_directory(record_results, "file"));
+	ASSERT_EQ(dyn_array_size(record_results), 1);
+	dyn_array_destroy(record_results);
+
+	fs_unmount(fs);
+}
+
+/*
+   (hashed directories, through fs_create/fs_open/fs_get_dir)
+   1. Normal, a directory well past one leaf block of entries
+   2. Normal, every name resolves, also after a remount
+   3. Error, duplicate name in a split directory
+   4. Error, out of inodes, not directory full
+   5. Normal, an image formatted before directories were hashed (one block of up to 31 entries
+      with a bitmap of them in the inode) mounts with its files, and keeps working after a remount
+ */
+TEST(p_tests, large_directory)
+{
+	const char *test_fname = "p_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/big", FS_DIRECTORY), 0);
+
+	// HASHED_DIR 1
+	// root and /big hold the first two inodes
+	const int files = 254;
+	char path[64];
+	for (int i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "/big/file_%d", i);
+		ASSERT_EQ(fs_create(fs, path, FS_REGULAR), 0);
+	}
+	dyn_array_t *record_results = fs_get_dir(fs, "/big");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), (size_t) files);
+	ASSERT_TRUE(find_in_directory(record_results, "file_0"));
+	ASSERT_TRUE(find_in_directory(record_results, "file_253"));
+	dyn_array_destroy(record_results);
+
+	// HASHED_DIR 2
+	fs_unmount(fs);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	for (int i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "/big/file_%d", i);
+		int fd = fs_open(fs, path);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	ASSERT_LT(fs_open(fs, "/big/file_254"), 0);
+
+	// HASHED_DIR 3
+	ASSERT_LT(fs_create(fs, "/big/file_100", FS_REGULAR), 0);
+
+	// HASHED_DIR 4
+	ASSERT_LT(fs_create(fs, "/big/file_254", FS_REGULAR), 0);
+	record_results = fs_get_dir(fs, "/big");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), (size_t) files);
+	dyn_array_destroy(record_results);
+
+	fs_unmount(fs);
+
+	// HASHED_DIR 5
+	// what the first fs_format left after creating /a holding "hello", /d and /d/x: the inode bitmap
+	// in block 0, 64 byte inodes from block 1 (entry bitmap at 0, type at 22, number, size and
+	// link count from 24, block pointers from 48), one block of 128 byte entries per directory
+	// and the free block map in the last two blocks
+	const char *legacy_fname = "p_tests_legacy.FS";
+	FILE *image = fopen(legacy_fname, "wb");
+	ASSERT_NE(image, nullptr);
+	auto put = [&](size_t offset, const void *bytes, size_t count) {
+		ASSERT_EQ(fseek(image, (long) offset, SEEK_SET), 0);
+		ASSERT_EQ(fwrite(bytes, 1, count, image), count);
+	};
+	auto put_inode = [&](size_t id, char type, uint32_t entries, size_t size, uint16_t block) {
+		uint8_t raw[64] = {0};
+		const size_t links = 1;
+		memcpy(raw, &entries, sizeof(entries));
+		raw[22] = type;
+		memcpy(raw + 24, &id, sizeof(id));
+		memcpy(raw + 32, &size, sizeof(size));
+		memcpy(raw + 40, &links, sizeof(links));
+		memcpy(raw + 48, &block, sizeof(block));
+		put(BLOCK_SIZE_BYTES + id * sizeof(raw), raw, sizeof(raw));
+	};
+	auto put_entry = [&](uint16_t block, size_t slot, const char *name, uint8_t inode) {
+		uint8_t raw[128] = {0};
+		strcpy((char *) raw, name);
+		raw[127] = inode;
+		put(block * BLOCK_SIZE_BYTES + slot * sizeof(raw), raw, sizeof(raw));
+	};
+	const uint8_t used_inodes = 0x0F, used_blocks = 0xFF, fbm_tail = 0xFF;
+	put(0, &used_inodes, 1);
+	put_inode(0, 'd', 0x3, 0, 5);
+	put_inode(1, 'r', 0, 5, 6);
+	put_inode(2, 'd', 0x1, 0, 7);
+	put_inode(3, 'r', 0, 0, 0);
+	put_entry(5, 0, "a", 1);
+	put_entry(5, 1, "d", 2);
+	put(6 * BLOCK_SIZE_BYTES, "hello", 5);
+	put_entry(7, 0, "x", 3);
+	put((size_t) BLOCK_STORE_AVAIL_BLOCKS * BLOCK_SIZE_BYTES, &used_blocks, 1);
+	put((size_t) BLOCK_STORE_NUM_BYTES - 1, &fbm_tail, 1);
+	fclose(image);
+
+	for (int mount = 0; mount < 2; ++mount) {
+		fs = fs_mount(legacy_fname);
+		ASSERT_NE(fs, nullptr);
+		record_results = fs_get_dir(fs, "/");
+		ASSERT_NE(record_results, nullptr);
+		ASSERT_EQ(dyn_array_size(record_results), (size_t) (mount == 0 ? 2 : 3));
+		ASSERT_TRUE(find_in_directory(record_results, "a"));
+		ASSERT_TRUE(find_in_directory(record_results, "d"));
+		dyn_array_destroy(record_results);
+		record_results = fs_get_dir(fs, "/d");
+		ASSERT_NE(record_results, nullptr);
+		ASSERT_EQ(dyn_array_size(record_results), (size_t) 1);
+		ASSERT_TRUE(find_in_directory(record_results, "x"));
+		dyn_array_destroy(record_results);
+		char hello[8] = {0};
+		int fd = fs_open(fs, "/a");
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_read(fs, fd, hello, sizeof(hello)), 5);
+		ASSERT_STREQ(hello, "hello");
+		ASSERT_EQ(fs_close(fs, fd), 0);
+		if (mount == 0) {
+			ASSERT_EQ(fs_create(fs, "/c", FS_REGULAR), 0);
+			ASSERT_LT(fs_create(fs, "/a", FS_REGULAR), 0);
+		}
+		fs_unmount(fs);
+	}
+}
+
+/*
+   ssize_t fs_create_many(FS *fs, const char *path, const char *const *names, size_t count, file_t type);
+   ssize_t fs_stat_many(FS *fs, const char *path, const char *const *names, size_t count, file_stat_t *stats);
+   1. Normal, batch of files in one directory
+   2. Normal, stat existing and missing names
+   3. Normal, batch stops at a name that already exists, the rest can be created after
+   4. Normal, batch cut short by running out of inodes
+   5. Error, FS null
+   6. Error, path not a directory
+   7. Error, bad type / bad name
+ */
+TEST(q_tests, batch_metadata)
+{
+	const char *test_fname = "q_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/ingest", FS_DIRECTORY), 0);
+
+	// BATCH 1
+	vector<string> storage;
+	for (int i = 0; i < 100; ++i) {
+		storage.push_back("file_" + std::to_string(i));
+	}
+	vector<const char *> names;
+	for (const string &name : storage) {
+		names.push_back(name.c_str());
+	}
+	ASSERT_EQ(fs_create_many(fs, "/ingest", names.data(), names.size(), FS_REGULAR), 100);
+	dyn_array_t *record_results = fs_get_dir(fs, "/ingest");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), (size_t) 100);
+	dyn_array_destroy(record_results);
+	int fd = fs_open(fs, "/ingest/file_7");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, test_fname, 10), 10);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// BATCH 2
+	const char *lookups[] = {"file_7", "missing", "file_99", "file_100"};
+	file_stat_t stats[4];
+	ASSERT_EQ(fs_stat_many(fs, "/ingest", lookups, 4, stats), 2);
+	ASSERT_NE(stats[0].inode, SIZE_MAX);
+	ASSERT_EQ(stats[0].type, FS_REGULAR);
+	ASSERT_EQ(stats[0].size, (size_t) 10);
+	ASSERT_EQ(stats[0].links, (size_t) 1);
+	ASSERT_EQ(stats[1].inode, SIZE_MAX);
+	ASSERT_NE(stats[2].inode, SIZE_MAX);
+	ASSERT_EQ(stats[2].size, (size_t) 0);
+	ASSERT_EQ(stats[3].inode, SIZE_MAX);
+	const char *root_lookup[] = {"ingest"};
+	ASSERT_EQ(fs_stat_many(fs, "/", root_lookup, 1, stats), 1);
+	ASSERT_EQ(stats[0].type, FS_DIRECTORY);
+
+	// BATCH 3
+	const char *clash[] = {"a", "b", "file_5", "c"};
+	ASSERT_EQ(fs_create_many(fs, "/ingest", clash, 4, FS_DIRECTORY), 2);
+	ASSERT_EQ(fs_create_many(fs, "/ingest", clash + 3, 1, FS_DIRECTORY), 1);
+	ASSERT_EQ(fs_stat_many(fs, "/ingest", clash, 4, stats), 4);
+	ASSERT_EQ(stats[3].type, FS_DIRECTORY);
+
+	// BATCH 4
+	// root, /ingest and 103 files leave 151 inodes
+	storage.clear();
+	for (int i = 0; i < 200; ++i) {
+		storage.push_back("more_" + std::to_string(i));
+	}
+	names.clear();
+	for (const string &name : storage) {
+		names.push_back(name.c_str());
+	}
+	ASSERT_EQ(fs_create_many(fs, "/ingest", names.data(), names.size(), FS_REGULAR), 151);
+	ASSERT_LT(fs_create(fs, "/one_more", FS_REGULAR), 0);
+
+	// BATCH 5
+	ASSERT_LT(fs_create_many(NULL, "/ingest", clash, 4, FS_REGULAR), 0);
+	ASSERT_LT(fs_stat_many(NULL, "/ingest", clash, 4, stats), 0);
+
+	// BATCH 6
+	ASSERT_LT(fs_create_many(fs, "/ingest/file_7", clash, 4, FS_REGULAR), 0);
+	ASSERT_LT(fs_stat_many(fs, "/ingest/file_7", clash, 4, stats), 0);
+	ASSERT_LT(fs_stat_many(fs, "/nope", clash, 4, stats), 0);
+
+	// BATCH 7
+	ASSERT_LT(fs_create_many(fs, "/ingest", clash, 4, (file_t) 44), 0);
+	fs_unmount(fs);
+	fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	const char *bad[] = {"ok", "no/slash", "never"};
+	ASSERT_EQ(fs_create_many(fs, "/", bad, 3, FS_REGULAR), 1);
+	ASSERT_EQ(fs_stat_many(fs, "/", bad, 3, stats), 1);
+
+	fs_unmount(fs);
+}
+
+/*
+   (fs_remove, space coming back)
+   1. Normal, a file reaching into the double indirects, written and removed until it
+      has gone through more blocks than the store holds
+   2. Normal, removing an open file closes its descriptors
+   3. Normal, directory emptied and removed, its inode reused
+   4. Error, directory with contents
+   5. Error, removed file no longer resolves
+ */
+TEST(r_tests, remove_reclaims)
+{
+	const char *test_fname = "r_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+
+	// REMOVE 1
+	// 96 MiB a round, three rounds would not fit without getting the blocks back
+	const size_t chunk = BLOCK_SIZE_BYTES * 64;
+	const size_t chunks = 384;
+	vector<uint8_t> data(chunk, 0x5A);
+	for (int round = 0; round < 3; ++round) {
+		ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+		int fd = fs_open(fs, "/big");
+		ASSERT_GE(fd, 0);
+		for (size_t i = 0; i < chunks; ++i) {
+			ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+		}
+		ASSERT_EQ(fs_close(fs, fd), 0);
+		ASSERT_EQ(fs_remove(fs, "/big"), 0);
+	}
+
+	// REMOVE 2
+	ASSERT_EQ(fs_create(fs, "/open", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/open");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), 100), 100);
+	ASSERT_EQ(fs_remove(fs, "/open"), 0);
+	ASSERT_LT(fs_close(fs, fd), 0);
+
+	// REMOVE 3
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/a", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/b", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_remove(fs, "/dir/a"), 0);
+	dyn_array_t *record_results = fs_get_dir(fs, "/dir");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), (size_t) 1);
+	ASSERT_TRUE(find_in_directory(record_results, "b"));
+	dyn_array_destroy(record_results);
+
+	// REMOVE 4
+	ASSERT_LT(fs_remove(fs, "/dir"), 0);
+	ASSERT_EQ(fs_remove(fs, "/dir/b"), 0);
+	ASSERT_EQ(fs_remove(fs, "/dir"), 0);
+	record_results = fs_get_dir(fs, "/");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), (size_t) 0);
+	dyn_array_destroy(record_results);
+	// every inode but the root's is free again
+	char path[32];
+	for (int i = 0; i < 255; ++i) {
+		snprintf(path, sizeof(path), "/f%d", i);
+		ASSERT_EQ(fs_create(fs, path, FS_REGULAR), 0);
+	}
+	ASSERT_LT(fs_create(fs, "/one_more", FS_REGULAR), 0);
+	ASSERT_EQ(fs_remove(fs, "/f17"), 0);
+	ASSERT_EQ(fs_create(fs, "/one_more", FS_REGULAR), 0);
+
+	// REMOVE 5
+	ASSERT_LT(fs_open(fs, "/f17"), 0);
+	ASSERT_LT(fs_remove(fs, "/f17"), 0);
+	ASSERT_LT(fs_remove(fs, "/"), 0);
+	fs_unmount(fs);
+}
+
+/*
+   (deferred reclamation, fs_remove hands the blocks to the reclaimer thread)
+   1. Normal, remove returns with the entry gone, the blocks come back in the background
+   2. Normal, mount finishes a reclaim that was cut off (image copied right after the remove)
+   3. Normal, unmount finishes pending reclaims
+   4. Error, mounting a path with no image returns NULL instead of recovering from nothing
+ */
+TEST(s_tests, deferred_reclaim)
+{
+	const char *test_fname = "s_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	const size_t chunk = BLOCK_SIZE_BYTES * 64;
+	vector<uint8_t> data(chunk, 0x3C);
+
+	// RECLAIM 1
+	// 160 MiB, a second one only fits once the first is reclaimed
+	const size_t chunks = 640;
+	ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/a");
+	ASSERT_GE(fd, 0);
+	for (size_t i = 0; i < chunks; ++i) {
+		ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_remove(fs, "/a"), 0);
+	ASSERT_LT(fs_open(fs, "/a"), 0);
+
+	// RECLAIM 2
+	// the copy is what a crash would leave behind, only what has been committed is in it
+	ASSERT_EQ(fs_sync(fs), 0);
+	ASSERT_EQ(system("cp s_tests.FS s_tests_copy.FS"), 0);
+	FS *copy = fs_mount("s_tests_copy.FS");
+	ASSERT_NE(copy, nullptr);
+	ASSERT_EQ(fs_create(copy, "/b", FS_REGULAR), 0);
+	fd = fs_open(copy, "/b");
+	ASSERT_GE(fd, 0);
+	for (size_t i = 0; i < chunks; ++i) {
+		ASSERT_EQ(fs_write(copy, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_close(copy, fd), 0);
+	dyn_array_t *record_results = fs_get_dir(copy, "/");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), (size_t) 1);
+	dyn_array_destroy(record_results);
+	fs_unmount(copy);
+
+	// RECLAIM 3
+	ASSERT_EQ(fs_create(fs, "/c", FS_REGULAR), 0);
+	fd = fs_open(fs, "/c");
+	ASSERT_GE(fd, 0);
+	for (size_t i = 0; i < chunks; ++i) {
+		ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_remove(fs, "/c"), 0);
+	fs_unmount(fs);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/d", FS_REGULAR), 0);
+	fd = fs_open(fs, "/d");
+	ASSERT_GE(fd, 0);
+	for (size_t i = 0; i < chunks; ++i) {
+		ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// RECLAIM 4
+	ASSERT_EQ(fs_mount("/nonexistent/s_tests.FS"), nullptr);
+	ASSERT_EQ(fs_mount("s_tests_missing.FS"), nullptr);
+}
+
+/*
+   (fs_move and fs_link, directory entries only)
+   1. Normal, move a large file between directories, open descriptor and data intact
+   2. Normal, rename within a directory, old name gone
+   3. Normal, link, write through one name and read through the other
+   4. Normal, removing one link keeps the file, removing the last one frees it
+   5. Error, directory into itself / into its own subdirectory
+   6. Error, dst exists, src missing, root as either end
+   7. Normal, a directory linked elsewhere. Error, a directory linked or moved into its own subtree,
+      also when the destination is named through another link to a directory inside it
+ */
+TEST(t_tests, move_link)
+{
+	const char *test_fname = "t_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	const size_t chunk = BLOCK_SIZE_BYTES * 64;
+	vector<uint8_t> data(chunk);
+	vector<uint8_t> check(chunk);
+
+	// MOVE_LINK 1
+	ASSERT_EQ(fs_create(fs, "/src", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dst", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/src/big", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/src/big");
+	ASSERT_GE(fd, 0);
+	for (int i = 0; i < 256; ++i) {
+		memset(data.data(), i, chunk);
+		ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_move(fs, "/src/big", "/dst/big"), 0);
+	ASSERT_LT(fs_open(fs, "/src/big"), 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), (off_t) (chunk * 256));
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/dst/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), chunk, chunk * 200), (ssize_t) chunk);
+	memset(data.data(), 200, chunk);
+	ASSERT_EQ(memcmp(data.data(), check.data(), chunk), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// MOVE_LINK 2
+	ASSERT_EQ(fs_move(fs, "/dst/big", "/dst/renamed"), 0);
+	dyn_array_t *record_results = fs_get_dir(fs, "/dst");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), (size_t) 1);
+	ASSERT_TRUE(find_in_directory(record_results, "renamed"));
+	dyn_array_destroy(record_results);
+
+	// MOVE_LINK 3
+	ASSERT_EQ(fs_link(fs, "/dst/renamed", "/src/alias"), 0);
+	fd = fs_open(fs, "/src/alias");
+	ASSERT_GE(fd, 0);
+	memset(data.data(), 0xEE, 100);
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), 100, 10), 100);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/dst/renamed");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), 100, 10), 100);
+	ASSERT_EQ(memcmp(data.data(), check.data(), 100), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	const char *names[] = {"alias"};
+	file_stat_t stats[1];
+	ASSERT_EQ(fs_stat_many(fs, "/src", names, 1, stats), 1);
+	ASSERT_EQ(stats[0].links, (size_t) 2);
+
+	// MOVE_LINK 4
+	ASSERT_EQ(fs_remove(fs, "/dst/renamed"), 0);
+	ASSERT_EQ(fs_stat_many(fs, "/src", names, 1, stats), 1);
+	ASSERT_EQ(stats[0].links, (size_t) 1);
+	ASSERT_EQ(stats[0].size, chunk * 256);
+	ASSERT_EQ(fs_remove(fs, "/src/alias"), 0);
+	// the 64 MiB file is gone, three more fit again
+	for (int i = 0; i < 3; ++i) {
+		char path[16];
+		snprintf(path, sizeof(path), "/f%d", i);
+		ASSERT_EQ(fs_create(fs, path, FS_REGULAR), 0);
+		fd = fs_open(fs, path);
+		ASSERT_GE(fd, 0);
+		for (int j = 0; j < 256; ++j) {
+			ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+		}
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+
+	// MOVE_LINK 5
+	ASSERT_EQ(fs_create(fs, "/src/sub", FS_DIRECTORY), 0);
+	ASSERT_LT(fs_move(fs, "/src", "/src/inside"), 0);
+	ASSERT_LT(fs_move(fs, "/src", "/src/sub/inside"), 0);
+	ASSERT_EQ(fs_move(fs, "/src/sub", "/dst/sub"), 0);
+	ASSERT_EQ(fs_move(fs, "/src", "/dst/sub/src"), 0);
+	record_results = fs_get_dir(fs, "/dst/sub");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_TRUE(find_in_directory(record_results, "src"));
+	dyn_array_destroy(record_results);
+
+	// MOVE_LINK 6
+	ASSERT_LT(fs_move(fs, "/f0", "/f1"), 0);
+	ASSERT_LT(fs_link(fs, "/f0", "/f1"), 0);
+	ASSERT_LT(fs_move(fs, "/nope", "/f9"), 0);
+	ASSERT_LT(fs_link(fs, "/nope", "/f9"), 0);
+	ASSERT_LT(fs_move(fs, "/", "/f9"), 0);
+	ASSERT_LT(fs_move(fs, "/f0", "/"), 0);
+	ASSERT_LT(fs_link(fs, "/f0", "/"), 0);
+	ASSERT_LT(fs_move(NULL, "/f0", "/f9"), 0);
+	ASSERT_LT(fs_link(fs, NULL, "/f9"), 0);
+
+	// MOVE_LINK 7
+	ASSERT_EQ(fs_link(fs, "/dst/sub", "/sub_alias"), 0);
+	const char *dir_names[] = {"sub_alias"};
+	ASSERT_EQ(fs_stat_many(fs, "/", dir_names, 1, stats), 1);
+	ASSERT_EQ(stats[0].type, FS_DIRECTORY);
+	ASSERT_EQ(stats[0].links, (size_t) 2);
+	record_results = fs_get_dir(fs, "/sub_alias");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_TRUE(find_in_directory(record_results, "src"));
+	dyn_array_destroy(record_results);
+	ASSERT_LT(fs_link(fs, "/dst/sub", "/dst/sub/loop"), 0);
+	ASSERT_LT(fs_link(fs, "/dst/sub", "/dst/sub/src/loop"), 0);
+	ASSERT_LT(fs_link(fs, "/sub_alias", "/dst/sub/src/loop"), 0);
+	ASSERT_EQ(fs_link(fs, "/dst/sub/src", "/src_alias"), 0);
+	ASSERT_LT(fs_link(fs, "/dst/sub", "/src_alias/loop"), 0);
+	ASSERT_LT(fs_move(fs, "/dst", "/src_alias/loop"), 0);
+	record_results = fs_get_dir(fs, "/dst/sub/src");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_FALSE(find_in_directory(record_results, "loop"));
+	dyn_array_destroy(record_results);
+
+	fs_unmount(fs);
+}
+
+/*
+   (sparse files, fs_pwrite past EOF leaves a hole)
+   1. Normal, write far past EOF, hole reads as zeros even over reused blocks
+   2. Normal, partial blocks around the hole edges read as zeros
+   3. Normal, filling in part of a hole, the rest stays zero and the size is unchanged
+   4. Normal, sequential fs_read across direct, indirect and double indirect holes
+   5. Normal, many sparse files take next to no space, a near full size file still fits
+ */
+TEST(u_tests, sparse_files)
+{
+	const char *test_fname = "u_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	const size_t chunk = BLOCK_SIZE_BYTES * 64;
+	vector<uint8_t> data(chunk, 0x5A);
+	vector<uint8_t> check(chunk);
+	vector<uint8_t> zeros(chunk, 0);
+
+	// leave old data in most of the store so hole reads can't pass by accident
+	ASSERT_EQ(fs_create(fs, "/junk", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/junk");
+	ASSERT_GE(fd, 0);
+	for (int i = 0; i < 512; ++i) {
+		ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_remove(fs, "/junk"), 0);
+	reclaim_drain(fs);
+
+	// SPARSE 1
+	const off_t far = (off_t) 200 << 20;
+	ASSERT_EQ(fs_create(fs, "/sparse", FS_REGULAR), 0);
+	fd = fs_open(fs, "/sparse");
+	ASSERT_GE(fd, 0);
+	memset(data.data(), 0x11, chunk);
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), BLOCK_SIZE_BYTES, far), (ssize_t) BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), far + (off_t) BLOCK_SIZE_BYTES);
+	for (off_t pos = 0; pos < far; pos += 37 * chunk) {
+		ASSERT_EQ(fs_pread(fs, fd, check.data(), chunk, pos), (ssize_t) chunk);
+		ASSERT_EQ(memcmp(check.data(), zeros.data(), chunk), 0);
+	}
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), BLOCK_SIZE_BYTES, far), (ssize_t) BLOCK_SIZE_BYTES);
+	ASSERT_EQ(memcmp(check.data(), data.data(), BLOCK_SIZE_BYTES), 0);
+
+	// SPARSE 2
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), 100, far + 2 * BLOCK_SIZE_BYTES + 1000), 100);
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), 100, far + 5 * BLOCK_SIZE_BYTES + 1000), 100);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), 4 * BLOCK_SIZE_BYTES, far + BLOCK_SIZE_BYTES), (ssize_t) (4 * BLOCK_SIZE_BYTES));
+	ASSERT_EQ(memcmp(check.data(), zeros.data(), BLOCK_SIZE_BYTES + 1000), 0);
+	ASSERT_EQ(memcmp(check.data() + BLOCK_SIZE_BYTES + 1000, data.data(), 100), 0);
+	ASSERT_EQ(memcmp(check.data() + BLOCK_SIZE_BYTES + 1100, zeros.data(), 3 * BLOCK_SIZE_BYTES - 1100), 0);
+
+	// SPARSE 3
+	memset(data.data(), 0x22, chunk);
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), 10, 3 * BLOCK_SIZE_BYTES + 5), 10);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), 2 * BLOCK_SIZE_BYTES, 2 * BLOCK_SIZE_BYTES + 5), (ssize_t) (2 * BLOCK_SIZE_BYTES));
+	ASSERT_EQ(memcmp(check.data(), zeros.data(), BLOCK_SIZE_BYTES), 0);
+	ASSERT_EQ(memcmp(check.data() + BLOCK_SIZE_BYTES, data.data(), 10), 0);
+	ASSERT_EQ(memcmp(check.data() + BLOCK_SIZE_BYTES + 10, zeros.data(), BLOCK_SIZE_BYTES - 10), 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), far + (off_t) (5 * BLOCK_SIZE_BYTES + 1100));
+
+	// SPARSE 4
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), 10, (6 + 512 + 700) * BLOCK_SIZE_BYTES), 10);
+	ASSERT_EQ(fs_seek(fs, fd, 3 * BLOCK_SIZE_BYTES, FS_SEEK_SET), (off_t) (3 * BLOCK_SIZE_BYTES));
+	for (off_t pos = 3 * BLOCK_SIZE_BYTES; pos < (off_t) ((6 + 512 + 768) * BLOCK_SIZE_BYTES); pos += chunk) {
+		ASSERT_EQ(fs_read(fs, fd, check.data(), chunk), (ssize_t) chunk);
+		for (size_t i = 0; i < chunk; ++i) {
+			const size_t off = pos + i;
+			const bool written = (off >= 3 * BLOCK_SIZE_BYTES + 5 && off < 3 * BLOCK_SIZE_BYTES + 15) ||
+				(off >= (6 + 512 + 700) * BLOCK_SIZE_BYTES && off < (6 + 512 + 700) * BLOCK_SIZE_BYTES + 10);
+			ASSERT_EQ(check[i], written ? 0x22 : 0);
+		}
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// SPARSE 5
+	char path[16];
+	for (int i = 0; i < 100; ++i) {
+		snprintf(path, sizeof(path), "/s%d", i);
+		ASSERT_EQ(fs_create(fs, path, FS_REGULAR), 0);
+		fd = fs_open(fs, path);
+		ASSERT_GE(fd, 0);
+		for (off_t pos = 0; pos < far; pos += (off_t) 50 << 20) {
+			ASSERT_EQ(fs_pwrite(fs, fd, data.data(), 10, pos + i), 10);
+		}
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	ASSERT_EQ(fs_create(fs, "/dense", FS_REGULAR), 0);
+	fd = fs_open(fs, "/dense");
+	ASSERT_GE(fd, 0);
+	for (int i = 0; i < 480; ++i) {
+		ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	fs_unmount(fs);
+}
+
+/*
+   (fs_format_map, extent mapped files)
+   1. Normal, large sequential file, read back with fs_read and fs_pread
+   2. Normal, fs_pwrite past EOF leaves a hole
+   3. Normal, two files written a block at a time in turn, thousands of extents, the tree goes several levels deep
+   4. Normal, the map survives fs_mount, old and new files read back
+   5. Normal, removing everything frees the extents and the tree nodes
+   6. Error, bad path or map
+   7. Error, mounting an image whose root inode is not an allocated directory
+ */
+TEST(v_tests, extent_map)
+{
+	const char *test_fname = "v_tests.FS";
+	FS *fs = fs_format_map(test_fname, FS_MAP_EXTENTS);
+	ASSERT_NE(fs, nullptr);
+	const size_t chunk = BLOCK_SIZE_BYTES * 64;
+	vector<uint8_t> data(chunk);
+	vector<uint8_t> check(chunk);
+
+	// EXTENT 1
+	ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/big");
+	ASSERT_GE(fd, 0);
+	for (int i = 0; i < 800; ++i) {
+		memset(data.data(), i, chunk);
+		ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+	for (int i = 0; i < 800; ++i) {
+		ASSERT_EQ(fs_read(fs, fd, check.data(), chunk), (ssize_t) chunk);
+		memset(data.data(), i, chunk);
+		ASSERT_EQ(memcmp(data.data(), check.data(), chunk), 0);
+	}
+	ASSERT_EQ(fs_read(fs, fd, check.data(), chunk), 0);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), 10, 799 * chunk - 5), 10);
+	ASSERT_EQ(check[4], 798 & 0xFF);
+	ASSERT_EQ(check[5], 799 & 0xFF);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// EXTENT 2
+	ASSERT_EQ(fs_create(fs, "/sparse", FS_REGULAR), 0);
+	fd = fs_open(fs, "/sparse");
+	ASSERT_GE(fd, 0);
+	memset(data.data(), 0x33, chunk);
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), 100, 10 * BLOCK_SIZE_BYTES + 50), 100);
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), 100, 5), 100);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), 11 * BLOCK_SIZE_BYTES, 0), (ssize_t) (10 * BLOCK_SIZE_BYTES + 150));
+	for (size_t i = 0; i < 10 * BLOCK_SIZE_BYTES + 150; ++i) {
+		const bool written = (i >= 5 && i < 105) || i >= 10 * BLOCK_SIZE_BYTES + 50;
+		ASSERT_EQ(check[i], written ? 0x33 : 0);
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// EXTENT 3
+	const uint32_t blocks = 1500;
+	ASSERT_EQ(fs_create(fs, "/even", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/odd", FS_REGULAR), 0);
+	int fds[2] = {fs_open(fs, "/even"), fs_open(fs, "/odd")};
+	ASSERT_GE(fds[0], 0);
+	ASSERT_GE(fds[1], 0);
+	for (uint32_t i = 0; i < 2 * blocks; ++i) {
+		memset(data.data(), i & 0xFF, BLOCK_SIZE_BYTES);
+		memcpy(data.data(), &i, sizeof(i));
+		ASSERT_EQ(fs_write(fs, fds[i % 2], data.data(), BLOCK_SIZE_BYTES), (ssize_t) BLOCK_SIZE_BYTES);
+	}
+	for (uint32_t i = 0; i < 2 * blocks; i += 7) {
+		ASSERT_EQ(fs_pread(fs, fds[i % 2], check.data(), BLOCK_SIZE_BYTES, (i / 2) * BLOCK_SIZE_BYTES), (ssize_t) BLOCK_SIZE_BYTES);
+		uint32_t stored;
+		memcpy(&stored, check.data(), sizeof(stored));
+		ASSERT_EQ(stored, i);
+		ASSERT_EQ(check[BLOCK_SIZE_BYTES - 1], i & 0xFF);
+	}
+	ASSERT_EQ(fs_close(fs, fds[0]), 0);
+	ASSERT_EQ(fs_close(fs, fds[1]), 0);
+
+	// EXTENT 4
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/odd");
+	ASSERT_GE(fd, 0);
+	for (uint32_t i = 1; i < 2 * blocks; i += 2) {
+		ASSERT_EQ(fs_read(fs, fd, check.data(), BLOCK_SIZE_BYTES), (ssize_t) BLOCK_SIZE_BYTES);
+		uint32_t stored;
+		memcpy(&stored, check.data(), sizeof(stored));
+		ASSERT_EQ(stored, i);
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_create(fs, "/after", FS_REGULAR), 0);
+	fd = fs_open(fs, "/after");
+	ASSERT_GE(fd, 0);
+	memset(data.data(), 0x44, chunk);
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), chunk, 3 * chunk), (ssize_t) chunk);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), chunk, 3 * chunk), (ssize_t) chunk);
+	ASSERT_EQ(memcmp(data.data(), check.data(), chunk), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// EXTENT 5
+	ASSERT_EQ(fs_remove(fs, "/big"), 0);
+	ASSERT_EQ(fs_remove(fs, "/sparse"), 0);
+	ASSERT_EQ(fs_remove(fs, "/even"), 0);
+	ASSERT_EQ(fs_remove(fs, "/odd"), 0);
+	ASSERT_EQ(fs_remove(fs, "/after"), 0);
+	ASSERT_EQ(fs_create(fs, "/full", FS_REGULAR), 0);
+	fd = fs_open(fs, "/full");
+	ASSERT_GE(fd, 0);
+	for (int i = 0; i < 1000; ++i) {
+		ASSERT_EQ(fs_write(fs, fd, data.data(), chunk), (ssize_t) chunk);
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// EXTENT 6
+	ASSERT_EQ(fs_format_map(NULL, FS_MAP_EXTENTS), nullptr);
+	ASSERT_EQ(fs_format_map("", FS_MAP_EXTENTS), nullptr);
+	ASSERT_EQ(fs_format_map(test_fname, (map_t) 7), nullptr);
+
+	// EXTENT 7
+	// the root inode's type is byte 22 of the inode table, its allocation bit is in the first byte of the inode bitmap
+	fs = fs_format_map(test_fname, FS_MAP_EXTENTS);
+	ASSERT_NE(fs, nullptr);
+	fs_unmount(fs);
+	FILE *image = fopen(test_fname, "r+b");
+	ASSERT_NE(image, nullptr);
+	ASSERT_EQ(fseek(image, (long) (BLOCK_SIZE_BYTES + 22), SEEK_SET), 0);
+	ASSERT_EQ(fputc('r', image), 'r');
+	fflush(image);
+	ASSERT_EQ(fs_mount(test_fname), nullptr);
+	ASSERT_EQ(fseek(image, (long) (BLOCK_SIZE_BYTES + 22), SEEK_SET), 0);
+	ASSERT_EQ(fputc('d', image), 'd');
+	ASSERT_EQ(fseek(image, 0, SEEK_SET), 0);
+	const int allocated = fgetc(image);
+	ASSERT_NE(allocated, 0);
+	ASSERT_EQ(fseek(image, 0, SEEK_SET), 0);
+	ASSERT_EQ(fputc(0, image), 0);
+	fflush(image);
+	ASSERT_EQ(fs_mount(test_fname), nullptr);
+	ASSERT_EQ(fseek(image, 0, SEEK_SET), 0);
+	ASSERT_EQ(fputc(allocated, image), allocated);
+	fclose(image);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fs_unmount(fs);
+}
+
+// bytes written to a new file before the FS runs out of blocks
+static size_t fill_until_full(FS *fs, const char *path)
+{
+	const size_t chunk = BLOCK_SIZE_BYTES * 64;
+	vector<uint8_t> data(chunk, 0x77);
+	size_t filled = 0;
+	if (fs_create(fs, path, FS_REGULAR) != 0) {
+		return 0;
+	}
+	int fd = fs_open(fs, path);
+	ssize_t written;
+	while ((written = fs_write(fs, fd, data.data(), chunk)) > 0) {
+		filled += written;
+	}
+	fs_close(fs, fd);
+	return filled;
+}
+
+/*
+   (inline data, files of up to 32 bytes live in the inode)
+   1. Normal, a couple hundred tiny files take no data blocks
+   2. Normal, read back whole and in part, a gap inside the inline data reads as zeros
+   3. Normal, growing past 32 bytes moves the data out to blocks, with block pointers and with extents
+   4. Normal, inline data survives fs_mount
+   5. Normal, removing a tiny file and reusing its inode
+   6. Normal, the inode fields keep the offsets of images written before inline data (mapType at 21, fileType at 22,
+      fileSize at 32, block pointers at 48), the data is split around them
+ */
+TEST(w_tests, inline_data)
+{
+	const char *test_fname = "w_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	char path[32];
+	char text[64];
+	char check[64];
+
+	// INLINE 1
+	const size_t empty = fill_until_full(fs, "/filler");
+	ASSERT_GT(empty, (size_t) 250 << 20);
+	ASSERT_EQ(fs_remove(fs, "/filler"), 0);
+	reclaim_drain(fs);
+	for (int i = 0; i < 200; ++i) {
+		snprintf(path, sizeof(path), "/stub%d", i);
+		ASSERT_EQ(fs_create(fs, path, FS_REGULAR), 0);
+		int fd = fs_open(fs, path);
+		ASSERT_GE(fd, 0);
+		const int len = snprintf(text, sizeof(text), "marker %d, 32 bytes at most", i);
+		ASSERT_LE(len, 32);
+		ASSERT_EQ(fs_write(fs, fd, text, len), len);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	// only the root directory grew
+	ASSERT_GT(fill_until_full(fs, "/filler"), empty - 16 * BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_remove(fs, "/filler"), 0);
+
+	// INLINE 2
+	for (int i = 0; i < 200; i += 13) {
+		snprintf(path, sizeof(path), "/stub%d", i);
+		int fd = fs_open(fs, path);
+		ASSERT_GE(fd, 0);
+		const int len = snprintf(text, sizeof(text), "marker %d, 32 bytes at most", i);
+		ASSERT_EQ(fs_read(fs, fd, check, sizeof(check)), len);
+		ASSERT_EQ(memcmp(text, check, len), 0);
+		ASSERT_EQ(fs_pread(fs, fd, check, 5, 7), 5);
+		ASSERT_EQ(memcmp(text + 7, check, 5), 0);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	ASSERT_EQ(fs_create(fs, "/gap", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/gap");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_pwrite(fs, fd, "tail", 4, 20), 4);
+	ASSERT_EQ(fs_read(fs, fd, check, sizeof(check)), 24);
+	for (int i = 0; i < 20; ++i) {
+		ASSERT_EQ(check[i], 0);
+	}
+	ASSERT_EQ(memcmp(check + 20, "tail", 4), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// INLINE 3
+	for (int map = 0; map < 2; ++map) {
+		FS *grow_fs = map == 0 ? fs : fs_format_map("w_tests_extents.FS", FS_MAP_EXTENTS);
+		ASSERT_NE(grow_fs, nullptr);
+		ASSERT_EQ(fs_create(grow_fs, "/grow", FS_REGULAR), 0);
+		fd = fs_open(grow_fs, "/grow");
+		ASSERT_GE(fd, 0);
+		vector<uint8_t> data(10000);
+		for (size_t i = 0; i < data.size(); ++i) {
+			data[i] = i * 7;
+		}
+		ASSERT_EQ(fs_write(grow_fs, fd, data.data(), 20), 20);
+		ASSERT_EQ(fs_write(grow_fs, fd, data.data() + 20, 20), 20);
+		ASSERT_EQ(fs_write(grow_fs, fd, data.data() + 40, data.size() - 40), (ssize_t) data.size() - 40);
+		vector<uint8_t> back(data.size());
+		ASSERT_EQ(fs_pread(grow_fs, fd, back.data(), back.size(), 0), (ssize_t) back.size());
+		ASSERT_EQ(memcmp(data.data(), back.data(), data.size()), 0);
+		ASSERT_EQ(fs_close(grow_fs, fd), 0);
+		if (map == 1) {
+			fs_unmount(grow_fs);
+		}
+	}
+
+	// INLINE 4
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/stub199");
+	ASSERT_GE(fd, 0);
+	const int len = snprintf(text, sizeof(text), "marker %d, 32 bytes at most", 199);
+	ASSERT_EQ(fs_read(fs, fd, check, sizeof(check)), len);
+	ASSERT_EQ(memcmp(text, check, len), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// INLINE 5
+	ASSERT_EQ(fs_remove(fs, "/stub199"), 0);
+	reclaim_drain(fs);
+	ASSERT_EQ(fs_create(fs, "/fresh", FS_REGULAR), 0);
+	fd = fs_open(fs, "/fresh");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, sizeof(check)), 0);
+	ASSERT_EQ(fs_pwrite(fs, fd, "x", 1, 31), 1);
+	ASSERT_EQ(fs_pread(fs, fd, check, sizeof(check), 0), 32);
+	for (int i = 0; i < 31; ++i) {
+		ASSERT_EQ(check[i], 0);
+	}
+	ASSERT_EQ(check[31], 'x');
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// INLINE 6
+	const size_t fresh = resolve_path(fs, "/fresh", nullptr, nullptr);
+	ASSERT_NE(fresh, SIZE_MAX);
+	fs_unmount(fs);
+	FILE *image = fopen(test_fname, "rb");
+	ASSERT_NE(image, nullptr);
+	uint8_t raw[64];
+	ASSERT_EQ(fseek(image, (long) (BLOCK_SIZE_BYTES + fresh * sizeof(raw)), SEEK_SET), 0);
+	ASSERT_EQ(fread(raw, 1, sizeof(raw), image), sizeof(raw));
+	fclose(image);
+	ASSERT_EQ(raw[21], 'i');
+	ASSERT_EQ(raw[22], 'r');
+	size_t size;
+	memcpy(&size, raw + 32, sizeof(size));
+	ASSERT_EQ(size, (size_t) 32);
+	ASSERT_EQ(raw[63], 'x');
+}
+
+/*
+   (several threads on one FS)
+   1. Normal, threads writing and reading back files of their own, each in a directory of its own
+   2. Normal, threads writing disjoint ranges of one shared file through descriptors of their own
+   3. Normal, threads creating, moving, linking and removing names in one shared directory,
+      with fs_stat_many, fs_get_dir and fs_sync going on alongside. Racing creates of one name, one wins
+   4. Normal, nothing was lost: the survivors are all there, every inode and block comes back
+ */
+TEST(x_tests, threads)
+{
+	const char *test_fname = "x_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	const int n_threads = 8;
+	std::atomic<int> failures(0);
+
+	// THREADS 1
+	std::vector<std::thread> threads;
+	for (int t = 0; t < n_threads; ++t) {
+		threads.emplace_back([fs, t, &failures]() {
+			char path[32];
+			snprintf(path, sizeof(path), "/dir%d", t);
+			if (fs_create(fs, path, FS_DIRECTORY) != 0) {
+				failures++;
+				return;
+			}
+			vector<uint8_t> data(BLOCK_SIZE_BYTES * 3 + 100);
+			vector<uint8_t> back(data.size());
+			for (int f = 0; f < 4; ++f) {
+				snprintf(path, sizeof(path), "/dir%d/file%d", t, f);
+				for (size_t i = 0; i < data.size(); ++i) {
+					data[i] = (uint8_t) (i * 31 + t * 7 + f);
+				}
+				int fd = fs_create(fs, path, FS_REGULAR) == 0 ? fs_open(fs, path) : -1;
+				bool ok = fd >= 0;
+				for (int round = 0; ok && round < 20; ++round) {
+					ok = fs_write(fs, fd, data.data(), data.size()) == (ssize_t) data.size() &&
+						fs_pread(fs, fd, back.data(), back.size(), round * data.size()) == (ssize_t) back.size() &&
+						memcmp(data.data(), back.data(), data.size()) == 0;
+				}
+				if (!ok || fs_close(fs, fd) != 0) {
+					failures++;
+				}
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	threads.clear();
+	ASSERT_EQ(failures.load(), 0);
+
+	// THREADS 2
+	const size_t slice = BLOCK_SIZE_BYTES * 2 + 512;
+	ASSERT_EQ(fs_create(fs, "/shared", FS_REGULAR), 0);
+	for (int t = 0; t < n_threads; ++t) {
+		threads.emplace_back([fs, t, slice, &failures]() {
+			int fd = fs_open(fs, "/shared");
+			vector<uint8_t> data(slice, (uint8_t) (0xA0 + t));
+			for (int round = 0; fd >= 0 && round < 10; ++round) {
+				const off_t offset = (off_t) (round * n_threads + t) * slice;
+				if (fs_pwrite(fs, fd, data.data(), slice, offset) != (ssize_t) slice) {
+					failures++;
+				}
+			}
+			if (fs_close(fs, fd) != 0) {
+				failures++;
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	threads.clear();
+	ASSERT_EQ(failures.load(), 0);
+	int fd = fs_open(fs, "/shared");
+	ASSERT_GE(fd, 0);
+	vector<uint8_t> back(slice);
+	for (int part = 0; part < 10 * n_threads; ++part) {
+		ASSERT_EQ(fs_read(fs, fd, back.data(), slice), (ssize_t) slice);
+		for (size_t i = 0; i < slice; ++i) {
+			ASSERT_EQ(back[i], 0xA0 + part % n_threads);
+		}
+	}
+	ASSERT_EQ(fs_read(fs, fd, back.data(), slice), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// THREADS 3
+	ASSERT_EQ(fs_create(fs, "/common", FS_DIRECTORY), 0);
+	std::atomic<bool> done(false);
+	std::atomic<int> winners(0);
+	std::thread watcher([fs, &done, &failures]() {
+		const char *const names[] = {"a0", "b0", "c0"};
+		file_stat_t stats[3];
+		while (!done) {
+			dyn_array_t *listing = fs_get_dir(fs, "/common");
+			if (listing == nullptr || fs_stat_many(fs, "/common", names, 3, stats) < 0 || fs_sync(fs) != 0) {
+				failures++;
+			}
+			dyn_array_destroy(listing);
+		}
+	});
+	for (int t = 0; t < n_threads; ++t) {
+		threads.emplace_back([fs, t, &failures, &winners]() {
+			char name[32], other[32], link[32];
+			for (int round = 0; round < 40; ++round) {
+				snprintf(name, sizeof(name), "/common/%c%d", 'a' + t, round);
+				snprintf(other, sizeof(other), "/common/%c%d_moved", 'a' + t, round);
+				snprintf(link, sizeof(link), "/dir%d/link%d", t, round);
+				int file_fd = fs_create(fs, name, FS_REGULAR) == 0 ? fs_open(fs, name) : -1;
+				if (file_fd < 0 || fs_write(fs, file_fd, name, strlen(name)) != (ssize_t) strlen(name) ||
+						fs_move(fs, name, other) != 0 || fs_link(fs, other, link) != 0 ||
+						fs_remove(fs, link) != 0 || fs_close(fs, file_fd) != 0) {
+					failures++;
+				}
+				// every other file stays, the rest go again while another thread may be looking them up
+				if (round % 2 == 1 && fs_remove(fs, other) != 0) {
+					failures++;
+				}
+				// every thread goes for the same name, only one gets it
+				snprintf(name, sizeof(name), "/common/race%d", round);
+				if (round % 4 == 0 && fs_create(fs, name, FS_REGULAR) == 0) {
+					winners++;
+				}
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	done = true;
+	watcher.join();
+	ASSERT_EQ(failures.load(), 0);
+	ASSERT_EQ(winners.load(), 10);
+
+	// THREADS 4
+	dyn_array_t *listing = fs_get_dir(fs, "/common");
+	ASSERT_NE(listing, nullptr);
+	ASSERT_EQ(dyn_array_size(listing), (size_t) n_threads * 20 + 10);
+	dyn_array_destroy(listing);
+	char path[32];
+	char text[32];
+	snprintf(path, sizeof(path), "/common/%c%d_moved", 'a' + n_threads - 1, 38);
+	fd = fs_open(fs, path);
+	ASSERT_GE(fd, 0);
+	snprintf(path, sizeof(path), "/common/%c%d", 'a' + n_threads - 1, 38);
+	ASSERT_EQ(fs_read(fs, fd, text, sizeof(text)), (ssize_t) strlen(path));
+	ASSERT_EQ(memcmp(text, path, strlen(path)), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// everything is removed, the whole FS is free again
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	for (int t = 0; t < n_threads; ++t) {
+		for (int round = 0; round < 40; round += 2) {
+			snprintf(path, sizeof(path), "/common/%c%d_moved", 'a' + t, round);
+			ASSERT_EQ(fs_remove(fs, path), 0);
+		}
+		for (int f = 0; f < 4; ++f) {
+			snprintf(path, sizeof(path), "/dir%d/file%d", t, f);
+			ASSERT_EQ(fs_remove(fs, path), 0);
+		}
+		snprintf(path, sizeof(path), "/dir%d", t);
+		ASSERT_EQ(fs_remove(fs, path), 0);
+	}
+	for (int round = 0; round < 40; round += 4) {
+		snprintf(path, sizeof(path), "/common/race%d", round);
+		ASSERT_EQ(fs_remove(fs, path), 0);
+	}
+	ASSERT_EQ(fs_remove(fs, "/common"), 0);
+	ASSERT_EQ(fs_remove(fs, "/shared"), 0);
+	reclaim_drain(fs);
+	ASSERT_EQ(fs_create_many(fs, "/", nullptr, 0, FS_REGULAR), 0);
+	ASSERT_GT(fill_until_full(fs, "/filler"), (size_t) 250 << 20);
+	fs_unmount(fs);
+}
+
+/*
+   (claiming bits and blocks from several threads without a lock)
+   1. Normal, threads claiming single bits until none are left, each bit goes to exactly one
+   2. Normal, threads claiming runs, the runs don't overlap
+   3. Normal, the same on a bitmap at an odd address, claimed a byte at a time
+   4. Normal, bits freed while others claim are all found again
+   5. Normal, threads filling the FS at once, no block ends up in two files
+   6. Normal, bitmap_ffs and bitmap_total_set while other threads claim, only bits that are set are reported
+ */
+TEST(y_tests, atomic_alloc)
+{
+	const int n_threads = 8;
+	const size_t n_bits = 65534;
+	vector<uint8_t> storage(n_bits / 8 + 16);
+
+	// ATOMIC_ALLOC 1 to 3, the aligned bitmap and the same one a byte off
+	for (int misaligned = 0; misaligned < 2; ++misaligned) {
+		bitmap_t *bitmap = misaligned ? bitmap_overlay(n_bits, storage.data() + 1) : bitmap_create(n_bits);
+		ASSERT_NE(bitmap, nullptr);
+		bitmap_reset_range(bitmap, 0, n_bits);
+		vector<vector<size_t>> claimed(n_threads);
+		vector<std::thread> threads;
+		for (int t = 0; t < n_threads; ++t) {
+			threads.emplace_back([bitmap, t, n_bits, &claimed]() {
+				size_t bit;
+				while ((bit = bitmap_claim_from(bitmap, t * n_bits / n_threads)) != SIZE_MAX) {
+					claimed[t].push_back(bit);
+				}
+			});
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		vector<int> owners(n_bits, 0);
+		for (const vector<size_t> &bits : claimed) {
+			for (size_t bit : bits) {
+				ASSERT_LT(bit, n_bits);
+				owners[bit]++;
+			}
+		}
+		ASSERT_EQ(std::count(owners.begin(), owners.end(), 1), (long) n_bits);
+		ASSERT_EQ(bitmap_total_set(bitmap), n_bits);
+		ASSERT_FALSE(bitmap_claim(bitmap, n_bits / 2));
+
+		bitmap_reset_range(bitmap, 0, n_bits);
+		threads.clear();
+		for (int t = 0; t < n_threads; ++t) {
+			claimed[t].clear();
+			threads.emplace_back([bitmap, t, &claimed]() {
+				size_t run;
+				while ((run = bitmap_claim_run(bitmap, 0, 37 + t)) != SIZE_MAX) {
+					claimed[t].push_back(run);
+				}
+			});
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		std::fill(owners.begin(), owners.end(), 0);
+		size_t run_bits = 0;
+		for (int t = 0; t < n_threads; ++t) {
+			for (size_t run : claimed[t]) {
+				for (size_t bit = run; bit < run + 37 + t; ++bit) {
+					ASSERT_EQ(owners[bit]++, 0);
+				}
+				run_bits += 37 + t;
+			}
+		}
+		ASSERT_EQ(bitmap_total_set(bitmap), run_bits);
+		ASSERT_GT(run_bits, n_bits - 45 * n_threads);
+		bitmap_destroy(bitmap);
+	}
+
+	// ATOMIC_ALLOC 4
+	bitmap_t *bitmap = bitmap_create(n_bits);
+	ASSERT_NE(bitmap, nullptr);
+	bitmap_set_range(bitmap, 0, n_bits);
+	std::atomic<size_t> found(0);
+	vector<std::thread> threads;
+	for (int t = 0; t < n_threads; ++t) {
+		threads.emplace_back([bitmap, t, n_bits, &found]() {
+			// half the threads free every eighth bit of their share, the other half claim them again
+			for (size_t bit = t / 2 * 8 + 3; bit < n_bits; bit += 8 * n_threads / 2) {
+				if (t % 2 == 0) {
+					bitmap_reset(bitmap, bit);
+				} else {
+					while (bitmap_claim_from(bitmap, bit) == SIZE_MAX) {
+						std::this_thread::yield();
+					}
+					found++;
+				}
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	ASSERT_EQ(bitmap_total_set(bitmap), n_bits);
+	ASSERT_EQ(bitmap_ffz(bitmap), SIZE_MAX);
+	bitmap_destroy(bitmap);
+
+	// ATOMIC_ALLOC 5
+	const char *test_fname = "y_tests.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	std::atomic<size_t> filled(0);
+	std::atomic<int> failures(0);
+	threads.clear();
+	for (int t = 0; t < n_threads; ++t) {
+		threads.emplace_back([fs, t, &filled, &failures]() {
+			char path[32];
+			snprintf(path, sizeof(path), "/fill%d", t);
+			vector<uint8_t> data(BLOCK_SIZE_BYTES * 16, (uint8_t) (t + 1));
+			int fd = fs_create(fs, path, FS_REGULAR) == 0 ? fs_open(fs, path) : -1;
+			if (fd < 0) {
+				failures++;
+				return;
+			}
+			ssize_t written;
+			while ((written = fs_write(fs, fd, data.data(), data.size())) > 0) {
+				filled += written;
+			}
+			fs_close(fs, fd);
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	ASSERT_EQ(failures.load(), 0);
+	ASSERT_GT(filled.load(), (size_t) 250 << 20);
+	for (int t = 0; t < n_threads; ++t) {
+		char path[32];
+		snprintf(path, sizeof(path), "/fill%d", t);
+		int fd = fs_open(fs, path);
+		ASSERT_GE(fd, 0);
+		vector<uint8_t> back(BLOCK_SIZE_BYTES * 16);
+		ssize_t got;
+		while ((got = fs_read(fs, fd, back.data(), back.size())) > 0) {
+			ASSERT_EQ(std::count(back.begin(), back.begin() + got, (uint8_t) (t + 1)), got);
+		}
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	fs_unmount(fs);
+
+	// ATOMIC_ALLOC 6
+	bitmap = bitmap_create(n_bits);
+	ASSERT_NE(bitmap, nullptr);
+	bitmap_reset_range(bitmap, 0, n_bits);
+	std::atomic<bool> claiming(true);
+	threads.clear();
+	for (int t = 0; t < n_threads; ++t) {
+		threads.emplace_back([bitmap, t, n_bits]() {
+			// from the back, so the first set bit keeps moving down
+			for (size_t bit = n_bits - 1 - t; bit < n_bits; bit -= n_threads) {
+				bitmap_claim(bitmap, bit);
+			}
+		});
+	}
+	std::thread watcher([bitmap, n_bits, &claiming]() {
+		size_t last = SIZE_MAX;
+		while (claiming) {
+			size_t first = bitmap_ffs(bitmap);
+			ASSERT_TRUE(first == SIZE_MAX || (first < n_bits && first <= last && bitmap_test(bitmap, first)));
+			last = first;
+			ASSERT_LE(bitmap_total_set(bitmap), n_bits);
+		}
+	});
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	claiming = false;
+	watcher.join();
+	ASSERT_EQ(bitmap_ffs(bitmap), (size_t) 0);
+	ASSERT_EQ(bitmap_total_set(bitmap), n_bits);
+	bitmap_destroy(bitmap);
+}
+
+/*
+   (per-thread magazines of blocks in the block store)
+   1. Normal, a thread's blocks come from a run claimed at once, in order, the rest of the run still counts as free
+   2. Normal, a released block is the next one handed out again
+   3. Normal, a thread's magazine goes back to the free block map when it exits
+   4. Normal, a block waiting in a magazine can still be requested
+   5. Normal, threads allocating until the store is full get every block once, magazines of the others included
+   6. Normal, destroying the store returns the magazines, nothing leaks into the file
+   7. Error, a block released twice from two threads is still handed out once
+   8. Normal, block_store_allocate takes a released block back out of the magazine
+   9. Normal, two files allocated in turn on one thread, each with the block after its last as the hint, stay contiguous
+ */
+TEST(z_tests, magazines)
+{
+	const char *test_fname = "z_tests.bs";
+	block_store_t *bs = block_store_create(test_fname);
+	ASSERT_NE(bs, nullptr);
+	bitmap_t *fbm = block_store_get_bm(bs);
+	const size_t base = block_store_get_used_blocks(bs);
+
+	// MAGAZINES 1
+	size_t first = SIZE_MAX;
+	std::thread([bs, base, &first]() {
+		first = block_store_allocate_near(bs, SIZE_MAX);
+		for (size_t i = 1; i < 10; ++i) {
+			ASSERT_EQ(block_store_allocate_near(bs, SIZE_MAX), first + i);
+		}
+		ASSERT_EQ(block_store_get_used_blocks(bs), base + 10);
+		ASSERT_EQ(block_store_get_free_blocks(bs), BLOCK_STORE_AVAIL_BLOCKS - base - 10);
+		ASSERT_EQ(bitmap_total_set(block_store_get_bm(bs)), base + 64);
+
+		// MAGAZINES 2
+		block_store_release(bs, first + 3);
+		ASSERT_EQ(block_store_get_used_blocks(bs), base + 9);
+		ASSERT_EQ(block_store_allocate_near(bs, SIZE_MAX), first + 3);
+		ASSERT_EQ(block_store_allocate_near(bs, first + 10), first + 10);
+	}).join();
+	ASSERT_NE(first, SIZE_MAX);
+
+	// MAGAZINES 3
+	ASSERT_EQ(bitmap_total_set(fbm), base + 11);
+	ASSERT_EQ(block_store_get_used_blocks(bs), base + 11);
+	ASSERT_FALSE(bitmap_test(fbm, first + 11));
+
+	// MAGAZINES 4
+	size_t held = block_store_allocate_near(bs, SIZE_MAX);
+	ASSERT_NE(held, SIZE_MAX);
+	ASSERT_TRUE(block_store_test(bs, held + 1));
+	ASSERT_TRUE(block_store_request(bs, held + 1));
+	ASSERT_FALSE(block_store_request(bs, held + 1));
+	ASSERT_EQ(block_store_get_used_blocks(bs), base + 13);
+
+	// MAGAZINES 5
+	const int n_threads = 8;
+	vector<vector<size_t>> allocated(n_threads);
+	vector<std::thread> threads;
+	for (int t = 0; t < n_threads; ++t) {
+		threads.emplace_back([bs, t, &allocated]() {
+			size_t id;
+			for (size_t calls = 1; (id = block_store_allocate_near(bs, SIZE_MAX)) != SIZE_MAX; ++calls) {
+				allocated[t].push_back(id);
+				if (calls % 100 == 0) {
+					block_store_release(bs, id);
+					allocated[t].pop_back();
+				}
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	vector<int> owners(BLOCK_STORE_AVAIL_BLOCKS, 0);
+	size_t handed_out = 0;
+	for (const vector<size_t> &ids : allocated) {
+		for (size_t id : ids) {
+			ASSERT_EQ(owners[id]++, 0);
+		}
+		handed_out += ids.size();
+	}
+	ASSERT_EQ(handed_out, BLOCK_STORE_AVAIL_BLOCKS - base - 13);
+	ASSERT_EQ(block_store_get_free_blocks(bs), (size_t) 0);
+
+	// MAGAZINES 6
+	for (const vector<size_t> &ids : allocated) {
+		for (size_t id : ids) {
+			block_store_release(bs, id);
+		}
+	}
+	held = block_store_allocate_near(bs, SIZE_MAX);
+	ASSERT_NE(held, SIZE_MAX);
+	block_store_destroy(bs);
+	bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	ASSERT_EQ(block_store_get_used_blocks(bs), base + 14);
+	ASSERT_TRUE(block_store_test(bs, held));
+
+	// MAGAZINES 7
+	const size_t twice = block_store_allocate_near(bs, SIZE_MAX);
+	ASSERT_NE(twice, SIZE_MAX);
+	block_store_release(bs, twice);
+	size_t other = SIZE_MAX;
+	std::thread([bs, twice, &other]() {
+		block_store_release(bs, twice);
+		other = block_store_allocate_near(bs, twice);
+	}).join();
+	ASSERT_NE(other, twice);
+	ASSERT_EQ(block_store_allocate_near(bs, twice), twice);
+
+	// MAGAZINES 8
+	block_store_release(bs, twice);
+	ASSERT_EQ(block_store_allocate(bs), twice);
+	block_store_destroy(bs);
+
+	// MAGAZINES 9
+	bs = block_store_create(test_fname);
+	ASSERT_NE(bs, nullptr);
+	size_t file_a = block_store_allocate_near(bs, 1000);
+	size_t file_b = block_store_allocate_near(bs, 30000);
+	ASSERT_EQ(file_a, (size_t) 1000);
+	ASSERT_EQ(file_b, (size_t) 30000);
+	for (size_t i = 1; i < 3 * 64; ++i) {
+		file_a = block_store_allocate_near(bs, file_a + 1);
+		file_b = block_store_allocate_near(bs, file_b + 1);
+		ASSERT_EQ(file_a, 1000 + i);
+		ASSERT_EQ(file_b, 30000 + i);
+	}
+	block_store_destroy(bs);
+}
+
+/*
+   (metadata journal)
+   1. Normal, what fs_sync committed comes back after the inode bitmap, the inode table and the free block map were lost
+   2. Normal, a call made after the last commit is rolled back as a whole
+   3. Normal, a replayed FS mounts again as it was, with nothing left to replay
+   4. Normal, a damaged transaction isn't replayed, the image is left as it is
+   5. Normal, a cleanly unmounted FS doesn't need its journal
+   6. Normal, blocks waiting in the magazines at a commit are free in the image it leaves, a crash leaks none
+ */
+TEST(za_tests, journal)
+{
+	const char *test_fname = "za_tests.FS";
+	const char *crash_fname = "za_tests_crash.FS";
+	// overwrite blocks of an image, the way a crash can leave them
+	auto scribble = [](const char *fname, size_t start, size_t count, int value) {
+		FILE *image = fopen(fname, "r+b");
+		ASSERT_NE(image, nullptr);
+		vector<uint8_t> block(BLOCK_SIZE_BYTES, (uint8_t) value);
+		for (size_t i = start; i < start + count; ++i) {
+			if (value < 0) {
+				// flip one byte, the rest of the block stays
+				ASSERT_EQ(fseek(image, (long) (i * BLOCK_SIZE_BYTES + 100), SEEK_SET), 0);
+				int byte = fgetc(image);
+				ASSERT_EQ(fseek(image, (long) (i * BLOCK_SIZE_BYTES + 100), SEEK_SET), 0);
+				ASSERT_NE(fputc(byte ^ 0xFF, image), EOF);
+			} else {
+				ASSERT_EQ(fseek(image, (long) (i * BLOCK_SIZE_BYTES), SEEK_SET), 0);
+				ASSERT_EQ(fwrite(block.data(), 1, block.size(), image), block.size());
+			}
+		}
+		fclose(image);
+	};
+	auto lose_metadata = [&scribble](const char *fname) {
+		scribble(fname, 0, FS_JOURNAL_START, 0);
+		scribble(fname, BLOCK_STORE_AVAIL_BLOCKS, BLOCK_STORE_NUM_BLOCKS - BLOCK_STORE_AVAIL_BLOCKS, 0);
+	};
+	auto entries = [](FS *fs, const char *path) {
+		dyn_array_t *records = fs_get_dir(fs, path);
+		size_t count = records == nullptr ? SIZE_MAX : dyn_array_size(records);
+		if (records != nullptr) {
+			dyn_array_destroy(records);
+		}
+		return count;
+	};
+
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	const size_t n_files = 40;
+	for (size_t i = 0; i < n_files; ++i) {
+		char path[32];
+		snprintf(path, sizeof(path), "/dir/file%zu", i);
+		ASSERT_EQ(fs_create(fs, path, FS_REGULAR), 0);
+	}
+	vector<uint8_t> data(BLOCK_SIZE_BYTES * 3, 0x5A);
+	int fd = fs_open(fs, "/dir/file0");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_sync(fs), 0);
+
+	// JOURNAL 1
+	// the journal holds the inode table, the inode bitmap and the free block map as of the commit
+	ASSERT_EQ(fs_create(fs, "/late", FS_REGULAR), 0);
+	ASSERT_EQ(system("cp za_tests.FS za_tests_crash.FS"), 0);
+	lose_metadata(crash_fname);
+	FS *crashed = fs_mount(crash_fname);
+	ASSERT_NE(crashed, nullptr);
+	ASSERT_EQ(entries(crashed, "/dir"), n_files);
+	fd = fs_open(crashed, "/dir/file0");
+	ASSERT_GE(fd, 0);
+	vector<uint8_t> back(data.size() + 1);
+	ASSERT_EQ(fs_read(crashed, fd, back.data(), back.size()), (ssize_t) data.size());
+	ASSERT_TRUE(std::equal(data.begin(), data.end(), back.begin()));
+	ASSERT_EQ(fs_close(crashed, fd), 0);
+
+	// JOURNAL 2
+	ASSERT_EQ(entries(crashed, "/"), (size_t) 1);
+	ASSERT_LT(fs_open(crashed, "/late"), 0);
+	ASSERT_EQ(fs_create(crashed, "/late", FS_REGULAR), 0);
+	// the free block map came back too, nothing the files hold is handed out again
+	fd = fs_open(crashed, "/late");
+	ASSERT_GE(fd, 0);
+	vector<uint8_t> other(data.size(), 0xA5);
+	ASSERT_EQ(fs_write(crashed, fd, other.data(), other.size()), (ssize_t) other.size());
+	ASSERT_EQ(fs_close(crashed, fd), 0);
+	fd = fs_open(crashed, "/dir/file0");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(crashed, fd, back.data(), back.size()), (ssize_t) data.size());
+	ASSERT_TRUE(std::equal(data.begin(), data.end(), back.begin()));
+	ASSERT_EQ(fs_close(crashed, fd), 0);
+	fs_unmount(crashed);
+
+	// JOURNAL 3
+	crashed = fs_mount(crash_fname);
+	ASSERT_NE(crashed, nullptr);
+	ASSERT_EQ(entries(crashed, "/"), (size_t) 2);
+	ASSERT_EQ(entries(crashed, "/dir"), n_files);
+	fs_unmount(crashed);
+
+	// JOURNAL 4
+	// the home blocks have the removal, the journal only the files from before it
+	ASSERT_EQ(fs_remove(fs, "/dir/file1"), 0);
+	ASSERT_EQ(fs_sync(fs), 0);
+	ASSERT_EQ(system("cp za_tests.FS za_tests_crash.FS"), 0);
+	scribble(crash_fname, FS_JOURNAL_START + 2, FS_JOURNAL_BLOCKS - 2, -1);
+	crashed = fs_mount(crash_fname);
+	ASSERT_NE(crashed, nullptr);
+	ASSERT_EQ(entries(crashed, "/dir"), n_files - 1);
+	ASSERT_LT(fs_open(crashed, "/dir/file1"), 0);
+	fs_unmount(crashed);
+
+	// JOURNAL 5
+	fs_unmount(fs);
+	ASSERT_EQ(system("cp za_tests.FS za_tests_crash.FS"), 0);
+	scribble(crash_fname, FS_JOURNAL_START + 1, FS_JOURNAL_BLOCKS - 1, 0);
+	crashed = fs_mount(crash_fname);
+	ASSERT_NE(crashed, nullptr);
+	ASSERT_EQ(entries(crashed, "/"), (size_t) 2);
+	ASSERT_EQ(entries(crashed, "/dir"), n_files - 1);
+	fs_unmount(crashed);
+
+	// JOURNAL 6
+	// the directory blocks come out of a magazine, the rest of its run waits there
+	fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/file", FS_REGULAR), 0);
+	ASSERT_EQ(fs_sync(fs), 0);
+	ASSERT_EQ(system("cp za_tests.FS za_tests_crash.FS"), 0);
+	fs_unmount(fs);
+	block_store_t *clean = block_store_open(test_fname);
+	ASSERT_NE(clean, nullptr);
+	block_store_t *leaked = block_store_open(crash_fname);
+	ASSERT_NE(leaked, nullptr);
+	ASSERT_EQ(block_store_get_used_blocks(leaked), block_store_get_used_blocks(clean));
+	block_store_destroy(leaked);
+	block_store_destroy(clean);
+}
+
+/*
+   (dirty blocks, fs_fsync)
+   1. Normal, blocks written through block_store_write, block_store_n_write and block_store_get_ptr (once marked) are synced once
+   2. Normal, only the dirty blocks inside the range are synced
+   3. Normal, block_store_sync leaves a block clean
+   4. Error, NULL store, range past the end
+   5. Error, NULL FS, fd out of range, closed fd
+   6. Normal, what fs_fsync synced comes back after the inode bitmap, the inode table and the free block map were lost
+   7. Normal, fs_fsync and fs_sync with nothing left to sync
+   8. Normal, a write through block_store_get_ptr spanning blocks counts once they are marked, all of them
+   9. Normal, an overwrite of a multi-block extent leaves every block of it dirty, fs_fsync leaves none
+ */
+TEST(zb_tests, fsync)
+{
+	const char *test_fname = "zb_tests.bs";
+	block_store_t *bs = block_store_create(test_fname);
+	ASSERT_NE(bs, nullptr);
+	uint8_t block[BLOCK_SIZE_BYTES];
+	memset(block, 0x3C, sizeof(block));
+	// whatever setting up the store wrote
+	ASSERT_NE(block_store_sync_dirty(bs, 0, BLOCK_STORE_NUM_BLOCKS), SIZE_MAX);
+
+	// DIRTY 1
+	ASSERT_EQ(block_store_write(bs, 100, block), (size_t) BLOCK_SIZE_BYTES);
+	ASSERT_EQ(block_store_n_write(bs, 101, 10, block, 20), (size_t) 20);
+	uint8_t *ptr = block_store_get_ptr(bs, 102);
+	ASSERT_NE(ptr, nullptr);
+	ptr[0] = 1;
+	block_store_mark_dirty(bs, 102, 1);
+	ASSERT_EQ(block_store_sync_dirty(bs, 0, BLOCK_STORE_NUM_BLOCKS), (size_t) 3);
+	ASSERT_EQ(block_store_sync_dirty(bs, 0, BLOCK_STORE_NUM_BLOCKS), (size_t) 0);
+
+	// DIRTY 2
+	ASSERT_EQ(block_store_write(bs, 200, block), (size_t) BLOCK_SIZE_BYTES);
+	ASSERT_EQ(block_store_write(bs, 300, block), (size_t) BLOCK_SIZE_BYTES);
+	ASSERT_EQ(block_store_sync_dirty(bs, 150, 100), (size_t) 1);
+	ASSERT_EQ(block_store_sync_dirty(bs, 150, 100), (size_t) 0);
+	ASSERT_EQ(block_store_sync_dirty(bs, 300, 1), (size_t) 1);
+
+	// DIRTY 3
+	ASSERT_EQ(block_store_write(bs, 400, block), (size_t) BLOCK_SIZE_BYTES);
+	ASSERT_TRUE(block_store_sync(bs, 390, 20));
+	ASSERT_EQ(block_store_sync_dirty(bs, 0, BLOCK_STORE_NUM_BLOCKS), (size_t) 0);
+
+	// DIRTY 4
+	ASSERT_EQ(block_store_sync_dirty(nullptr, 0, 1), SIZE_MAX);
+	ASSERT_EQ(block_store_sync_dirty(bs, BLOCK_STORE_NUM_BLOCKS, 1), SIZE_MAX);
+	ASSERT_EQ(block_store_sync_dirty(bs, 10, BLOCK_STORE_NUM_BLOCKS), SIZE_MAX);
+
+	// DIRTY 8
+	ptr = block_store_get_ptr(bs, 500);
+	ASSERT_NE(ptr, nullptr);
+	memset(ptr + 100, 0x11, BLOCK_SIZE_BYTES * 3);
+	ASSERT_EQ(block_store_sync_dirty(bs, 0, BLOCK_STORE_NUM_BLOCKS), (size_t) 0);
+	block_store_mark_dirty(bs, 500, 4);
+	ASSERT_EQ(block_store_sync_dirty(bs, 0, BLOCK_STORE_NUM_BLOCKS), (size_t) 4);
+	block_store_destroy(bs);
+
+	const char *fs_fname = "zb_tests.FS";
+	FS *fs = fs_format(fs_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	vector<uint8_t> data(BLOCK_SIZE_BYTES * 20, 0x6B);
+
+	// FSYNC 5
+	ASSERT_LT(fs_fsync(nullptr, fd), 0);
+	ASSERT_LT(fs_fsync(fs, -1), 0);
+	ASSERT_LT(fs_fsync(fs, 256), 0);
+	ASSERT_LT(fs_fsync(fs, fd + 1), 0);
+
+	// FSYNC 6
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+	ASSERT_EQ(fs_fsync(fs, fd), 0);
+	ASSERT_EQ(system("cp zb_tests.FS zb_tests_crash.FS"), 0);
+	FILE *image = fopen("zb_tests_crash.FS", "r+b");
+	ASSERT_NE(image, nullptr);
+	vector<uint8_t> zeros(BLOCK_SIZE_BYTES * FS_JOURNAL_START, 0);
+	ASSERT_EQ(fwrite(zeros.data(), 1, zeros.size(), image), zeros.size());
+	ASSERT_EQ(fseek(image, (long) BLOCK_STORE_AVAIL_BLOCKS * BLOCK_SIZE_BYTES, SEEK_SET), 0);
+	ASSERT_EQ(fwrite(zeros.data(), 1, BLOCK_SIZE_BYTES * 2, image), (size_t) BLOCK_SIZE_BYTES * 2);
+	fclose(image);
+	FS *crashed = fs_mount("zb_tests_crash.FS");
+	ASSERT_NE(crashed, nullptr);
+	int crashed_fd = fs_open(crashed, "/file");
+	ASSERT_GE(crashed_fd, 0);
+	vector<uint8_t> back(data.size() + 1);
+	ASSERT_EQ(fs_read(crashed, crashed_fd, back.data(), back.size()), (ssize_t) data.size());
+	ASSERT_TRUE(std::equal(data.begin(), data.end(), back.begin()));
+	ASSERT_EQ(fs_close(crashed, crashed_fd), 0);
+	fs_unmount(crashed);
+
+	// FSYNC 7
+	ASSERT_EQ(fs_fsync(fs, fd), 0);
+	ASSERT_EQ(fs_sync(fs), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// FSYNC 9
+	fs = fs_format_map(fs_fname, FS_MAP_EXTENTS);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/extent", FS_REGULAR), 0);
+	fd = fs_open(fs, "/extent");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+	ASSERT_EQ(fs_sync(fs), 0);
+	size_t inode_id = resolve_path(fs, "/extent", nullptr, nullptr);
+	ASSERT_NE(inode_id, SIZE_MAX);
+	auto dirty_blocks = [fs, inode_id]() {
+		inode_lock(fs, inode_id, false);
+		ssize_t synced = file_sync_blocks(fs, inode_get(fs, inode_id), false);
+		inode_unlock(fs, inode_id);
+		return synced;
+	};
+	ASSERT_EQ(dirty_blocks(), 0);
+	// one copy per extent, starting part way into the first block
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), data.size() - 200, 100), (ssize_t) data.size() - 200);
+	ASSERT_EQ(dirty_blocks(), (ssize_t) (data.size() / BLOCK_SIZE_BYTES));
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), data.size() - 200, 100), (ssize_t) data.size() - 200);
+	ASSERT_EQ(fs_fsync(fs, fd), 0);
+	ASSERT_EQ(dirty_blocks(), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
 #ifdef FS_MOVE_TESTS
 /*
    int fs_move(FS *fs, const char *src, const char *dst);